@@ -1,2 +1,3 @@
 #!/bin/bash
-g++ -ggdb src/main.cpp src/glad.c -lglfw -ldl -o window
+./embed.sh src/vert.glsl src/frag.glsl src/light.vert src/light.frag src/normal.vert src/normal.geom src/normal.frag src/bounds.vert src/cull.comp
+g++ -ggdb src/main.cpp src/shader.cpp src/shadinglod.cpp src/hotreload.cpp src/embed.cpp src/uniforms.cpp src/blocks.cpp src/clusteredlighting.cpp src/glstate.cpp src/framepacing.cpp src/framering.cpp src/renderqueue.cpp src/instancing.cpp src/geometry.cpp src/staticbatch.cpp src/vertexpulling.cpp src/gpuscene.cpp src/jobs.cpp src/culling.cpp src/depthprepass.cpp src/occlusion.cpp src/softocclusion.cpp src/bvh.cpp src/pvs.cpp src/glad.c -lglfw -ldl -lpthread -o window
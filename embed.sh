@@ -0,0 +1,30 @@
+#!/bin/bash
+# Embed files into the executable. Writes src/embedded_files.inc, compiled in by src/embed.cpp.
+# Each file becomes a constexpr char array; its content hash is computed by the compiler.
+# usage: ./embed.sh file...
+out=src/embedded_files.inc
+tmp=$(mktemp)
+
+echo "// Generated by embed.sh, do not edit." > "$tmp"
+i=0
+for f in "$@"; do
+	printf 'static constexpr char embeddedData%d[] = R"__EMBED__(' $i >> "$tmp"
+	cat "$f" >> "$tmp"
+	printf ')__EMBED__";\n' >> "$tmp"
+	i=$((i + 1))
+done
+
+echo "static constexpr EmbeddedFile embeddedFiles[] = {" >> "$tmp"
+i=0
+for f in "$@"; do
+	echo "	{\"$f\", embeddedData$i, sizeof(embeddedData$i) - 1, contentHash(embeddedData$i, sizeof(embeddedData$i) - 1)}," >> "$tmp"
+	i=$((i + 1))
+done
+echo "};" >> "$tmp"
+
+# Only touch the output when something changed, so it does not force a rebuild.
+if cmp -s "$tmp" "$out"; then
+	rm "$tmp"
+else
+	mv "$tmp" "$out"
+fi
@@ -0,0 +1,58 @@
+#include "blocks.h"
+#include "glstate.h"
+
+#include <cstring>
+
+void createUniformBlocks(UniformBlocks& blocks, FrameRing& ring) {
+	blocks.ring = &ring;
+	size_t align = ring.uniformAlignment;
+	blocks.objectStride = (sizeof(ObjectData) + align - 1) / align * align;
+}
+
+void deleteUniformBlocks(UniformBlocks& blocks) {
+	blocks = UniformBlocks();
+}
+
+int uniformBlockBinding(const char* name) {
+	if (strcmp(name, "FrameData") == 0) {
+		return FRAME_DATA_BINDING;
+	}
+	if (strcmp(name, "ObjectData") == 0) {
+		return OBJECT_DATA_BINDING;
+	}
+	return -1;
+}
+
+void updateFrameData(UniformBlocks& blocks, const FrameData& frame) {
+	blocks.frameOffset = ringUpload(*blocks.ring, &frame, sizeof(FrameData), blocks.ring->uniformAlignment);
+}
+
+void uploadObjectData(UniformBlocks& blocks, const ObjectData* objects, size_t count) {
+	if (count == 0) {
+		return;
+	}
+
+	FrameRing& ring = *blocks.ring;
+	RingAllocation allocation = ringAllocate(ring, count * blocks.objectStride, ring.uniformAlignment);
+	blocks.objectOffset = allocation.offset;
+	unsigned char* dst = static_cast<unsigned char*>(allocation.data);
+	for (size_t i = 0; i < count; ++i) {
+		if (dst) {
+			memcpy(dst + i * blocks.objectStride, &objects[i], sizeof(ObjectData));
+		} else {
+			bindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+			glBufferSubData(GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(ringBufferOffset(ring, allocation.offset + i * blocks.objectStride)),
+				sizeof(ObjectData), &objects[i]);
+		}
+	}
+}
+
+void bindObjectData(UniformBlocks& blocks, size_t index) {
+	GLintptr offset = static_cast<GLintptr>(ringBufferOffset(*blocks.ring, blocks.objectOffset + index * blocks.objectStride));
+	bindBufferRange(GL_UNIFORM_BUFFER, OBJECT_DATA_BINDING, blocks.ring->buffer, offset, sizeof(ObjectData));
+}
+
+void bindFrameData(UniformBlocks& blocks) {
+	bindBufferRange(GL_UNIFORM_BUFFER, FRAME_DATA_BINDING, blocks.ring->buffer,
+		static_cast<GLintptr>(ringBufferOffset(*blocks.ring, blocks.frameOffset)), sizeof(FrameData));
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+
+#include "framering.h"
+
+#include "../include/glad/glad.h"
+
+#include <glm/glm.hpp>
+
+// Binding points of the uniform blocks shared by all shaders. Programs get their blocks
+// assigned to these when their uniforms are reflected.
+enum UniformBlockBinding {
+	FRAME_DATA_BINDING = 0,
+	OBJECT_DATA_BINDING = 1,
+};
+
+// Same as MAX_LIGHTS in the shaders.
+const int maxFrameLights = 8;
+
+// Mirror of the std140 FrameData block. Uploaded once per frame.
+struct FrameData {
+	glm::mat4 proj;
+	glm::mat4 view;
+	// w is unused, vec3 members would still take 16 bytes under std140.
+	glm::vec4 cameraPos;
+	glm::vec4 lightPos[maxFrameLights];
+	// Turns gl_FragCoord and view depth into a cluster, see clusteredlighting.h.
+	glm::vec4 clusterScale;
+};
+
+static_assert(offsetof(FrameData, proj) == 0, "FrameData::proj does not match std140");
+static_assert(offsetof(FrameData, view) == 64, "FrameData::view does not match std140");
+static_assert(offsetof(FrameData, cameraPos) == 128, "FrameData::cameraPos does not match std140");
+static_assert(offsetof(FrameData, lightPos) == 144, "FrameData::lightPos does not match std140");
+static_assert(offsetof(FrameData, clusterScale) == 144 + 16 * maxFrameLights, "FrameData::clusterScale does not match std140");
+static_assert(sizeof(FrameData) == 160 + 16 * maxFrameLights, "FrameData size does not match std140");
+
+// Mirror of the std140 ObjectData block. The full transform is multiplied once on the CPU
+// instead of once per vertex.
+struct ObjectData {
+	glm::mat4 model;
+	glm::mat4 modelViewProj;
+};
+
+static_assert(offsetof(ObjectData, model) == 0, "ObjectData::model does not match std140");
+static_assert(offsetof(ObjectData, modelViewProj) == 64, "ObjectData::modelViewProj does not match std140");
+static_assert(sizeof(ObjectData) == 128, "ObjectData size does not match std140");
+
+// Both blocks live in the FrameRing, written afresh each frame and bound by range.
+struct UniformBlocks {
+	FrameRing* ring = nullptr;
+	// Region offsets of this frame's data, see ringBufferOffset.
+	size_t frameOffset = 0;
+	size_t objectOffset = 0;
+	// ObjectData slots are padded to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT so each can be bound on its own.
+	size_t objectStride = 0;
+};
+
+void createUniformBlocks(UniformBlocks& blocks, FrameRing& ring);
+void deleteUniformBlocks(UniformBlocks& blocks);
+// Binding point for a block name, -1 if it is not one of ours.
+int uniformBlockBinding(const char* name);
+
+void updateFrameData(UniformBlocks& blocks, const FrameData& frame);
+// Both upload into the ring, so they must come before finishFrameRing.
+// uploadObjectData writes the object data of every draw in the frame in one go, bindObjectData
+// then selects the slot used by the next draw.
+void uploadObjectData(UniformBlocks& blocks, const ObjectData* objects, size_t count);
+void bindObjectData(UniformBlocks& blocks, size_t index);
+// Binds this frame's FrameData, after finishFrameRing since the ring may have moved buffers.
+void bindFrameData(UniformBlocks& blocks);
@@ -0,0 +1,22 @@
+#version 330
+
+// Corners of the unit cube, stretched over a world space box.
+layout (location = 0) in vec3 inPos;
+
+// Same as maxFrameLights in blocks.h
+#define MAX_LIGHTS 8
+
+layout (std140) uniform FrameData {
+	mat4 proj;
+	mat4 view;
+	vec4 cameraPos;
+	vec4 lightPos[MAX_LIGHTS];
+	vec4 clusterScale;
+};
+
+uniform vec3 boundsMin;
+uniform vec3 boundsMax;
+
+void main() {
+	gl_Position = proj * view * vec4(mix(boundsMin, boundsMax, inPos), 1.0);
+}
@@ -0,0 +1,153 @@
+#include "bvh.h"
+
+#include <cfloat>
+#include <cmath>
+
+#include <algorithm>
+
+static const uint32_t maxLeafTriangles = 4;
+// Deep enough for any tree built from median splits of 32 bit triangle counts.
+static const int maxTraversalDepth = 64;
+
+struct BuildTriangle {
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+	glm::vec3 centroid;
+	uint32_t index;
+};
+
+static void buildNode(Bvh& bvh, std::vector<BuildTriangle>& build, uint32_t nodeIndex, uint32_t first, uint32_t count) {
+	glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX);
+	glm::vec3 centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+	for (uint32_t i = first; i < first + count; ++i) {
+		boundsMin = glm::min(boundsMin, build[i].boundsMin);
+		boundsMax = glm::max(boundsMax, build[i].boundsMax);
+		centroidMin = glm::min(centroidMin, build[i].centroid);
+		centroidMax = glm::max(centroidMax, build[i].centroid);
+	}
+	bvh.nodes[nodeIndex].boundsMin = boundsMin;
+	bvh.nodes[nodeIndex].boundsMax = boundsMax;
+
+	glm::vec3 spread = centroidMax - centroidMin;
+	int axis = spread.x > spread.y ? (spread.x > spread.z ? 0 : 2) : (spread.y > spread.z ? 1 : 2);
+	if (count <= maxLeafTriangles || spread[axis] <= 0.f) {
+		bvh.nodes[nodeIndex].first = first;
+		bvh.nodes[nodeIndex].count = count;
+		return;
+	}
+
+	uint32_t half = count / 2;
+	std::nth_element(build.begin() + first, build.begin() + first + half, build.begin() + first + count,
+		[axis](const BuildTriangle& lhs, const BuildTriangle& rhs) { return lhs.centroid[axis] < rhs.centroid[axis]; });
+
+	uint32_t children = static_cast<uint32_t>(bvh.nodes.size());
+	bvh.nodes.resize(bvh.nodes.size() + 2);
+	bvh.nodes[nodeIndex].first = children;
+	bvh.nodes[nodeIndex].count = 0;
+	buildNode(bvh, build, children, first, half);
+	buildNode(bvh, build, children + 1, first + half, count - half);
+}
+
+void buildBvh(Bvh& bvh, const std::vector<glm::vec3>& triangles) {
+	uint32_t count = static_cast<uint32_t>(triangles.size() / 3);
+	std::vector<BuildTriangle> build(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		const glm::vec3* v = &triangles[i * 3];
+		build[i].boundsMin = glm::min(v[0], glm::min(v[1], v[2]));
+		build[i].boundsMax = glm::max(v[0], glm::max(v[1], v[2]));
+		build[i].centroid = (v[0] + v[1] + v[2]) / 3.f;
+		build[i].index = i;
+	}
+
+	bvh.nodes.clear();
+	bvh.nodes.reserve(count > 0 ? 2 * count : 1);
+	bvh.nodes.resize(1);
+	if (count == 0) {
+		bvh.nodes[0] = {glm::vec3(0.f), glm::vec3(0.f), 0, 0};
+	} else {
+		buildNode(bvh, build, 0, 0, count);
+	}
+
+	bvh.triangles.resize(static_cast<size_t>(count) * 3);
+	for (uint32_t i = 0; i < count; ++i) {
+		for (int k = 0; k < 3; ++k) {
+			bvh.triangles[i * 3 + k] = triangles[build[i].index * 3 + k];
+		}
+	}
+}
+
+// Entry distance of the ray into the box, FLT_MAX when it misses before maxT.
+static float intersectBounds(const BvhNode& node, const glm::vec3& origin, const glm::vec3& invDirection, float maxT) {
+	float t0 = 0.f;
+	float t1 = maxT;
+	for (int axis = 0; axis < 3; ++axis) {
+		float entry = (node.boundsMin[axis] - origin[axis]) * invDirection[axis];
+		float exit = (node.boundsMax[axis] - origin[axis]) * invDirection[axis];
+		if (entry > exit) {
+			std::swap(entry, exit);
+		}
+		t0 = std::max(t0, entry);
+		t1 = std::min(t1, exit);
+	}
+	return t0 <= t1 ? t0 : FLT_MAX;
+}
+
+// Möller-Trumbore.
+static float intersectTriangle(const glm::vec3* v, const glm::vec3& origin, const glm::vec3& direction, float maxT) {
+	glm::vec3 edge1 = v[1] - v[0];
+	glm::vec3 edge2 = v[2] - v[0];
+	glm::vec3 p = glm::cross(direction, edge2);
+	float det = glm::dot(edge1, p);
+	if (std::abs(det) < 1e-12f) {
+		return maxT;
+	}
+	float invDet = 1.f / det;
+	glm::vec3 s = origin - v[0];
+	float u = glm::dot(s, p) * invDet;
+	if (u < 0.f || u > 1.f) {
+		return maxT;
+	}
+	glm::vec3 q = glm::cross(s, edge1);
+	float w = glm::dot(direction, q) * invDet;
+	if (w < 0.f || u + w > 1.f) {
+		return maxT;
+	}
+	float t = glm::dot(edge2, q) * invDet;
+	return t >= 0.f && t < maxT ? t : maxT;
+}
+
+float intersectBvh(const Bvh& bvh, const glm::vec3& origin, const glm::vec3& direction, float maxT) {
+	glm::vec3 invDirection(1.f / direction.x, 1.f / direction.y, 1.f / direction.z);
+	if (bvh.triangles.empty() || intersectBounds(bvh.nodes[0], origin, invDirection, maxT) == FLT_MAX) {
+		return maxT;
+	}
+
+	uint32_t stack[maxTraversalDepth];
+	int depth = 0;
+	stack[depth++] = 0;
+	while (depth > 0) {
+		const BvhNode& node = bvh.nodes[stack[--depth]];
+		if (node.count > 0) {
+			for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+				maxT = intersectTriangle(&bvh.triangles[i * 3], origin, direction, maxT);
+			}
+			continue;
+		}
+		// Nearer child on top so it is visited first and shortens the ray for the other one.
+		uint32_t nearChild = node.first;
+		uint32_t farChild = node.first + 1;
+		float nearT = intersectBounds(bvh.nodes[nearChild], origin, invDirection, maxT);
+		float farT = intersectBounds(bvh.nodes[farChild], origin, invDirection, maxT);
+		if (farT < nearT) {
+			std::swap(nearChild, farChild);
+			std::swap(nearT, farT);
+		}
+		if (farT != FLT_MAX) {
+			stack[depth++] = farChild;
+		}
+		if (nearT != FLT_MAX) {
+			stack[depth++] = nearChild;
+		}
+	}
+	return maxT;
+}
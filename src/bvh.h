@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Bounding volume hierarchy over world space triangles, for casting rays on the CPU. Built once
+// with median splits along the widest axis; queries only read it, so any number of threads can
+// trace at the same time.
+struct BvhNode {
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+	// A leaf holds count triangles starting at first. An inner node has count 0 and its children
+	// at first and first + 1.
+	uint32_t first;
+	uint32_t count;
+};
+
+struct Bvh {
+	std::vector<BvhNode> nodes;
+	// Three vertices per triangle, reordered so every leaf is a contiguous range.
+	std::vector<glm::vec3> triangles;
+};
+
+void buildBvh(Bvh& bvh, const std::vector<glm::vec3>& triangles);
+// Nearest hit along origin + t * direction for t in [0, maxT), maxT if nothing is hit.
+// The direction need not be normalized. Triangles are hit from both sides.
+float intersectBvh(const Bvh& bvh, const glm::vec3& origin, const glm::vec3& direction, float maxT);
@@ -0,0 +1,289 @@
+#include "clusteredlighting.h"
+#include "glstate.h"
+#include "jobs.h"
+
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CLUSTERS_X86 1
+#else
+#define CLUSTERS_X86 0
+#endif
+
+// Below this many lights the slices are not worth waking the workers for.
+static const size_t clusterThreadedLights = 256;
+
+enum ClusterBuffer {
+	CLUSTER_LIGHTS = 0,
+	CLUSTER_GRID = 1,
+	CLUSTER_INDICES = 2,
+};
+
+static const int clusterUnits[3] = {clusterLightUnit, clusterGridUnit, clusterIndexUnit};
+static const GLenum clusterFormats[3] = {GL_RGBA32F, GL_RG32UI, GL_R16UI};
+// What each buffer starts out with room for: 64 lights, the whole grid, 4096 list entries.
+static const size_t clusterInitialSizes[3] = {64 * 2 * sizeof(glm::vec4), clusterCount * 2 * sizeof(uint32_t), 4096 * sizeof(uint16_t)};
+
+void createClusteredLighting(ClusteredLighting& cl) {
+	int maxTexels = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+	cl.maxTexels = static_cast<size_t>(std::max(maxTexels, 65536));
+	glGenBuffers(3 * maxFramesInFlight, &cl.buffers[0][0]);
+	glGenTextures(3 * maxFramesInFlight, &cl.textures[0][0]);
+	for (int slot = 0; slot < maxFramesInFlight; ++slot) {
+		for (int kind = 0; kind < 3; ++kind) {
+			bindBuffer(GL_TEXTURE_BUFFER, cl.buffers[slot][kind]);
+			glBufferData(GL_TEXTURE_BUFFER, static_cast<GLsizeiptr>(clusterInitialSizes[kind]), NULL, GL_STREAM_DRAW);
+			cl.capacity[slot][kind] = clusterInitialSizes[kind];
+			bindTexture(clusterUnits[kind], GL_TEXTURE_BUFFER, cl.textures[slot][kind]);
+			glTexBuffer(GL_TEXTURE_BUFFER, clusterFormats[kind], cl.buffers[slot][kind]);
+		}
+	}
+}
+
+void deleteClusteredLighting(ClusteredLighting& cl) {
+	for (int slot = 0; slot < maxFramesInFlight; ++slot) {
+		for (int kind = 0; kind < 3; ++kind) {
+			deleteTexture(cl.textures[slot][kind]);
+			deleteBuffer(cl.buffers[slot][kind]);
+		}
+	}
+	cl = ClusteredLighting();
+}
+
+static float nearPlane(const glm::mat4& proj) {
+	return proj[3][2] / (proj[2][2] - 1.f);
+}
+
+static float farPlane(const glm::mat4& proj) {
+	return proj[3][2] / (proj[2][2] + 1.f);
+}
+
+static int sliceOf(const ClusteredLighting& cl, float depth) {
+	int slice = static_cast<int>(std::floor(std::log2(depth) * cl.scale.z + cl.scale.w));
+	return std::max(0, std::min(slice, clusterCountZ - 1));
+}
+
+static void buildClusterBounds(ClusteredLighting& cl, const glm::mat4& proj, int width, int height) {
+	float zNear = nearPlane(proj);
+	float zFar = farPlane(proj);
+	float logRatio = std::log2(zFar / zNear);
+	cl.scale = glm::vec4(static_cast<float>(clusterCountX) / static_cast<float>(width),
+		static_cast<float>(clusterCountY) / static_cast<float>(height),
+		clusterCountZ / logRatio, -clusterCountZ * std::log2(zNear) / logRatio);
+
+	cl.clusterMin.resize(clusterCount);
+	cl.clusterMax.resize(clusterCount);
+	for (int z = 0; z < clusterCountZ; ++z) {
+		float depth0 = zNear * std::pow(zFar / zNear, static_cast<float>(z) / clusterCountZ);
+		float depth1 = zNear * std::pow(zFar / zNear, static_cast<float>(z + 1) / clusterCountZ);
+		for (int y = 0; y < clusterCountY; ++y) {
+			// The tile's edges in NDC, scaled to view space at depth one.
+			float y0 = (-1.f + 2.f * static_cast<float>(y) / clusterCountY) / proj[1][1];
+			float y1 = (-1.f + 2.f * static_cast<float>(y + 1) / clusterCountY) / proj[1][1];
+			for (int x = 0; x < clusterCountX; ++x) {
+				float x0 = (-1.f + 2.f * static_cast<float>(x) / clusterCountX) / proj[0][0];
+				float x1 = (-1.f + 2.f * static_cast<float>(x + 1) / clusterCountX) / proj[0][0];
+				// The tile's frustum widens with depth, its box is spanned by the corners at both ends.
+				size_t cluster = static_cast<size_t>(x + clusterCountX * (y + clusterCountY * z));
+				cl.clusterMin[cluster] = glm::vec3(std::min(x0 * depth0, x0 * depth1), std::min(y0 * depth0, y0 * depth1), -depth1);
+				cl.clusterMax[cluster] = glm::vec3(std::max(x1 * depth0, x1 * depth1), std::max(y1 * depth0, y1 * depth1), -depth0);
+			}
+		}
+	}
+	cl.boundsProj = proj;
+	cl.boundsWidth = width;
+	cl.boundsHeight = height;
+}
+
+// A sphere reaches a box when the distance from its center to the nearest point of the box is
+// below its radius.
+static void testClusterScalar(ClusterSlice& slice, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	for (size_t i = 0; i < slice.x.size(); ++i) {
+		float dx = std::max(std::max(boundsMin.x - slice.x[i], slice.x[i] - boundsMax.x), 0.f);
+		float dy = std::max(std::max(boundsMin.y - slice.y[i], slice.y[i] - boundsMax.y), 0.f);
+		float dz = std::max(std::max(boundsMin.z - slice.z[i], slice.z[i] - boundsMax.z), 0.f);
+		if (dx * dx + dy * dy + dz * dz <= slice.range2[i]) {
+			slice.indices.push_back(slice.lights[i]);
+		}
+	}
+}
+
+#if CLUSTERS_X86
+static void testClusterSSE(ClusterSlice& slice, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	__m128 minX = _mm_set1_ps(boundsMin.x);
+	__m128 minY = _mm_set1_ps(boundsMin.y);
+	__m128 minZ = _mm_set1_ps(boundsMin.z);
+	__m128 maxX = _mm_set1_ps(boundsMax.x);
+	__m128 maxY = _mm_set1_ps(boundsMax.y);
+	__m128 maxZ = _mm_set1_ps(boundsMax.z);
+	__m128 zero = _mm_setzero_ps();
+	for (size_t i = 0; i < slice.x.size(); i += 4) {
+		__m128 x = _mm_loadu_ps(&slice.x[i]);
+		__m128 y = _mm_loadu_ps(&slice.y[i]);
+		__m128 z = _mm_loadu_ps(&slice.z[i]);
+		__m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minX, x), _mm_sub_ps(x, maxX)), zero);
+		__m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minY, y), _mm_sub_ps(y, maxY)), zero);
+		__m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minZ, z), _mm_sub_ps(z, maxZ)), zero);
+		__m128 distance2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+		int mask = _mm_movemask_ps(_mm_cmple_ps(distance2, _mm_loadu_ps(&slice.range2[i])));
+		while (mask) {
+			slice.indices.push_back(slice.lights[i + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)))]);
+			mask &= mask - 1;
+		}
+	}
+}
+#endif
+
+static void assignSlice(ClusteredLighting& cl, int z, size_t count, bool simd) {
+	ClusterSlice& slice = cl.slices[z];
+	slice.x.clear();
+	slice.y.clear();
+	slice.z.clear();
+	slice.range2.clear();
+	slice.lights.clear();
+	for (size_t i = 0; i < count; ++i) {
+		if (cl.firstSlice[i] <= z && z <= cl.lastSlice[i]) {
+			const glm::vec4& light = cl.viewLights[i];
+			slice.x.push_back(light.x);
+			slice.y.push_back(light.y);
+			slice.z.push_back(light.z);
+			slice.range2.push_back(light.w);
+			slice.lights.push_back(static_cast<uint16_t>(i));
+		}
+	}
+	// No distance is below a negative squared range.
+	while (slice.x.size() % 4 != 0) {
+		slice.x.push_back(0.f);
+		slice.y.push_back(0.f);
+		slice.z.push_back(0.f);
+		slice.range2.push_back(-1.f);
+		slice.lights.push_back(0);
+	}
+
+	slice.indices.clear();
+	for (int tile = 0; tile < clusterCountX * clusterCountY; ++tile) {
+		size_t cluster = static_cast<size_t>(tile + clusterCountX * clusterCountY * z);
+		slice.first[tile] = static_cast<uint32_t>(slice.indices.size());
+#if CLUSTERS_X86
+		if (simd) {
+			testClusterSSE(slice, cl.clusterMin[cluster], cl.clusterMax[cluster]);
+		} else {
+			testClusterScalar(slice, cl.clusterMin[cluster], cl.clusterMax[cluster]);
+		}
+#else
+		(void)simd;
+		testClusterScalar(slice, cl.clusterMin[cluster], cl.clusterMax[cluster]);
+#endif
+		slice.count[tile] = static_cast<uint32_t>(slice.indices.size()) - slice.first[tile];
+	}
+}
+
+void assignClusterLights(ClusteredLighting& cl, const PointLight* lights, size_t count, const glm::mat4& view,
+	const glm::mat4& proj, int width, int height, bool simd, bool threaded) {
+	auto start = std::chrono::steady_clock::now();
+	if (proj != cl.boundsProj || width != cl.boundsWidth || height != cl.boundsHeight) {
+		buildClusterBounds(cl, proj, width, height);
+	}
+
+	count = std::min({count, maxClusterLights, cl.maxTexels / 2});
+	float zNear = nearPlane(proj);
+	float zFar = farPlane(proj);
+	cl.viewLights.resize(count);
+	cl.firstSlice.resize(count);
+	cl.lastSlice.resize(count);
+	cl.lightData.resize(2 * count);
+	int inRange = 0;
+	for (size_t i = 0; i < count; ++i) {
+		const PointLight& light = lights[i];
+		cl.lightData[2 * i] = glm::vec4(light.position, light.range);
+		cl.lightData[2 * i + 1] = glm::vec4(light.color, 0.f);
+		glm::vec3 viewPos(view * glm::vec4(light.position, 1.f));
+		float depth = -viewPos.z;
+		cl.viewLights[i] = glm::vec4(viewPos, light.range * light.range);
+		if (depth + light.range < zNear || depth - light.range > zFar) {
+			// In no slice.
+			cl.firstSlice[i] = 1;
+			cl.lastSlice[i] = 0;
+			continue;
+		}
+		cl.firstSlice[i] = sliceOf(cl, std::max(depth - light.range, zNear));
+		cl.lastSlice[i] = sliceOf(cl, std::min(depth + light.range, zFar));
+		++inRange;
+	}
+
+	size_t grain = threaded && count >= clusterThreadedLights ? 1 : clusterCountZ;
+	parallelFor(clusterCountZ, grain, [&](size_t begin, size_t end) {
+		for (size_t z = begin; z < end; ++z) {
+			assignSlice(cl, static_cast<int>(z), count, simd);
+		}
+	});
+
+	// The slices' lists joined into one, with the grid pointing into it. Lists are cut where the
+	// joined one reaches maxTexels, the far slices lose their lights first.
+	cl.indices.clear();
+	cl.grid.resize(2 * clusterCount);
+	int longestList = 0;
+	for (int z = 0; z < clusterCountZ; ++z) {
+		const ClusterSlice& slice = cl.slices[z];
+		uint32_t base = static_cast<uint32_t>(cl.indices.size());
+		size_t room = cl.maxTexels - cl.indices.size();
+		cl.indices.insert(cl.indices.end(), slice.indices.begin(),
+			slice.indices.begin() + static_cast<ptrdiff_t>(std::min(slice.indices.size(), room)));
+		for (int tile = 0; tile < clusterCountX * clusterCountY; ++tile) {
+			size_t cluster = static_cast<size_t>(tile + clusterCountX * clusterCountY * z);
+			uint32_t first = std::min(slice.first[tile], static_cast<uint32_t>(room));
+			uint32_t listCount = std::min(slice.count[tile], static_cast<uint32_t>(room) - first);
+			cl.grid[2 * cluster] = base + first;
+			cl.grid[2 * cluster + 1] = listCount;
+			longestList = std::max(longestList, static_cast<int>(listCount));
+		}
+	}
+
+	cl.stats.lights = static_cast<int>(count);
+	cl.stats.inRange = inRange;
+	cl.stats.indices = static_cast<int>(cl.indices.size());
+	cl.stats.longestList = longestList;
+	cl.stats.assignMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void uploadClusterBuffer(ClusteredLighting& cl, int kind, const void* data, size_t size) {
+	bindBuffer(GL_TEXTURE_BUFFER, cl.buffers[cl.slot][kind]);
+	size_t& capacity = cl.capacity[cl.slot][kind];
+	if (size > capacity) {
+		// Room for twice as much, so a few more lights next frame do not reallocate again.
+		capacity = size * 2;
+		glBufferData(GL_TEXTURE_BUFFER, static_cast<GLsizeiptr>(capacity), NULL, GL_STREAM_DRAW);
+	}
+	if (size > 0) {
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, static_cast<GLsizeiptr>(size), data);
+	}
+}
+
+void uploadClusterLights(ClusteredLighting& cl, int slot) {
+	cl.slot = slot;
+	uploadClusterBuffer(cl, CLUSTER_LIGHTS, cl.lightData.data(), cl.lightData.size() * sizeof(glm::vec4));
+	uploadClusterBuffer(cl, CLUSTER_GRID, cl.grid.data(), cl.grid.size() * sizeof(uint32_t));
+	uploadClusterBuffer(cl, CLUSTER_INDICES, cl.indices.data(), cl.indices.size() * sizeof(uint16_t));
+	for (int kind = 0; kind < 3; ++kind) {
+		bindTexture(clusterUnits[kind], GL_TEXTURE_BUFFER, cl.textures[slot][kind]);
+	}
+}
+
+int clusterSamplerUnit(const char* name) {
+	if (strcmp(name, "clusterLights") == 0) {
+		return clusterLightUnit;
+	}
+	if (strcmp(name, "clusterGrid") == 0) {
+		return clusterGridUnit;
+	}
+	if (strcmp(name, "clusterIndices") == 0) {
+		return clusterIndexUnit;
+	}
+	return -1;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "framepacing.h"
+
+#include <glm/glm.hpp>
+
+// Clustered forward lighting. The view frustum is split into clusters, a grid of screen tiles
+// times depth slices spaced exponentially between the near and far plane, and every frame the
+// CPU lists the point lights whose range reaches each cluster. The CLUSTERED_LIGHTING variant
+// of frag.glsl finds its fragment's cluster from gl_FragCoord and the view depth and only loops
+// over that list, so a fragment pays for the few lights near it out of however many there are.
+// Lights are tested as view space spheres against the view space box around each cluster, four
+// lights at a time with SSE. Slices are independent and spread over the job workers.
+// The result goes to the GPU in three texture buffers, one set per frame slot so a frame never
+// overwrites what an earlier one in flight still reads:
+// - lights: two RGBA32F texels per light, world position and range, then color.
+// - grid: one RG32UI texel per cluster, the offset and count of its list.
+// - indices: the R16UI light indices of every cluster's list, one after the other.
+// The projection must be a symmetric perspective one, like glm::perspective makes.
+
+// Same as CLUSTER_COUNT_X, _Y and _Z in frag.glsl.
+const int clusterCountX = 16;
+const int clusterCountY = 9;
+const int clusterCountZ = 24;
+const int clusterCount = clusterCountX * clusterCountY * clusterCountZ;
+// Light indices are 16 bits, lights past these are left out. Fewer fit when the texture
+// buffers are smaller, see ClusteredLighting::maxTexels.
+const size_t maxClusterLights = 65536;
+
+// Past the ones vertexpulling.h uses.
+const int clusterLightUnit = 7;
+const int clusterGridUnit = 8;
+const int clusterIndexUnit = 9;
+
+struct PointLight {
+	glm::vec3 position;
+	// Nothing past this distance is lit, see frag.glsl for the falloff.
+	float range;
+	glm::vec3 color;
+};
+
+struct ClusterStats {
+	int lights = 0;
+	// Lights between the near and far plane.
+	int inRange = 0;
+	// Entries over all lists, and the longest one.
+	int indices = 0;
+	int longestList = 0;
+	float assignMs = 0.f;
+};
+
+// Scratch of one depth slice, reused across frames.
+struct ClusterSlice {
+	// View space spheres of the lights overlapping the slice in depth, padded to a multiple of
+	// four with spheres that reach nothing.
+	std::vector<float> x, y, z, range2;
+	std::vector<uint16_t> lights;
+	// The lists of the slice's clusters one after the other, and where each one starts.
+	std::vector<uint16_t> indices;
+	uint32_t first[clusterCountX * clusterCountY];
+	uint32_t count[clusterCountX * clusterCountY];
+};
+
+struct ClusteredLighting {
+	// View space bounds of every cluster, rebuilt when the projection or viewport changes.
+	glm::mat4 boundsProj = glm::mat4(0.f);
+	int boundsWidth = 0;
+	int boundsHeight = 0;
+	std::vector<glm::vec3> clusterMin;
+	std::vector<glm::vec3> clusterMax;
+	// FrameData::clusterScale: clusters per pixel in x and y, then the scale and bias turning
+	// log2 of the view depth into a slice.
+	glm::vec4 scale = glm::vec4(0.f);
+
+	// View space light spheres and the slices each one spans, of the frame.
+	std::vector<glm::vec4> viewLights;
+	std::vector<int> firstSlice;
+	std::vector<int> lastSlice;
+	ClusterSlice slices[clusterCountZ];
+	// What goes into the buffers.
+	std::vector<glm::vec4> lightData;
+	std::vector<uint32_t> grid;
+	std::vector<uint16_t> indices;
+
+	// Lights, grid and indices of each slot, and the bytes each buffer has room for.
+	unsigned buffers[maxFramesInFlight][3] = {};
+	unsigned textures[maxFramesInFlight][3] = {};
+	size_t capacity[maxFramesInFlight][3] = {};
+	// GL_MAX_TEXTURE_BUFFER_SIZE, only 65536 is guaranteed. Lights and list entries past it are
+	// left out rather than going into a buffer the shader cannot read all of.
+	size_t maxTexels = 65536;
+	int slot = 0;
+	ClusterStats stats;
+};
+
+void createClusteredLighting(ClusteredLighting& cl);
+void deleteClusteredLighting(ClusteredLighting& cl);
+
+// Lists the lights of every cluster for a viewport of width by height pixels. With simd off the
+// spheres are tested one by one, with threaded off the slices go one after the other.
+void assignClusterLights(ClusteredLighting& cl, const PointLight* lights, size_t count, const glm::mat4& view,
+	const glm::mat4& proj, int width, int height, bool simd = true, bool threaded = true);
+// Writes the lists into the buffers of the frame's FramePacing slot and binds them to their
+// units. The fence waited on in beginFrame covers the last frame that read them.
+void uploadClusterLights(ClusteredLighting& cl, int slot);
+// The unit of a cluster sampler uniform, -1 for any other name. The samplers of a program are
+// pointed at their units once, when programUniforms reflects it.
+int clusterSamplerUnit(const char* name);
@@ -0,0 +1,232 @@
+#include "culling.h"
+#include "jobs.h"
+
+#include <chrono>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CULLING_X86 1
+#else
+#define CULLING_X86 0
+#endif
+
+// Below this many boxes a loop is not worth waking the workers for.
+static const size_t cullGrain = 16 * 1024;
+// Arrays are padded to the widest SIMD path so no loop needs a tail.
+static const size_t cullPadding = 8;
+
+struct FrustumPlanes {
+	float nx[6], ny[6], nz[6], w[6];
+	// Absolute normal components, for the projected extent of a box.
+	float ax[6], ay[6], az[6];
+};
+
+void clearCullingSet(CullingSet& set) {
+	set.count = 0;
+	set.centerX.clear();
+	set.centerY.clear();
+	set.centerZ.clear();
+	set.extentX.clear();
+	set.extentY.clear();
+	set.extentZ.clear();
+}
+
+size_t addCullingBounds(CullingSet& set, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+	glm::vec3 extent = (boundsMax - boundsMin) * 0.5f;
+	set.centerX.push_back(center.x);
+	set.centerY.push_back(center.y);
+	set.centerZ.push_back(center.z);
+	set.extentX.push_back(extent.x);
+	set.extentY.push_back(extent.y);
+	set.extentZ.push_back(extent.z);
+	return set.count++;
+}
+
+void transformBounds(const glm::mat4& model, const glm::vec3& boundsMin, const glm::vec3& boundsMax,
+	glm::vec3& outMin, glm::vec3& outMax) {
+	// Each output extent is the sum of the absolute contributions of the input extents.
+	glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+	glm::vec3 extent = (boundsMax - boundsMin) * 0.5f;
+	glm::vec3 newCenter(model * glm::vec4(center, 1.f));
+	glm::vec3 newExtent(0.f);
+	for (int col = 0; col < 3; ++col) {
+		for (int row = 0; row < 3; ++row) {
+			newExtent[row] += std::fabs(model[col][row]) * extent[col];
+		}
+	}
+	outMin = newCenter - newExtent;
+	outMax = newCenter + newExtent;
+}
+
+void extractFrustumPlanes(const glm::mat4& viewProj, glm::vec4 planes[6]) {
+	// Rows of the matrix, glm is column major.
+	glm::vec4 row[4];
+	for (int i = 0; i < 4; ++i) {
+		row[i] = glm::vec4(viewProj[0][i], viewProj[1][i], viewProj[2][i], viewProj[3][i]);
+	}
+	planes[0] = row[3] + row[0];
+	planes[1] = row[3] - row[0];
+	planes[2] = row[3] + row[1];
+	planes[3] = row[3] - row[1];
+	planes[4] = row[3] + row[2];
+	planes[5] = row[3] - row[2];
+	for (int i = 0; i < 6; ++i) {
+		planes[i] /= glm::length(glm::vec3(planes[i]));
+	}
+}
+
+static FrustumPlanes splatPlanes(const glm::vec4 planes[6]) {
+	FrustumPlanes fp;
+	for (int i = 0; i < 6; ++i) {
+		fp.nx[i] = planes[i].x;
+		fp.ny[i] = planes[i].y;
+		fp.nz[i] = planes[i].z;
+		fp.w[i] = planes[i].w;
+		fp.ax[i] = std::fabs(planes[i].x);
+		fp.ay[i] = std::fabs(planes[i].y);
+		fp.az[i] = std::fabs(planes[i].z);
+	}
+	return fp;
+}
+
+// A box is outside when it lies entirely behind one plane: distance of the center plus the
+// extent projected on the normal is negative.
+static void cullScalar(CullingSet& set, const FrustumPlanes& fp, size_t begin, size_t end) {
+	for (size_t i = begin; i < end; ++i) {
+		bool inside = true;
+		for (int p = 0; p < 6; ++p) {
+			float d = fp.nx[p] * set.centerX[i] + fp.ny[p] * set.centerY[i] + fp.nz[p] * set.centerZ[i] + fp.w[p];
+			float r = fp.ax[p] * set.extentX[i] + fp.ay[p] * set.extentY[i] + fp.az[p] * set.extentZ[i];
+			inside = inside && d + r >= 0.f;
+		}
+		set.visible[i] = inside ? 1 : 0;
+	}
+}
+
+#if CULLING_X86
+static void cullSSE(CullingSet& set, const FrustumPlanes& fp, size_t begin, size_t end) {
+	for (size_t i = begin; i < end; i += 4) {
+		__m128 cx = _mm_loadu_ps(&set.centerX[i]);
+		__m128 cy = _mm_loadu_ps(&set.centerY[i]);
+		__m128 cz = _mm_loadu_ps(&set.centerZ[i]);
+		__m128 ex = _mm_loadu_ps(&set.extentX[i]);
+		__m128 ey = _mm_loadu_ps(&set.extentY[i]);
+		__m128 ez = _mm_loadu_ps(&set.extentZ[i]);
+		__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (int p = 0; p < 6; ++p) {
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(fp.nx[p]), cx), _mm_mul_ps(_mm_set1_ps(fp.ny[p]), cy)),
+				_mm_add_ps(_mm_mul_ps(_mm_set1_ps(fp.nz[p]), cz), _mm_set1_ps(fp.w[p])));
+			__m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(fp.ax[p]), ex), _mm_mul_ps(_mm_set1_ps(fp.ay[p]), ey)),
+				_mm_mul_ps(_mm_set1_ps(fp.az[p]), ez));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(d, r), _mm_setzero_ps()));
+		}
+		int mask = _mm_movemask_ps(inside);
+		for (int j = 0; j < 4; ++j) {
+			set.visible[i + j] = static_cast<uint8_t>((mask >> j) & 1);
+		}
+	}
+}
+
+__attribute__((target("avx")))
+static void cullAVX(CullingSet& set, const FrustumPlanes& fp, size_t begin, size_t end) {
+	for (size_t i = begin; i < end; i += 8) {
+		__m256 cx = _mm256_loadu_ps(&set.centerX[i]);
+		__m256 cy = _mm256_loadu_ps(&set.centerY[i]);
+		__m256 cz = _mm256_loadu_ps(&set.centerZ[i]);
+		__m256 ex = _mm256_loadu_ps(&set.extentX[i]);
+		__m256 ey = _mm256_loadu_ps(&set.extentY[i]);
+		__m256 ez = _mm256_loadu_ps(&set.extentZ[i]);
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (int p = 0; p < 6; ++p) {
+			__m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(fp.nx[p]), cx), _mm256_mul_ps(_mm256_set1_ps(fp.ny[p]), cy)),
+				_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(fp.nz[p]), cz), _mm256_set1_ps(fp.w[p])));
+			__m256 r = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(fp.ax[p]), ex), _mm256_mul_ps(_mm256_set1_ps(fp.ay[p]), ey)),
+				_mm256_mul_ps(_mm256_set1_ps(fp.az[p]), ez));
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(d, r), _mm256_setzero_ps(), _CMP_GE_OQ));
+		}
+		int mask = _mm256_movemask_ps(inside);
+		for (int j = 0; j < 8; ++j) {
+			set.visible[i + j] = static_cast<uint8_t>((mask >> j) & 1);
+		}
+	}
+}
+#endif
+
+static CullingPath resolvePath(CullingPath path) {
+#if CULLING_X86
+	if (path == CULL_FASTEST) {
+		return __builtin_cpu_supports("avx") ? CULL_AVX : CULL_SSE;
+	}
+	if (path == CULL_AVX && !__builtin_cpu_supports("avx")) {
+		return CULL_SSE;
+	}
+	return path;
+#else
+	(void)path;
+	return CULL_SCALAR;
+#endif
+}
+
+const char* cullingPathName(CullingPath path) {
+	switch (resolvePath(path)) {
+	case CULL_SSE: return "SSE";
+	case CULL_AVX: return "AVX";
+	default: return "scalar";
+	}
+}
+
+void cullBounds(CullingSet& set, const glm::mat4& viewProj, CullingPath path, bool threaded) {
+	auto start = std::chrono::steady_clock::now();
+
+	size_t padded = (set.count + cullPadding - 1) / cullPadding * cullPadding;
+	// Padding boxes are empty and at the origin, their result is ignored.
+	set.centerX.resize(padded);
+	set.centerY.resize(padded);
+	set.centerZ.resize(padded);
+	set.extentX.resize(padded);
+	set.extentY.resize(padded);
+	set.extentZ.resize(padded);
+	set.visible.resize(padded);
+
+	glm::vec4 planes[6];
+	extractFrustumPlanes(viewProj, planes);
+	FrustumPlanes fp = splatPlanes(planes);
+
+	path = resolvePath(path);
+	auto cullRange = [&](size_t begin, size_t end) {
+#if CULLING_X86
+		if (path == CULL_AVX) {
+			cullAVX(set, fp, begin, end);
+			return;
+		}
+		if (path == CULL_SSE) {
+			cullSSE(set, fp, begin, end);
+			return;
+		}
+#endif
+		cullScalar(set, fp, begin, end);
+	};
+	if (threaded) {
+		// Ranges stay multiples of the padding, so every SIMD step is whole.
+		parallelFor(padded, cullGrain, cullRange);
+	} else {
+		cullRange(0, padded);
+	}
+
+	// The padding is dropped again, so more boxes can be added after a cull.
+	set.centerX.resize(set.count);
+	set.centerY.resize(set.count);
+	set.centerZ.resize(set.count);
+	set.extentX.resize(set.count);
+	set.extentY.resize(set.count);
+	set.extentZ.resize(set.count);
+
+	int visibleCount = 0;
+	for (size_t i = 0; i < set.count; ++i) {
+		visibleCount += set.visible[i];
+	}
+	set.visibleCount = visibleCount;
+	set.cullMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// World space boxes, kept as separate arrays of center and half extent components so they can
+// be tested against the frustum four (SSE) or eight (AVX) at a time.
+struct CullingSet {
+	size_t count = 0;
+	std::vector<float> centerX, centerY, centerZ;
+	std::vector<float> extentX, extentY, extentZ;
+	// Written by cullBounds, 1 when the box touches the frustum. Padded past count.
+	std::vector<uint8_t> visible;
+	int visibleCount = 0;
+	float cullMs = 0.f;
+};
+
+enum CullingPath {
+	CULL_SCALAR,
+	CULL_SSE,
+	CULL_AVX,
+	// AVX when the CPU has it, SSE otherwise.
+	CULL_FASTEST,
+};
+
+void clearCullingSet(CullingSet& set);
+// Returns the index the result is written to in CullingSet::visible.
+size_t addCullingBounds(CullingSet& set, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+
+// The box around a model space box after transforming it.
+void transformBounds(const glm::mat4& model, const glm::vec3& boundsMin, const glm::vec3& boundsMax,
+	glm::vec3& outMin, glm::vec3& outMax);
+// Left, right, bottom, top, near, far. Normals point inside and are normalized.
+void extractFrustumPlanes(const glm::mat4& viewProj, glm::vec4 planes[6]);
+
+// Sets the visibility of every box. Large sets are split across the job workers.
+void cullBounds(CullingSet& set, const glm::mat4& viewProj, CullingPath path = CULL_FASTEST, bool threaded = true);
+const char* cullingPathName(CullingPath path);
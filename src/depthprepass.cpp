@@ -0,0 +1,91 @@
+#include "depthprepass.h"
+#include "glstate.h"
+
+void createDepthPrepass(DepthPrepass& dp, DepthPrepassMode mode) {
+	dp.mode = mode;
+	dp.enabled = mode == DEPTH_PREPASS_ON;
+	glGenQueries(2 * maxFramesInFlight, &dp.queries[0][0]);
+}
+
+void deleteDepthPrepass(DepthPrepass& dp) {
+	glDeleteQueries(2 * maxFramesInFlight, &dp.queries[0][0]);
+	dp = DepthPrepass();
+}
+
+ShaderVariantKey depthPrepassVariant(const ShaderVariantKey& key) {
+	// Material switches do not change the position, leaving them out keeps one depth variant
+	// per vertex input.
+	ShaderVariantKey depth;
+	depth.normalMapping = false;
+	depth.specular = false;
+	depth.packedVertices = key.packedVertices;
+	depth.instanced = key.instanced;
+	depth.vertexPulling = key.vertexPulling;
+	depth.depthOnly = true;
+	return depth;
+}
+
+// Called on a count of the same frame in both passes.
+static void decide(DepthPrepass& dp) {
+	if (dp.mode != DEPTH_PREPASS_AUTO) {
+		return;
+	}
+	if (!dp.enabled && dp.stats.overdraw > depthPrepassEnableOverdraw) {
+		dp.enabled = true;
+		++dp.stats.switches;
+	} else if (dp.enabled && dp.stats.overdraw < depthPrepassDisableOverdraw) {
+		dp.enabled = false;
+		++dp.stats.switches;
+	}
+}
+
+bool beginDepthPrepassFrame(DepthPrepass& dp, int slot) {
+	dp.slot = slot;
+	if (dp.measured[slot]) {
+		GLuint64 shaded = 0;
+		glGetQueryObjectui64v(dp.queries[slot][1], GL_QUERY_RESULT, &shaded);
+		if (dp.prepassed[slot]) {
+			GLuint64 depthPassed = 0;
+			glGetQueryObjectui64v(dp.queries[slot][0], GL_QUERY_RESULT, &depthPassed);
+			dp.stats.shadedWith = shaded;
+			dp.stats.shadedWithout = depthPassed;
+			dp.stats.overdraw = shaded > 0 ? static_cast<float>(depthPassed) / static_cast<float>(shaded) : 0.f;
+			decide(dp);
+		} else {
+			dp.stats.shadedWithout = shaded;
+		}
+		dp.measured[slot] = false;
+	}
+	dp.prepassed[slot] = false;
+
+	bool run = dp.mode == DEPTH_PREPASS_ON;
+	if (dp.mode == DEPTH_PREPASS_AUTO) {
+		run = dp.enabled || ++dp.framesOff >= depthPrepassProbeFrames;
+	}
+	if (run) {
+		dp.framesOff = 0;
+	}
+	dp.stats.enabled = dp.mode == DEPTH_PREPASS_ON || (dp.mode == DEPTH_PREPASS_AUTO && dp.enabled);
+	return run;
+}
+
+void beginDepthPrepass(DepthPrepass& dp) {
+	setColorMask(false);
+	glBeginQuery(GL_SAMPLES_PASSED, dp.queries[dp.slot][0]);
+}
+
+void endDepthPrepass(DepthPrepass& dp) {
+	glEndQuery(GL_SAMPLES_PASSED);
+	setColorMask(true);
+	// Only an ended query has a count for beginDepthPrepassFrame to read.
+	dp.prepassed[dp.slot] = true;
+}
+
+void beginShadedCount(DepthPrepass& dp) {
+	glBeginQuery(GL_SAMPLES_PASSED, dp.queries[dp.slot][1]);
+}
+
+void endShadedCount(DepthPrepass& dp) {
+	glEndQuery(GL_SAMPLES_PASSED);
+	dp.measured[dp.slot] = true;
+}
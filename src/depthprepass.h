@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+
+#include "framepacing.h"
+#include "shader.h"
+
+// Opaque draws first go out with the DEPTH_ONLY variant of their program and color writes off,
+// then in color with GL_EQUAL and depth writes off, so frag.glsl only runs once per visible pixel
+// instead of for everything that was drawn before what ends up in front. The vertex work is paid
+// twice, though positions come from the position-only stream; worth it when overdraw is high.
+// Both passes are wrapped in GL_SAMPLES_PASSED queries, one pair per frame slot, read once the
+// fence of the slot signaled. The pre-pass count is what the color pass would shade without it,
+// the draws go out in the same order and early-Z lets through the same fragments.
+enum DepthPrepassMode {
+	DEPTH_PREPASS_OFF = 0,
+	DEPTH_PREPASS_ON = 1,
+	// Decided from the measured overdraw, see beginDepthPrepassFrame.
+	DEPTH_PREPASS_AUTO = 2,
+};
+
+struct DepthPrepassStats {
+	bool enabled = false;
+	// Fragments of the covered draws the color pass let through, the ones frag.glsl shaded.
+	// Of the last measured frame with and without the pre-pass.
+	uint64_t shadedWith = 0;
+	uint64_t shadedWithout = 0;
+	// Fragments shaded without the pre-pass per fragment shaded with it, 0 until measured.
+	float overdraw = 0.f;
+	int switches = 0;
+};
+
+struct DepthPrepass {
+	DepthPrepassMode mode = DEPTH_PREPASS_AUTO;
+	// What the automatic mode settled on.
+	bool enabled = false;
+	int slot = 0;
+	// Pre-pass and color pass queries of each slot, and what the slot last measured.
+	unsigned queries[maxFramesInFlight][2] = {};
+	bool measured[maxFramesInFlight] = {};
+	bool prepassed[maxFramesInFlight] = {};
+	// Frames since the automatic mode last ran the pre-pass.
+	int framesOff = 0;
+	DepthPrepassStats stats;
+};
+
+// The automatic mode turns the pre-pass on above the first overdraw and off again below the
+// second. While off it runs it every probe frames anyway, to know what it would save.
+const float depthPrepassEnableOverdraw = 1.5f;
+const float depthPrepassDisableOverdraw = 1.2f;
+const int depthPrepassProbeFrames = 120;
+
+void createDepthPrepass(DepthPrepass& dp, DepthPrepassMode mode);
+void deleteDepthPrepass(DepthPrepass& dp);
+
+// The variant the pre-pass draws key's draws with: the same vertex inputs, nothing else.
+ShaderVariantKey depthPrepassVariant(const ShaderVariantKey& key);
+
+// Reads the counts the slot's last frame left, which the fence waited on in beginFrame covers,
+// and returns whether this frame should run the pre-pass. The caller may still skip it, when
+// the depth programs are not built yet.
+bool beginDepthPrepassFrame(DepthPrepass& dp, int slot);
+// Around the pre-pass draws: color writes off, counting what passes.
+void beginDepthPrepass(DepthPrepass& dp);
+void endDepthPrepass(DepthPrepass& dp);
+// Around the color draws the pre-pass covered, counting the fragments they shade. Called every
+// frame, with or without the pre-pass.
+void beginShadedCount(DepthPrepass& dp);
+void endShadedCount(DepthPrepass& dp);
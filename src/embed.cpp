@@ -0,0 +1,14 @@
+#include "embed.h"
+
+#include <cstring>
+
+#include "embedded_files.inc"
+
+const EmbeddedFile* findEmbeddedFile(const char* path) {
+	for (const EmbeddedFile& file : embeddedFiles) {
+		if (strcmp(file.path, path) == 0) {
+			return &file;
+		}
+	}
+	return nullptr;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// A file compiled into the executable by embed.sh.
+struct EmbeddedFile {
+	const char* path;
+	const char* data;
+	size_t size;
+	uint64_t hash;
+};
+
+// FNV-1a. constexpr so the hashes of embedded files cost nothing at runtime.
+constexpr uint64_t contentHash(const char* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= static_cast<unsigned char>(data[i]);
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+// Looked up by the path given to embed.sh, e.g. "src/frag.glsl". nullptr if it was not embedded.
+const EmbeddedFile* findEmbeddedFile(const char* path);
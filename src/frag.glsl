@@ -1,45 +1,203 @@
 #version 330
 
+// Variant switches, injected by requestShaderVariant. The defaults match the full material.
+#ifndef NORMAL_MAPPING
+#define NORMAL_MAPPING 1
+#endif
+#ifndef SPECULAR
+#define SPECULAR 1
+#endif
+#ifndef LIGHT_COUNT
+#define LIGHT_COUNT 1
+#endif
+#ifndef INSTANCED
+#define INSTANCED 0
+#endif
+#ifndef SHININESS
+#define SHININESS 32.0
+#endif
+#ifndef DEPTH_ONLY
+#define DEPTH_ONLY 0
+#endif
+#ifndef VERTEX_LIGHTING
+#define VERTEX_LIGHTING 0
+#endif
+#ifndef CLUSTERED_LIGHTING
+#define CLUSTERED_LIGHTING 0
+#endif
+#if CLUSTERED_LIGHTING
+// The clustered lights of a fragment are only known per fragment.
+#undef VERTEX_LIGHTING
+#define VERTEX_LIGHTING 0
+#endif
+#if VERTEX_LIGHTING
+// Diffuse only, lit per vertex.
+#undef NORMAL_MAPPING
+#define NORMAL_MAPPING 0
+#undef SPECULAR
+#define SPECULAR 0
+#endif
+#ifndef TANGENT_SPACE_LIGHTING
+#define TANGENT_SPACE_LIGHTING 0
+#endif
+#if !NORMAL_MAPPING || CLUSTERED_LIGHTING
+#undef TANGENT_SPACE_LIGHTING
+#define TANGENT_SPACE_LIGHTING 0
+#endif
+
+#if DEPTH_ONLY
+// The depth pre-pass writes nothing but depth, see depthprepass.h.
+void main() {
+}
+#else
+
 uniform sampler2D diffuseMap;
+#if SPECULAR
 uniform sampler2D specularMap;
+#endif
+#if NORMAL_MAPPING
 uniform sampler2D normalMap;
+#endif
 
-uniform mat4 model;
+// Same as maxFrameLights in blocks.h
+#define MAX_LIGHTS 8
 
-uniform vec3 lightPos;
-uniform vec3 cameraPos;
+layout (std140) uniform FrameData {
+	mat4 proj;
+	mat4 view;
+	vec4 cameraPos;
+	vec4 lightPos[MAX_LIGHTS];
+	vec4 clusterScale;
+};
 
 in vec3 vertexPos;
 in vec2 textureCoords;
 in vec3 geomNormal;
 
+#if VERTEX_LIGHTING
+in float vertexDiffuse;
+#endif
+
+#if TANGENT_SPACE_LIGHTING
+// Lighting happens in tangent space, where the normal map is: no TBN and no normalization of
+// the map's normal into world space per fragment.
+in vec3 tangentLightDir[LIGHT_COUNT];
+in vec3 tangentViewDir;
+#elif NORMAL_MAPPING
 in mat3 TBN;
+#endif
 
-out vec4 FragColor;
+#if INSTANCED
+flat in uint materialIndex;
 
-void main() {
-	vec3 materialAmbient = vec3(1.0, 0.5, 0.31);
-	vec3 materialDiffuse = vec3(texture(diffuseMap, textureCoords));
-	vec3 materialSpecular = vec3(texture(specularMap, textureCoords));
+// Tints picked by the per-instance material index, to tell instances apart.
+const vec3 instanceTints[4] = vec3[](
+	vec3(1.0, 1.0, 1.0),
+	vec3(1.0, 0.7, 0.7),
+	vec3(0.7, 1.0, 0.7),
+	vec3(0.7, 0.7, 1.0)
+);
+#endif
 
-	vec3 lightColor = vec3(1.0, 1.0, 1.0);
-	float ambientStrength = 0.15f;
-	vec3 ambient = ambientStrength * materialAmbient;
+#if CLUSTERED_LIGHTING
+// Same as in clusteredlighting.h.
+#define CLUSTER_COUNT_X 16
+#define CLUSTER_COUNT_Y 9
+#define CLUSTER_COUNT_Z 24
 
-	vec3 shadeNormal = normalize(texture(normalMap, textureCoords).xyz * 2 - 1);
-	shadeNormal = mat3(model) * TBN * shadeNormal;
+// Two texels per light, world position and range, then color.
+uniform samplerBuffer clusterLights;
+// Per cluster the offset and count of its list in clusterIndices.
+uniform usamplerBuffer clusterGrid;
+uniform usamplerBuffer clusterIndices;
+#endif
+
+out vec4 FragColor;
 
-	vec3 lightDir = normalize(lightPos - vertexPos);
+const vec3 materialAmbient = vec3(1.0, 0.5, 0.31);
+const vec3 lightColor = vec3(1.0, 1.0, 1.0);
+const float ambientStrength = 0.15f;
+
+#if !VERTEX_LIGHTING
+// Diffuse and specular of a white light in lightDir, before any falloff.
+vec3 shadeLight(vec3 lightDir, vec3 shadeNormal, vec3 viewDir, vec3 materialDiffuse, vec3 materialSpecular) {
 	float cosLightAngle = dot(shadeNormal, lightDir);
 	float diffuseStrength = max(cosLightAngle, 0);
-	vec3 diffuse = diffuseStrength * materialDiffuse;
+	vec3 res = diffuseStrength * materialDiffuse;
 
-	vec3 viewDir = normalize(cameraPos - vertexPos);
+#if SPECULAR
 	vec3 reflectDir = reflect(-lightDir, shadeNormal);
 	float cosViewAngle = dot(viewDir, reflectDir);
-	float specularStrength = pow(max(cosViewAngle, 0), 32);
-	vec3 specular = specularStrength * materialSpecular;
+	float specularStrength = pow(max(cosViewAngle, 0), SHININESS);
+	res += specularStrength * materialSpecular;
+#endif
+	return res;
+}
+#endif
+
+void main() {
+	vec3 materialDiffuse = vec3(texture(diffuseMap, textureCoords));
+#if INSTANCED
+	materialDiffuse *= instanceTints[materialIndex % 4u];
+#endif
+	vec3 ambient = ambientStrength * materialAmbient;
+#if VERTEX_LIGHTING
+	FragColor = vec4((ambient + vertexDiffuse * materialDiffuse) * lightColor, 1.0);
+#else
+
+#if TANGENT_SPACE_LIGHTING
+	vec3 shadeNormal = normalize(texture(normalMap, textureCoords).xyz * 2 - 1);
+#elif NORMAL_MAPPING
+	vec3 shadeNormal = normalize(texture(normalMap, textureCoords).xyz * 2 - 1);
+	shadeNormal = TBN * shadeNormal;
+#else
+	vec3 shadeNormal = normalize(geomNormal);
+#endif
+
+#if SPECULAR
+	vec3 materialSpecular = vec3(texture(specularMap, textureCoords));
+#if TANGENT_SPACE_LIGHTING
+	vec3 viewDir = normalize(tangentViewDir);
+#else
+	vec3 viewDir = normalize(cameraPos.xyz - vertexPos);
+#endif
+#else
+	// Unused without specular.
+	vec3 materialSpecular = vec3(0.0);
+	vec3 viewDir = vec3(0.0);
+#endif
+
+	vec3 res = ambient;
+	for (int i = 0; i < LIGHT_COUNT; ++i) {
+#if TANGENT_SPACE_LIGHTING
+		vec3 lightDir = normalize(tangentLightDir[i]);
+#else
+		vec3 lightDir = normalize(lightPos[i].xyz - vertexPos);
+#endif
+		res += shadeLight(lightDir, shadeNormal, viewDir, materialDiffuse, materialSpecular);
+	}
+
+#if CLUSTERED_LIGHTING
+	float viewDepth = -(view * vec4(vertexPos, 1.0)).z;
+	ivec3 cluster = ivec3(vec3(gl_FragCoord.xy * clusterScale.xy, log2(max(viewDepth, 1e-4)) * clusterScale.z + clusterScale.w));
+	cluster = clamp(cluster, ivec3(0), ivec3(CLUSTER_COUNT_X - 1, CLUSTER_COUNT_Y - 1, CLUSTER_COUNT_Z - 1));
+	uvec2 list = texelFetch(clusterGrid, cluster.x + CLUSTER_COUNT_X * (cluster.y + CLUSTER_COUNT_Y * cluster.z)).xy;
+	for (uint i = 0u; i < list.y; ++i) {
+		int light = int(texelFetch(clusterIndices, int(list.x + i)).x);
+		vec4 positionRange = texelFetch(clusterLights, 2 * light);
+		vec3 color = texelFetch(clusterLights, 2 * light + 1).rgb;
+		vec3 toLight = positionRange.xyz - vertexPos;
+		float distance2 = dot(toLight, toLight);
+		// Inverse square, windowed down to exactly 0 at the range the light was assigned with.
+		float rangeRatio2 = distance2 / (positionRange.w * positionRange.w);
+		float window = clamp(1.0 - rangeRatio2 * rangeRatio2, 0.0, 1.0);
+		float falloff = window * window / (distance2 + 1.0);
+		vec3 lightDir = toLight * inversesqrt(max(distance2, 1e-8));
+		res += falloff * color * shadeLight(lightDir, shadeNormal, viewDir, materialDiffuse, materialSpecular);
+	}
+#endif
 
-	vec3 res = (ambient + diffuse + specular) * lightColor;
-	FragColor = vec4(res, 1.0);
+	FragColor = vec4(res * lightColor, 1.0);
+#endif
 }
+#endif
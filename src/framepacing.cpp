@@ -0,0 +1,63 @@
+#include "framepacing.h"
+
+#include <algorithm>
+#include <chrono>
+
+// Length of one blocking wait call. Waiting goes on until the fence signals.
+static const GLuint64 waitTimeoutNs = 100000000;
+
+// True if the fence had to be waited on.
+static bool waitFence(GLsync fence) {
+	GLenum result = glClientWaitSync(fence, 0, 0);
+	if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED) {
+		return false;
+	}
+	// The fence may still sit in an unflushed command buffer, flush once and then block.
+	GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+	do {
+		result = glClientWaitSync(fence, flags, waitTimeoutNs);
+		flags = 0;
+	} while (result == GL_TIMEOUT_EXPIRED);
+	return true;
+}
+
+void initFramePacing(FramePacing& fp, int queueDepth) {
+	deleteFramePacing(fp);
+	fp.queueDepth = std::max(1, std::min(queueDepth, maxFramesInFlight));
+	fp.frame = 0;
+	fp.slot = 0;
+	fp.stats = FramePacingStats();
+}
+
+int beginFrame(FramePacing& fp) {
+	fp.slot = static_cast<int>(fp.frame % static_cast<uint64_t>(fp.queueDepth));
+	fp.stats.waitMs = 0.f;
+	GLsync& fence = fp.fences[fp.slot];
+	if (fence) {
+		auto start = std::chrono::steady_clock::now();
+		if (waitFence(fence)) {
+			fp.stats.waitMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+			++fp.stats.stalls;
+		}
+		glDeleteSync(fence);
+		fence = 0;
+	}
+	return fp.slot;
+}
+
+void endFrame(FramePacing& fp) {
+	fp.fences[fp.slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	// Make sure the fence reaches the GPU, otherwise waiting on it later could never return.
+	glFlush();
+	++fp.frame;
+}
+
+void deleteFramePacing(FramePacing& fp) {
+	for (GLsync& fence : fp.fences) {
+		if (fence) {
+			waitFence(fence);
+			glDeleteSync(fence);
+			fence = 0;
+		}
+	}
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+#include "../include/glad/glad.h"
+
+// Explicit bound on how far the CPU runs ahead of the GPU. Every frame ends with a fence, and
+// before a frame starts the CPU waits for the fence of the frame queueDepth frames back. That
+// frame's slot is then free: per-frame resources kept once per slot can be rewritten without
+// orphaning or the driver stalling on them, while the GPU still works on the frames after it.
+// A depth of 1 waits for the previous frame, lowest latency and no overlap; 2 lets the CPU
+// build frame N+1 while the GPU draws frame N.
+const int maxFramesInFlight = 4;
+
+struct FramePacingStats {
+	// The last wait, 0 when the fence had already signaled.
+	float waitMs = 0.f;
+	// Frames so far that had to wait.
+	int stalls = 0;
+};
+
+struct FramePacing {
+	int queueDepth = 2;
+	GLsync fences[maxFramesInFlight] = {};
+	uint64_t frame = 0;
+	// Index of the per-frame resources the current frame writes, in [0, queueDepth).
+	int slot = 0;
+	FramePacingStats stats;
+};
+
+// Clamps the depth to [1, maxFramesInFlight]. Call before the first frame.
+void initFramePacing(FramePacing& fp, int queueDepth);
+// Waits until the frames in flight leave room for this one and returns its slot.
+int beginFrame(FramePacing& fp);
+// Fences the commands of the frame. Call after the swap so the fence also covers it.
+void endFrame(FramePacing& fp);
+// Waits for every frame in flight and deletes the fences.
+void deleteFramePacing(FramePacing& fp);
@@ -0,0 +1,118 @@
+#include "framering.h"
+#include "glstate.h"
+
+#include <cstring>
+
+#include <algorithm>
+
+static void allocateStorage(FrameRing& ring) {
+	glGenBuffers(1, &ring.buffer);
+	bindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, static_cast<GLsizeiptr>(ring.regionSize * static_cast<size_t>(ring.regions)), NULL, GL_STREAM_DRAW);
+}
+
+// Maps the rest of the current region from start on.
+static void mapRegion(FrameRing& ring, size_t start) {
+	bindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+	size_t regionStart = static_cast<size_t>(ring.slot) * ring.regionSize;
+	GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_FLUSH_EXPLICIT_BIT;
+	ring.mapStart = start;
+	ring.mapped = static_cast<unsigned char*>(glMapBufferRange(GL_COPY_WRITE_BUFFER,
+		static_cast<GLintptr>(regionStart + start), static_cast<GLsizeiptr>(ring.regionSize - start), access));
+}
+
+static void unmapRegion(FrameRing& ring) {
+	if (!ring.mapped) {
+		return;
+	}
+	bindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+	if (ring.offset > ring.mapStart) {
+		glFlushMappedBufferRange(GL_COPY_WRITE_BUFFER, 0, static_cast<GLsizeiptr>(ring.offset - ring.mapStart));
+	}
+	glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+	ring.mapped = nullptr;
+}
+
+void createFrameRing(FrameRing& ring, size_t regionSize, int regions) {
+	int alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	ring.uniformAlignment = static_cast<size_t>(alignment);
+	ring.regions = std::max(1, std::min(regions, maxFramesInFlight));
+	ring.regionSize = (regionSize + ring.uniformAlignment - 1) / ring.uniformAlignment * ring.uniformAlignment;
+	allocateStorage(ring);
+}
+
+void deleteFrameRing(FrameRing& ring) {
+	unmapRegion(ring);
+	deleteBuffer(ring.buffer);
+	ring = FrameRing();
+}
+
+void beginFrameRing(FrameRing& ring, int slot) {
+	unmapRegion(ring);
+	ring.slot = slot % ring.regions;
+	ring.offset = 0;
+	ring.stats.usedBytes = 0;
+	ring.stats.allocations = 0;
+	mapRegion(ring, 0);
+}
+
+// Moves to a buffer with twice the region size, or more if needed, keeping what the frame
+// wrote at the same region offsets. The region itself starts elsewhere in the new buffer.
+// Frames still in flight keep reading the old buffer, which GL only frees once they are done.
+static void growFrameRing(FrameRing& ring, size_t needed) {
+	unmapRegion(ring);
+	unsigned oldBuffer = ring.buffer;
+	size_t oldRegionStart = static_cast<size_t>(ring.slot) * ring.regionSize;
+	while (ring.regionSize < needed) {
+		ring.regionSize *= 2;
+	}
+	allocateStorage(ring);
+
+	if (ring.offset > 0) {
+		bindBuffer(GL_COPY_READ_BUFFER, oldBuffer);
+		bindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(oldRegionStart),
+			static_cast<GLintptr>(static_cast<size_t>(ring.slot) * ring.regionSize), static_cast<GLsizeiptr>(ring.offset));
+	}
+	deleteBuffer(oldBuffer);
+	++ring.stats.grows;
+	mapRegion(ring, ring.offset);
+}
+
+RingAllocation ringAllocate(FrameRing& ring, size_t size, size_t alignment) {
+	size_t offset = (ring.offset + alignment - 1) / alignment * alignment;
+	if (offset + size > ring.regionSize) {
+		growFrameRing(ring, std::max(ring.regionSize * 2, offset + size));
+	}
+	ring.offset = offset + size;
+	ring.stats.usedBytes = ring.offset;
+	ring.stats.peakBytes = std::max(ring.stats.peakBytes, ring.offset);
+	++ring.stats.allocations;
+
+	RingAllocation allocation;
+	allocation.offset = offset;
+	allocation.data = ring.mapped ? ring.mapped + (offset - ring.mapStart) : nullptr;
+	return allocation;
+}
+
+size_t ringUpload(FrameRing& ring, const void* data, size_t size, size_t alignment) {
+	RingAllocation allocation = ringAllocate(ring, size, alignment);
+	if (allocation.data) {
+		memcpy(allocation.data, data, size);
+	} else {
+		// The driver refused the mapping, fall back to a plain upload.
+		bindBuffer(GL_COPY_WRITE_BUFFER, ring.buffer);
+		glBufferSubData(GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(ringBufferOffset(ring, allocation.offset)),
+			static_cast<GLsizeiptr>(size), data);
+	}
+	return allocation.offset;
+}
+
+size_t ringBufferOffset(const FrameRing& ring, size_t offset) {
+	return static_cast<size_t>(ring.slot) * ring.regionSize + offset;
+}
+
+void finishFrameRing(FrameRing& ring) {
+	unmapRegion(ring);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+
+#include "framepacing.h"
+
+#include "../include/glad/glad.h"
+
+// One large buffer for everything the CPU writes anew each frame: frame and object uniform
+// blocks, instance attributes, other vertex streams. It is split into one region per frame in
+// flight. A frame maps the region of its FramePacing slot once, unsynchronized, since the fence
+// waited on in beginFrame guarantees the GPU is done with it, and sub-allocates from it by
+// bumping an offset. Data is written straight into the mapping, with no staging copy in the
+// driver and no implicit sync.
+// GL 3.3 cannot draw from a mapped buffer, so allocations are only made between beginFrameRing
+// and finishFrameRing, and draws reading them only after. Allocations hand out offsets into the
+// frame's region, which callers turn into FrameRing::buffer offsets with ringBufferOffset when
+// they bind them (glBindBufferRange, glVertexAttribPointer) at draw time. The region moves when
+// the buffer grows, so buffer offsets must not be kept from before the last allocation.
+struct FrameRingStats {
+	// This frame, and the most any frame used so far.
+	size_t usedBytes = 0;
+	size_t peakBytes = 0;
+	int allocations = 0;
+	// Times a frame overflowed its region and the buffer was replaced by a larger one.
+	int grows = 0;
+};
+
+struct FrameRing {
+	unsigned buffer = 0;
+	int regions = 0;
+	size_t regionSize = 0;
+	// GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, what uniform block allocations must be aligned to.
+	size_t uniformAlignment = 256;
+
+	// Of the current frame.
+	int slot = 0;
+	size_t offset = 0;
+	// Region offset the mapping starts at, and the pointer to it. Null when not mapped.
+	size_t mapStart = 0;
+	unsigned char* mapped = nullptr;
+	FrameRingStats stats;
+};
+
+struct RingAllocation {
+	// Into the frame's region, see ringBufferOffset.
+	size_t offset;
+	// Where to write the data, valid until the next allocation or finishFrameRing.
+	void* data;
+};
+
+// regions is the number of frames in flight, FramePacing::queueDepth.
+void createFrameRing(FrameRing& ring, size_t regionSize, int regions);
+void deleteFrameRing(FrameRing& ring);
+
+// Maps the region of the frame's FramePacing slot.
+void beginFrameRing(FrameRing& ring, int slot);
+// A block of size bytes at a multiple of alignment. A frame outgrowing its region moves to a
+// buffer twice the size, copying what the frame wrote so far; region offsets stay valid.
+RingAllocation ringAllocate(FrameRing& ring, size_t size, size_t alignment = 16);
+// ringAllocate and a copy of data. Returns the region offset.
+size_t ringUpload(FrameRing& ring, const void* data, size_t size, size_t alignment = 16);
+// Where a region offset of the current frame is in FrameRing::buffer.
+size_t ringBufferOffset(const FrameRing& ring, size_t offset);
+// Flushes what the frame wrote and unmaps, the allocations can be drawn from after this.
+void finishFrameRing(FrameRing& ring);
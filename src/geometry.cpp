@@ -0,0 +1,443 @@
+#include "geometry.h"
+#include "embed.h"
+#include "glstate.h"
+
+#include "../include/glad/glad.h"
+
+#include <cstring>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include <glm/gtc/packing.hpp>
+
+// removeArenaMesh defragments once there are this many holes and they hold most of the free space.
+static const size_t defragmentBlocks = 16;
+static const float defragmentThreshold = 0.5f;
+
+size_t vertexFormatSize(VertexFormat format) {
+	switch (format) {
+	case VERTEX_FORMAT_PACKED: return sizeof(PackedVertex);
+	default: return standardVertexFloats * sizeof(float);
+	}
+}
+
+size_t vertexAttributeSize(VertexFormat format) {
+	return vertexFormatSize(format) - sizeof(glm::vec3);
+}
+
+struct VertexAttribute {
+	int size;
+	GLenum type;
+	bool normalized;
+	// In the interleaved vertex, the position first.
+	size_t offset;
+};
+
+static const VertexAttribute packedAttributes[] = {
+	{3, GL_FLOAT, false, offsetof(PackedVertex, pos)},
+	{2, GL_FLOAT, false, offsetof(PackedVertex, uv)},
+	{4, GL_INT_2_10_10_10_REV, true, offsetof(PackedVertex, normal)},
+	{4, GL_INT_2_10_10_10_REV, true, offsetof(PackedVertex, tangent)},
+};
+
+// Points, uv coordinates, normals, tangent, bitangent.
+static const VertexAttribute standardAttributes[] = {
+	{3, GL_FLOAT, false, 0},
+	{2, GL_FLOAT, false, 3 * sizeof(float)},
+	{3, GL_FLOAT, false, 5 * sizeof(float)},
+	{3, GL_FLOAT, false, 8 * sizeof(float)},
+	{3, GL_FLOAT, false, 11 * sizeof(float)},
+};
+
+static const VertexAttribute* formatAttributes(VertexFormat format, unsigned& count) {
+	if (format == VERTEX_FORMAT_PACKED) {
+		count = 4;
+		return packedAttributes;
+	}
+	count = 5;
+	return standardAttributes;
+}
+
+// Attribute i of format from the bound GL_ARRAY_BUFFER, first is where attribute 0 would start.
+static void setupAttributes(VertexFormat format, unsigned first, size_t start, int stride) {
+	unsigned count;
+	const VertexAttribute* attributes = formatAttributes(format, count);
+	for (unsigned i = first; i < count; ++i) {
+		size_t offset = attributes[i].offset - start;
+		glVertexAttribPointer(i, attributes[i].size, attributes[i].type, attributes[i].normalized ? GL_TRUE : GL_FALSE,
+			stride, reinterpret_cast<void*>(offset));
+		glEnableVertexAttribArray(i);
+	}
+}
+
+void setupVertexFormat(VertexFormat format) {
+	setupAttributes(format, 0, 0, static_cast<int>(vertexFormatSize(format)));
+}
+
+void setupPositionFormat() {
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), 0);
+	glEnableVertexAttribArray(0);
+}
+
+void setupSplitVertexFormat(VertexFormat format, unsigned positionBuffer, unsigned attributeBuffer) {
+	bindBuffer(GL_ARRAY_BUFFER, positionBuffer);
+	setupPositionFormat();
+	bindBuffer(GL_ARRAY_BUFFER, attributeBuffer);
+	setupAttributes(format, 1, sizeof(glm::vec3), static_cast<int>(vertexAttributeSize(format)));
+}
+
+void setupVertexArrayFormat(unsigned vao, VertexFormat format, unsigned positionBinding, unsigned attributeBinding) {
+	unsigned count;
+	const VertexAttribute* attributes = formatAttributes(format, count);
+	for (unsigned i = 0; i < count; ++i) {
+		size_t offset = i == 0 ? 0 : attributes[i].offset - sizeof(glm::vec3);
+		glEnableVertexArrayAttrib(vao, i);
+		glVertexArrayAttribFormat(vao, i, attributes[i].size, attributes[i].type,
+			attributes[i].normalized ? GL_TRUE : GL_FALSE, static_cast<unsigned>(offset));
+		glVertexArrayAttribBinding(vao, i, i == 0 ? positionBinding : attributeBinding);
+	}
+}
+
+std::vector<PackedVertex> packVertices(const std::vector<float>& standardVertices) {
+	size_t numVertices = standardVertices.size() / standardVertexFloats;
+	std::vector<PackedVertex> packed(numVertices);
+	for (size_t i = 0; i < numVertices; ++i) {
+		const float* src = &standardVertices[i * standardVertexFloats];
+		glm::vec3 n = glm::normalize(glm::vec3(src[5], src[6], src[7]));
+		glm::vec3 t = glm::vec3(src[8], src[9], src[10]);
+		glm::vec3 b = glm::vec3(src[11], src[12], src[13]);
+		float handedness = glm::dot(glm::cross(n, t), b) < 0.f ? -1.f : 1.f;
+
+		packed[i].pos = glm::vec3(src[0], src[1], src[2]);
+		packed[i].uv = glm::vec2(src[3], src[4]);
+		packed[i].normal = glm::packSnorm3x10_1x2(glm::vec4(n, 0.f));
+		packed[i].tangent = glm::packSnorm3x10_1x2(glm::vec4(glm::normalize(t), handedness));
+	}
+	return packed;
+}
+
+void indexVertices(const void* data, size_t vertexSize, size_t vertexCount,
+	std::vector<unsigned char>& vertices, std::vector<uint32_t>& indices) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	std::unordered_map<uint64_t, uint32_t> seen;
+	vertices.clear();
+	indices.clear();
+	indices.reserve(vertexCount);
+	for (size_t i = 0; i < vertexCount; ++i) {
+		const unsigned char* src = bytes + i * vertexSize;
+		uint64_t hash = contentHash(reinterpret_cast<const char*>(src), vertexSize);
+		auto it = seen.find(hash);
+		if (it != seen.end() && memcmp(&vertices[it->second * vertexSize], src, vertexSize) == 0) {
+			indices.push_back(it->second);
+			continue;
+		}
+		uint32_t index = static_cast<uint32_t>(vertices.size() / vertexSize);
+		vertices.insert(vertices.end(), src, src + vertexSize);
+		seen[hash] = index;
+		indices.push_back(index);
+	}
+}
+
+void splitVertices(const void* data, VertexFormat format, size_t vertexCount,
+	std::vector<glm::vec3>& positions, std::vector<unsigned char>& attributes) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	size_t vertexSize = vertexFormatSize(format);
+	size_t attributeSize = vertexAttributeSize(format);
+	positions.resize(vertexCount);
+	attributes.resize(vertexCount * attributeSize);
+	for (size_t i = 0; i < vertexCount; ++i) {
+		const unsigned char* src = bytes + i * vertexSize;
+		memcpy(&positions[i], src, sizeof(glm::vec3));
+		memcpy(&attributes[i * attributeSize], src + sizeof(glm::vec3), attributeSize);
+	}
+}
+
+void initArenaAllocator(ArenaAllocator& allocator, size_t capacity) {
+	allocator.capacity = capacity;
+	allocator.used = 0;
+	allocator.freeBlocks.clear();
+	if (capacity > 0) {
+		allocator.freeBlocks.push_back({0, capacity});
+	}
+}
+
+bool arenaAllocate(ArenaAllocator& allocator, size_t size, size_t& offset) {
+	for (size_t i = 0; i < allocator.freeBlocks.size(); ++i) {
+		FreeBlock& block = allocator.freeBlocks[i];
+		if (block.size < size) {
+			continue;
+		}
+		offset = block.offset;
+		block.offset += size;
+		block.size -= size;
+		if (block.size == 0) {
+			allocator.freeBlocks.erase(allocator.freeBlocks.begin() + static_cast<std::ptrdiff_t>(i));
+		}
+		allocator.used += size;
+		return true;
+	}
+	return false;
+}
+
+void arenaFree(ArenaAllocator& allocator, size_t offset, size_t size) {
+	std::vector<FreeBlock>& blocks = allocator.freeBlocks;
+	size_t i = 0;
+	while (i < blocks.size() && blocks[i].offset < offset) {
+		++i;
+	}
+	blocks.insert(blocks.begin() + static_cast<std::ptrdiff_t>(i), {offset, size});
+	allocator.used -= size;
+
+	// Merge with the following block, then with the preceding one.
+	if (i + 1 < blocks.size() && blocks[i].offset + blocks[i].size == blocks[i + 1].offset) {
+		blocks[i].size += blocks[i + 1].size;
+		blocks.erase(blocks.begin() + static_cast<std::ptrdiff_t>(i + 1));
+	}
+	if (i > 0 && blocks[i - 1].offset + blocks[i - 1].size == blocks[i].offset) {
+		blocks[i - 1].size += blocks[i].size;
+		blocks.erase(blocks.begin() + static_cast<std::ptrdiff_t>(i));
+	}
+}
+
+float arenaFragmentation(const ArenaAllocator& allocator) {
+	size_t free = allocator.capacity - allocator.used;
+	if (free == 0) {
+		return 0.f;
+	}
+	size_t largest = 0;
+	for (const FreeBlock& block : allocator.freeBlocks) {
+		largest = std::max(largest, block.size);
+	}
+	return 1.f - static_cast<float>(largest) / static_cast<float>(free);
+}
+
+static unsigned createArenaBuffer(size_t size) {
+	unsigned buffer;
+	glGenBuffers(1, &buffer);
+	bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, static_cast<GLsizeiptr>(size), NULL, GL_STATIC_DRAW);
+	return buffer;
+}
+
+// Whether buffer textures can reach all of the arena's buffers, read as 32 bit texels. GL only
+// guarantees GL_MAX_TEXTURE_BUFFER_SIZE to be 65536, a 64k vertex arena already needs more.
+static bool fitsTextureBuffers(const GeometryArena& arena) {
+	int maxTexels = 65536;
+	glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+	size_t limit = static_cast<size_t>(maxTexels);
+	return arena.vertices.capacity * sizeof(glm::vec3) / sizeof(uint32_t) <= limit
+		&& arena.vertices.capacity * vertexAttributeSize(arena.format) / sizeof(uint32_t) <= limit
+		&& arena.indices.capacity <= limit;
+}
+
+static void deletePullingTextures(GeometryArena& arena) {
+	deleteTexture(arena.positionTexture);
+	deleteTexture(arena.vertexTexture);
+	deleteTexture(arena.indexTexture);
+	arena.positionTexture = 0;
+	arena.vertexTexture = 0;
+	arena.indexTexture = 0;
+}
+
+static void attachArenaBuffers(GeometryArena& arena) {
+	bindVertexArray(arena.vao);
+	setupSplitVertexFormat(arena.format, arena.positionBuffer, arena.vertexBuffer);
+	bindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.indexBuffer);
+	bindVertexArray(arena.positionVao);
+	bindBuffer(GL_ARRAY_BUFFER, arena.positionBuffer);
+	setupPositionFormat();
+	bindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.indexBuffer);
+	if (arena.vertexTexture && !fitsTextureBuffers(arena)) {
+		// Grown past what the textures can address, pulled draws would read past their end.
+		deletePullingTextures(arena);
+	}
+	if (arena.vertexTexture) {
+		bindTexture(0, GL_TEXTURE_BUFFER, arena.positionTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, arena.positionBuffer);
+		bindTexture(0, GL_TEXTURE_BUFFER, arena.vertexTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, arena.vertexBuffer);
+		bindTexture(0, GL_TEXTURE_BUFFER, arena.indexTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, arena.indexBuffer);
+	}
+}
+
+void createGeometryArena(GeometryArena& arena, VertexFormat format, size_t vertexCapacity, size_t indexCapacity) {
+	arena.format = format;
+	initArenaAllocator(arena.vertices, vertexCapacity);
+	initArenaAllocator(arena.indices, indexCapacity);
+	arena.positionBuffer = createArenaBuffer(vertexCapacity * sizeof(glm::vec3));
+	arena.vertexBuffer = createArenaBuffer(vertexCapacity * vertexAttributeSize(format));
+	arena.indexBuffer = createArenaBuffer(indexCapacity * sizeof(uint32_t));
+	glGenVertexArrays(1, &arena.vao);
+	glGenVertexArrays(1, &arena.positionVao);
+	attachArenaBuffers(arena);
+}
+
+void deleteGeometryArena(GeometryArena& arena) {
+	if (arena.vertexTexture) {
+		deletePullingTextures(arena);
+	}
+	deleteVertexArray(arena.vao);
+	deleteVertexArray(arena.positionVao);
+	deleteBuffer(arena.positionBuffer);
+	deleteBuffer(arena.vertexBuffer);
+	deleteBuffer(arena.indexBuffer);
+	arena = GeometryArena();
+}
+
+static void copyBufferRange(unsigned from, unsigned to, size_t fromOffset, size_t toOffset, size_t size) {
+	bindBuffer(GL_COPY_READ_BUFFER, from);
+	bindBuffer(GL_COPY_WRITE_BUFFER, to);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(fromOffset),
+		static_cast<GLintptr>(toOffset), static_cast<GLsizeiptr>(size));
+}
+
+// Copies the live meshes, packed at the front, into new buffers of the given capacities.
+static void relocateArena(GeometryArena& arena, size_t vertexCapacity, size_t indexCapacity) {
+	const size_t positionSize = sizeof(glm::vec3);
+	size_t vertexSize = vertexAttributeSize(arena.format);
+	unsigned positionBuffer = createArenaBuffer(vertexCapacity * positionSize);
+	unsigned vertexBuffer = createArenaBuffer(vertexCapacity * vertexSize);
+	unsigned indexBuffer = createArenaBuffer(indexCapacity * sizeof(uint32_t));
+
+	initArenaAllocator(arena.vertices, vertexCapacity);
+	initArenaAllocator(arena.indices, indexCapacity);
+	for (ArenaMesh& mesh : arena.meshes) {
+		if (!mesh.live) {
+			continue;
+		}
+		size_t baseVertex = 0;
+		size_t firstIndex = 0;
+		arenaAllocate(arena.vertices, static_cast<size_t>(mesh.vertexCount), baseVertex);
+		arenaAllocate(arena.indices, static_cast<size_t>(mesh.indexCount), firstIndex);
+
+		size_t oldBaseVertex = static_cast<size_t>(mesh.baseVertex);
+		size_t vertexCount = static_cast<size_t>(mesh.vertexCount);
+		copyBufferRange(arena.positionBuffer, positionBuffer, oldBaseVertex * positionSize,
+			baseVertex * positionSize, vertexCount * positionSize);
+		copyBufferRange(arena.vertexBuffer, vertexBuffer, oldBaseVertex * vertexSize,
+			baseVertex * vertexSize, vertexCount * vertexSize);
+		copyBufferRange(arena.indexBuffer, indexBuffer, static_cast<size_t>(mesh.firstIndex) * sizeof(uint32_t),
+			firstIndex * sizeof(uint32_t), static_cast<size_t>(mesh.indexCount) * sizeof(uint32_t));
+
+		mesh.baseVertex = static_cast<int>(baseVertex);
+		mesh.firstIndex = static_cast<int>(firstIndex);
+	}
+
+	unsigned oldPositionBuffer = arena.positionBuffer;
+	unsigned oldVertexBuffer = arena.vertexBuffer;
+	unsigned oldIndexBuffer = arena.indexBuffer;
+	arena.positionBuffer = positionBuffer;
+	arena.vertexBuffer = vertexBuffer;
+	arena.indexBuffer = indexBuffer;
+	attachArenaBuffers(arena);
+	deleteBuffer(oldPositionBuffer);
+	deleteBuffer(oldVertexBuffer);
+	deleteBuffer(oldIndexBuffer);
+}
+
+void defragmentGeometryArena(GeometryArena& arena) {
+	relocateArena(arena, arena.vertices.capacity, arena.indices.capacity);
+	++arena.defragmentations;
+}
+
+bool enableVertexPulling(GeometryArena& arena) {
+	if (arena.vertexTexture) {
+		return true;
+	}
+	if (!fitsTextureBuffers(arena)) {
+		return false;
+	}
+	glGenTextures(1, &arena.positionTexture);
+	glGenTextures(1, &arena.vertexTexture);
+	glGenTextures(1, &arena.indexTexture);
+	attachArenaBuffers(arena);
+	return true;
+}
+
+static bool allocateMesh(GeometryArena& arena, size_t vertexCount, size_t indexCount, ArenaMesh& mesh) {
+	size_t baseVertex = 0;
+	if (!arenaAllocate(arena.vertices, vertexCount, baseVertex)) {
+		return false;
+	}
+	size_t firstIndex = 0;
+	if (!arenaAllocate(arena.indices, indexCount, firstIndex)) {
+		arenaFree(arena.vertices, baseVertex, vertexCount);
+		return false;
+	}
+	mesh.baseVertex = static_cast<int>(baseVertex);
+	mesh.vertexCount = static_cast<int>(vertexCount);
+	mesh.firstIndex = static_cast<int>(firstIndex);
+	mesh.indexCount = static_cast<int>(indexCount);
+	mesh.live = true;
+	mesh.boundsMin = glm::vec3(0.f);
+	mesh.boundsMax = glm::vec3(0.f);
+	return true;
+}
+
+int addArenaMesh(GeometryArena& arena, const void* vertexData, size_t vertexCount, const uint32_t* indexData, size_t indexCount) {
+	ArenaMesh mesh;
+	if (!allocateMesh(arena, vertexCount, indexCount, mesh)) {
+		size_t freeVertices = arena.vertices.capacity - arena.vertices.used;
+		size_t freeIndices = arena.indices.capacity - arena.indices.used;
+		if (freeVertices >= vertexCount && freeIndices >= indexCount) {
+			defragmentGeometryArena(arena);
+		} else {
+			size_t vertexCapacity = std::max(arena.vertices.capacity * 2, arena.vertices.used + vertexCount);
+			size_t indexCapacity = std::max(arena.indices.capacity * 2, arena.indices.used + indexCount);
+			relocateArena(arena, vertexCapacity, indexCapacity);
+		}
+		allocateMesh(arena, vertexCount, indexCount, mesh);
+	}
+
+	std::vector<glm::vec3> positions;
+	std::vector<unsigned char> attributes;
+	splitVertices(vertexData, arena.format, vertexCount, positions, attributes);
+	size_t baseVertex = static_cast<size_t>(mesh.baseVertex);
+	bindBuffer(GL_COPY_WRITE_BUFFER, arena.positionBuffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(baseVertex * sizeof(glm::vec3)),
+		static_cast<GLsizeiptr>(positions.size() * sizeof(glm::vec3)), positions.data());
+	bindBuffer(GL_COPY_WRITE_BUFFER, arena.vertexBuffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(baseVertex * vertexAttributeSize(arena.format)),
+		static_cast<GLsizeiptr>(attributes.size()), attributes.data());
+	bindBuffer(GL_COPY_WRITE_BUFFER, arena.indexBuffer);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, static_cast<GLintptr>(static_cast<size_t>(mesh.firstIndex) * sizeof(uint32_t)),
+		static_cast<GLsizeiptr>(indexCount * sizeof(uint32_t)), indexData);
+
+	if (!arena.freeMeshIds.empty()) {
+		int id = arena.freeMeshIds.back();
+		arena.freeMeshIds.pop_back();
+		arena.meshes[static_cast<size_t>(id)] = mesh;
+		return id;
+	}
+	arena.meshes.push_back(mesh);
+	return static_cast<int>(arena.meshes.size() - 1);
+}
+
+int addArenaMesh(GeometryArena& arena, const void* vertexData, size_t vertexCount) {
+	std::vector<unsigned char> vertices;
+	std::vector<uint32_t> indices;
+	size_t vertexSize = vertexFormatSize(arena.format);
+	indexVertices(vertexData, vertexSize, vertexCount, vertices, indices);
+	return addArenaMesh(arena, vertices.data(), vertices.size() / vertexSize, indices.data(), indices.size());
+}
+
+void removeArenaMesh(GeometryArena& arena, int id) {
+	ArenaMesh& mesh = arena.meshes[static_cast<size_t>(id)];
+	if (!mesh.live) {
+		return;
+	}
+	arenaFree(arena.vertices, static_cast<size_t>(mesh.baseVertex), static_cast<size_t>(mesh.vertexCount));
+	arenaFree(arena.indices, static_cast<size_t>(mesh.firstIndex), static_cast<size_t>(mesh.indexCount));
+	mesh.live = false;
+	arena.freeMeshIds.push_back(id);
+
+	bool scattered = arena.vertices.freeBlocks.size() > defragmentBlocks
+		&& arenaFragmentation(arena.vertices) > defragmentThreshold;
+	scattered = scattered || (arena.indices.freeBlocks.size() > defragmentBlocks
+		&& arenaFragmentation(arena.indices) > defragmentThreshold);
+	if (scattered) {
+		defragmentGeometryArena(arena);
+	}
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Layouts of the vertex data the arenas hold, one arena and one VAO per layout.
+enum VertexFormat {
+	// Position, uv, normal, tangent, bitangent as floats, 56 bytes. What parseObjectFile produces.
+	VERTEX_FORMAT_STANDARD = 0,
+	// PackedVertex, 28 bytes. Used by the PACKED_VERTICES shader variant.
+	VERTEX_FORMAT_PACKED = 1,
+};
+
+const size_t standardVertexFloats = 14;
+
+// Position, uv, then normal and tangent as 10:10:10:2 signed normalized ints. The bitangent is
+// rebuilt in the vertex shader from the normal, the tangent and the handedness kept in tangent.w.
+struct PackedVertex {
+	glm::vec3 pos;
+	glm::vec2 uv;
+	uint32_t normal;
+	uint32_t tangent;
+};
+
+// Of an interleaved vertex, what readObjectFile and packVertices produce.
+size_t vertexFormatSize(VertexFormat format);
+// Of the vertex without its position, which every format starts with.
+size_t vertexAttributeSize(VertexFormat format);
+// Points the attributes of the bound VAO at interleaved vertices in the bound GL_ARRAY_BUFFER,
+// starting at offset 0.
+void setupVertexFormat(VertexFormat format);
+// Only attribute 0, from tightly packed vec3 positions in the bound GL_ARRAY_BUFFER.
+void setupPositionFormat();
+// Attribute 0 from tightly packed positions in positionBuffer, the others from attributeBuffer,
+// vertexAttributeSize bytes per vertex. Leaves attributeBuffer bound to GL_ARRAY_BUFFER.
+void setupSplitVertexFormat(VertexFormat format, unsigned positionBuffer, unsigned attributeBuffer);
+// The same through direct state access (GL 4.5): the attributes of vao read from two of its vertex
+// buffer binding points, which the caller attaches the buffers to with glVertexArrayVertexBuffer.
+void setupVertexArrayFormat(unsigned vao, VertexFormat format, unsigned positionBinding, unsigned attributeBinding);
+
+// Splits interleaved vertices into the two streams of an arena.
+void splitVertices(const void* data, VertexFormat format, size_t vertexCount,
+	std::vector<glm::vec3>& positions, std::vector<unsigned char>& attributes);
+
+std::vector<PackedVertex> packVertices(const std::vector<float>& standardVertices);
+
+// Merges identical vertices. vertices gets the unique ones, indices one entry per input vertex.
+void indexVertices(const void* data, size_t vertexSize, size_t vertexCount,
+	std::vector<unsigned char>& vertices, std::vector<uint32_t>& indices);
+
+struct FreeBlock {
+	size_t offset;
+	size_t size;
+};
+
+// First fit over a free list kept sorted by offset, neighbouring blocks are merged when freed.
+// Units are whatever the caller uses, vertices or indices for the arenas.
+struct ArenaAllocator {
+	size_t capacity = 0;
+	size_t used = 0;
+	std::vector<FreeBlock> freeBlocks;
+};
+
+void initArenaAllocator(ArenaAllocator& allocator, size_t capacity);
+bool arenaAllocate(ArenaAllocator& allocator, size_t size, size_t& offset);
+void arenaFree(ArenaAllocator& allocator, size_t offset, size_t size);
+// 0 when all free space is in one block, close to 1 when it is scattered in small holes.
+float arenaFragmentation(const ArenaAllocator& allocator);
+
+struct ArenaMesh {
+	int baseVertex;
+	int vertexCount;
+	int firstIndex;
+	int indexCount;
+	bool live;
+	// Model space, set by whoever adds the mesh. Used for culling.
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+};
+
+// Vertex and index buffers shared by every mesh of a format, behind a single VAO, so drawing
+// different meshes needs no rebinding and can be merged into multi-draws. Indices are relative
+// to the mesh, draws pass baseVertex.
+// Vertices are kept as two streams: positions alone, 12 bytes each, and everything else. Depth
+// only and shadow passes draw through positionVao, which reads nothing but the positions, instead
+// of pulling whole vertices through the cache for 12 of their bytes.
+struct GeometryArena {
+	VertexFormat format = VERTEX_FORMAT_STANDARD;
+	unsigned vao = 0;
+	// Same indices, attribute 0 only.
+	unsigned positionVao = 0;
+	unsigned positionBuffer = 0;
+	// The rest of the vertex, vertexAttributeSize bytes each.
+	unsigned vertexBuffer = 0;
+	unsigned indexBuffer = 0;
+	// Buffer textures over the three buffers, for vertex pulling. 0 until enableVertexPulling.
+	unsigned positionTexture = 0;
+	unsigned vertexTexture = 0;
+	unsigned indexTexture = 0;
+	ArenaAllocator vertices;
+	ArenaAllocator indices;
+	// Indexed by the id addArenaMesh returns. Ids of removed meshes are reused.
+	std::vector<ArenaMesh> meshes;
+	std::vector<int> freeMeshIds;
+	int defragmentations = 0;
+};
+
+void createGeometryArena(GeometryArena& arena, VertexFormat format, size_t vertexCapacity, size_t indexCapacity);
+void deleteGeometryArena(GeometryArena& arena);
+
+// vertexData is interleaved in the format of the arena, it is split into the two streams on
+// upload. Returns the mesh id. The buffers grow when the mesh does not fit, after a
+// defragmentation if that would have been enough.
+int addArenaMesh(GeometryArena& arena, const void* vertexData, size_t vertexCount, const uint32_t* indexData, size_t indexCount);
+// Indexes the vertices first, see indexVertices.
+int addArenaMesh(GeometryArena& arena, const void* vertexData, size_t vertexCount);
+void removeArenaMesh(GeometryArena& arena, int mesh);
+
+// Moves every live mesh to the front of the buffers. Done on the GPU with buffer copies.
+// Called by removeArenaMesh once the free space gets too scattered.
+void defragmentGeometryArena(GeometryArena& arena);
+
+// Creates 32 bit unsigned buffer textures over the position, vertex and index buffers, which follow the
+// arena to new buffers when it grows. See vertexpulling.h. Returns false, leaving pulling off, when a
+// buffer holds more texels than GL_MAX_TEXTURE_BUFFER_SIZE. Should the arena grow past that later,
+// pulling turns itself off again and vertexTexture goes back to 0.
+bool enableVertexPulling(GeometryArena& arena);
@@ -0,0 +1,298 @@
+#include "glstate.h"
+
+GLStateStats glStateStats;
+
+static const unsigned unknown = ~0u;
+static const int maxTextureUnits = 16;
+static const int maxIndexedBindings = 16;
+
+static const GLenum bufferTargets[] = {
+	GL_ARRAY_BUFFER,
+	GL_ELEMENT_ARRAY_BUFFER,
+	GL_UNIFORM_BUFFER,
+	GL_TEXTURE_BUFFER,
+	GL_COPY_READ_BUFFER,
+	GL_COPY_WRITE_BUFFER,
+	GL_PIXEL_PACK_BUFFER,
+	GL_PIXEL_UNPACK_BUFFER,
+	GL_DRAW_INDIRECT_BUFFER,
+	GL_SHADER_STORAGE_BUFFER,
+};
+static const int numBufferTargets = sizeof(bufferTargets) / sizeof(bufferTargets[0]);
+
+static const GLenum textureTargets[] = {
+	GL_TEXTURE_2D,
+	GL_TEXTURE_BUFFER,
+	GL_TEXTURE_2D_ARRAY,
+};
+static const int numTextureTargets = sizeof(textureTargets) / sizeof(textureTargets[0]);
+
+struct IndexedBinding {
+	unsigned buffer;
+	GLintptr offset;
+	GLsizeiptr size;
+};
+
+// Booleans are kept as unsigned so they can be unknown too.
+struct GLState {
+	unsigned program;
+	unsigned vao;
+	unsigned buffers[numBufferTargets];
+	IndexedBinding uniformBindings[maxIndexedBindings];
+	int activeUnit;
+	unsigned textures[maxTextureUnits][numTextureTargets];
+
+	unsigned depthTest;
+	unsigned depthFunc;
+	unsigned depthMask;
+	unsigned colorMask;
+	unsigned blend;
+	unsigned blendSrc;
+	unsigned blendDst;
+	unsigned cullFace;
+	int viewport[4];
+};
+
+static GLState state;
+
+static bool change(unsigned& cached, unsigned value) {
+	if (cached == value) {
+		++glStateStats.elided;
+		return false;
+	}
+	cached = value;
+	++glStateStats.issued;
+	return true;
+}
+
+static int bufferTargetIndex(GLenum target) {
+	for (int i = 0; i < numBufferTargets; ++i) {
+		if (bufferTargets[i] == target) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int textureTargetIndex(GLenum target) {
+	for (int i = 0; i < numTextureTargets; ++i) {
+		if (textureTargets[i] == target) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void resetGLStateStats() {
+	glStateStats = GLStateStats();
+}
+
+void invalidateGLState() {
+	state.program = unknown;
+	state.vao = unknown;
+	for (unsigned& buffer : state.buffers) {
+		buffer = unknown;
+	}
+	for (IndexedBinding& binding : state.uniformBindings) {
+		binding.buffer = unknown;
+	}
+	state.activeUnit = -1;
+	for (auto& unit : state.textures) {
+		for (unsigned& tex : unit) {
+			tex = unknown;
+		}
+	}
+	state.depthTest = unknown;
+	state.depthFunc = unknown;
+	state.depthMask = unknown;
+	state.colorMask = unknown;
+	state.blend = unknown;
+	state.blendSrc = unknown;
+	state.blendDst = unknown;
+	state.cullFace = unknown;
+	state.viewport[0] = -1;
+}
+
+void useProgram(unsigned program) {
+	if (change(state.program, program)) {
+		glUseProgram(program);
+	}
+}
+
+void bindVertexArray(unsigned vao) {
+	if (change(state.vao, vao)) {
+		glBindVertexArray(vao);
+		state.buffers[bufferTargetIndex(GL_ELEMENT_ARRAY_BUFFER)] = unknown;
+	}
+}
+
+void bindBuffer(GLenum target, unsigned buffer) {
+	int index = bufferTargetIndex(target);
+	if (index < 0) {
+		++glStateStats.issued;
+		glBindBuffer(target, buffer);
+	} else if (change(state.buffers[index], buffer)) {
+		glBindBuffer(target, buffer);
+	}
+}
+
+static void setIndexedBinding(GLenum target, unsigned index, unsigned buffer, GLintptr offset, GLsizeiptr size) {
+	// Indexed binds also replace the generic binding of the target.
+	int targetIndex = bufferTargetIndex(target);
+	if (targetIndex >= 0) {
+		state.buffers[targetIndex] = buffer;
+	}
+	if (target == GL_UNIFORM_BUFFER && index < static_cast<unsigned>(maxIndexedBindings)) {
+		state.uniformBindings[index] = {buffer, offset, size};
+	}
+}
+
+void bindBufferBase(GLenum target, unsigned index, unsigned buffer) {
+	if (target == GL_UNIFORM_BUFFER && index < static_cast<unsigned>(maxIndexedBindings)) {
+		const IndexedBinding& cur = state.uniformBindings[index];
+		if (cur.buffer == buffer && cur.size == 0) {
+			++glStateStats.elided;
+			return;
+		}
+	}
+	++glStateStats.issued;
+	glBindBufferBase(target, index, buffer);
+	setIndexedBinding(target, index, buffer, 0, 0);
+}
+
+void bindBufferRange(GLenum target, unsigned index, unsigned buffer, GLintptr offset, GLsizeiptr size) {
+	if (target == GL_UNIFORM_BUFFER && index < static_cast<unsigned>(maxIndexedBindings)) {
+		const IndexedBinding& cur = state.uniformBindings[index];
+		if (cur.buffer == buffer && cur.offset == offset && cur.size == size) {
+			++glStateStats.elided;
+			return;
+		}
+	}
+	++glStateStats.issued;
+	glBindBufferRange(target, index, buffer, offset, size);
+	setIndexedBinding(target, index, buffer, offset, size);
+}
+
+void bindTexture(int unit, GLenum target, unsigned texture) {
+	int targetIndex = textureTargetIndex(target);
+	if (targetIndex >= 0 && unit < maxTextureUnits && state.textures[unit][targetIndex] == texture) {
+		++glStateStats.elided;
+		return;
+	}
+
+	if (state.activeUnit != unit) {
+		++glStateStats.issued;
+		glActiveTexture(static_cast<GLenum>(GL_TEXTURE0 + unit));
+		state.activeUnit = unit;
+	}
+	++glStateStats.issued;
+	glBindTexture(target, texture);
+	if (targetIndex >= 0 && unit < maxTextureUnits) {
+		state.textures[unit][targetIndex] = texture;
+	}
+}
+
+static void setCapability(unsigned& cached, GLenum cap, bool enable) {
+	if (change(cached, enable ? 1 : 0)) {
+		if (enable) {
+			glEnable(cap);
+		} else {
+			glDisable(cap);
+		}
+	}
+}
+
+void setDepthTest(bool enable) {
+	setCapability(state.depthTest, GL_DEPTH_TEST, enable);
+}
+
+void setDepthFunc(GLenum func) {
+	if (change(state.depthFunc, func)) {
+		glDepthFunc(func);
+	}
+}
+
+void setDepthMask(bool write) {
+	if (change(state.depthMask, write ? 1 : 0)) {
+		glDepthMask(write ? GL_TRUE : GL_FALSE);
+	}
+}
+
+void setColorMask(bool write) {
+	if (change(state.colorMask, write ? 1 : 0)) {
+		GLboolean mask = write ? GL_TRUE : GL_FALSE;
+		glColorMask(mask, mask, mask, mask);
+	}
+}
+
+void setBlend(bool enable) {
+	setCapability(state.blend, GL_BLEND, enable);
+}
+
+void setBlendFunc(GLenum src, GLenum dst) {
+	if (state.blendSrc == src && state.blendDst == dst) {
+		++glStateStats.elided;
+		return;
+	}
+	++glStateStats.issued;
+	glBlendFunc(src, dst);
+	state.blendSrc = src;
+	state.blendDst = dst;
+}
+
+void setCullFace(bool enable) {
+	setCapability(state.cullFace, GL_CULL_FACE, enable);
+}
+
+void setViewport(int x, int y, int width, int height) {
+	int* vp = state.viewport;
+	if (vp[0] == x && vp[1] == y && vp[2] == width && vp[3] == height) {
+		++glStateStats.elided;
+		return;
+	}
+	++glStateStats.issued;
+	glViewport(x, y, width, height);
+	vp[0] = x;
+	vp[1] = y;
+	vp[2] = width;
+	vp[3] = height;
+}
+
+void deleteProgram(unsigned program) {
+	if (state.program == program) {
+		state.program = unknown;
+	}
+	glDeleteProgram(program);
+}
+
+void deleteVertexArray(unsigned vao) {
+	if (state.vao == vao) {
+		state.vao = unknown;
+	}
+	glDeleteVertexArrays(1, &vao);
+}
+
+void deleteBuffer(unsigned buffer) {
+	for (unsigned& bound : state.buffers) {
+		if (bound == buffer) {
+			bound = unknown;
+		}
+	}
+	for (IndexedBinding& binding : state.uniformBindings) {
+		if (binding.buffer == buffer) {
+			binding.buffer = unknown;
+		}
+	}
+	glDeleteBuffers(1, &buffer);
+}
+
+void deleteTexture(unsigned texture) {
+	for (auto& unit : state.textures) {
+		for (unsigned& bound : unit) {
+			if (bound == texture) {
+				bound = unknown;
+			}
+		}
+	}
+	glDeleteTextures(1, &texture);
+}
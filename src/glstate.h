@@ -0,0 +1,42 @@
+#pragma once
+
+#include "../include/glad/glad.h"
+
+// Thin layer over the glad entry points that remembers what is bound on the main context and
+// drops calls that would not change anything. All binds on the main context should go
+// through here, otherwise the cache goes stale; call invalidateGLState after raw GL calls.
+struct GLStateStats {
+	int issued = 0;
+	int elided = 0;
+};
+
+// Counts for the frame in progress. Reset by resetGLStateStats at the start of a frame.
+extern GLStateStats glStateStats;
+
+void resetGLStateStats();
+// Forget everything, the next call of each kind is issued. Must also be called once the
+// context is created, before anything else in here.
+void invalidateGLState();
+
+void useProgram(unsigned program);
+// Also marks the element array binding unknown, it is part of the VAO state.
+void bindVertexArray(unsigned vao);
+void bindBuffer(GLenum target, unsigned buffer);
+void bindBufferBase(GLenum target, unsigned index, unsigned buffer);
+void bindBufferRange(GLenum target, unsigned index, unsigned buffer, GLintptr offset, GLsizeiptr size);
+void bindTexture(int unit, GLenum target, unsigned texture);
+
+void setDepthTest(bool enable);
+void setDepthFunc(GLenum func);
+void setDepthMask(bool write);
+void setColorMask(bool write);
+void setBlend(bool enable);
+void setBlendFunc(GLenum src, GLenum dst);
+void setCullFace(bool enable);
+void setViewport(int x, int y, int width, int height);
+
+// Deleting a bound object silently unbinds it, these keep the cache in sync.
+void deleteProgram(unsigned program);
+void deleteVertexArray(unsigned vao);
+void deleteBuffer(unsigned buffer);
+void deleteTexture(unsigned texture);
@@ -0,0 +1,239 @@
+#include "gpuscene.h"
+#include "culling.h"
+#include "framepacing.h"
+#include "glstate.h"
+#include "uniforms.h"
+
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+
+// What glMultiDrawElementsIndirect reads, and cull.comp writes.
+struct DrawCommand {
+	uint32_t count;
+	uint32_t instanceCount;
+	uint32_t firstIndex;
+	int32_t baseVertex;
+	uint32_t baseInstance;
+};
+
+// Same as local_size_x in cull.comp.
+static const unsigned cullGroupSize = 64;
+// Same as the binding of occlusionDepth in cull.comp.
+static const int occlusionTextureUnit = 3;
+static const int occlusionBlocksX = softDepthWidth / softBlockSize;
+static const int occlusionBlocksY = softDepthHeight / softBlockSize;
+// The list of hidden objects in cull.comp, past any real one.
+static const uint32_t hiddenList = 0xFFFFFFFFu;
+
+static size_t alignUp(size_t value, size_t alignment) {
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+bool gpuDrivenSupported() {
+	return GLAD_GL_VERSION_4_5 != 0;
+}
+
+// The model matrix of the records on binding 1, one per instance.
+static void setupInstanceFormat(unsigned vao) {
+	for (unsigned i = 0; i < 4; ++i) {
+		unsigned location = instanceModelLocation + i;
+		glEnableVertexArrayAttrib(vao, location);
+		glVertexArrayAttribFormat(vao, location, 4, GL_FLOAT, GL_FALSE,
+			static_cast<unsigned>(offsetof(InstanceData, model) + i * sizeof(glm::vec4)));
+		glVertexArrayAttribBinding(vao, location, 1);
+	}
+	glVertexArrayBindingDivisor(vao, 1, 1);
+}
+
+void createGpuScene(GpuScene& scene, const GeometryArena& arena, size_t capacity, int regions, int lists) {
+	// Regions and the sections in them are bound as shader storage, so they start at multiples of this.
+	int alignment = 256;
+	glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	size_t storageAlignment = static_cast<size_t>(alignment);
+	scene.arena = &arena;
+	scene.capacity = capacity;
+	scene.lists = std::max(1, lists);
+	scene.regions = std::max(1, std::min(regions, maxFramesInFlight));
+	scene.boundsOffset = alignUp(capacity * sizeof(InstanceData), storageAlignment);
+	scene.drawsOffset = scene.boundsOffset + alignUp(capacity * 2 * sizeof(glm::vec4), storageAlignment);
+	scene.counterOffset = scene.drawsOffset + alignUp(capacity * 4 * sizeof(uint32_t), storageAlignment);
+	scene.regionSize = scene.counterOffset + alignUp(sizeof(uint32_t), storageAlignment);
+
+	// Coherent, so neither side has to flush: what the CPU writes is seen by the next dispatch,
+	// and the counts the GPU writes are seen by the CPU once the fence of their frame signaled.
+	GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	GLsizeiptr size = static_cast<GLsizeiptr>(scene.regionSize * static_cast<size_t>(scene.regions));
+	glCreateBuffers(1, &scene.buffer);
+	glNamedBufferStorage(scene.buffer, size, NULL, access);
+	scene.mapped = static_cast<unsigned char*>(glMapNamedBufferRange(scene.buffer, 0, size, access));
+	memset(scene.mapped, 0, static_cast<size_t>(size));
+
+	glCreateBuffers(1, &scene.commandBuffer);
+	size_t commands = std::max<size_t>(capacity, 1) * static_cast<size_t>(scene.lists);
+	glNamedBufferStorage(scene.commandBuffer, static_cast<GLsizeiptr>(commands * sizeof(DrawCommand)), NULL, 0);
+
+	glCreateVertexArrays(1, &scene.vao);
+	setupVertexArrayFormat(scene.vao, arena.format, 0, 2);
+	setupInstanceFormat(scene.vao);
+	glEnableVertexArrayAttrib(scene.vao, instanceMaterialLocation);
+	glVertexArrayAttribIFormat(scene.vao, instanceMaterialLocation, 1, GL_UNSIGNED_INT,
+		static_cast<unsigned>(offsetof(InstanceData, material)));
+	glVertexArrayAttribBinding(scene.vao, instanceMaterialLocation, 1);
+
+	// Only the position on binding 0, like GeometryArena::positionVao.
+	glCreateVertexArrays(1, &scene.depthVao);
+	glEnableVertexArrayAttrib(scene.depthVao, 0);
+	glVertexArrayAttribFormat(scene.depthVao, 0, 3, GL_FLOAT, GL_FALSE, 0);
+	glVertexArrayAttribBinding(scene.depthVao, 0, 0);
+	setupInstanceFormat(scene.depthVao);
+
+	glCreateTextures(GL_TEXTURE_2D, 1, &scene.occlusionTexture);
+	glTextureStorage2D(scene.occlusionTexture, 1, GL_R32F, occlusionBlocksX, occlusionBlocksY);
+	glTextureParameteri(scene.occlusionTexture, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTextureParameteri(scene.occlusionTexture, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+}
+
+void deleteGpuScene(GpuScene& scene) {
+	if (scene.mapped) {
+		glUnmapNamedBuffer(scene.buffer);
+	}
+	deleteBuffer(scene.buffer);
+	deleteBuffer(scene.commandBuffer);
+	deleteVertexArray(scene.vao);
+	deleteVertexArray(scene.depthVao);
+	deleteTexture(scene.occlusionTexture);
+	scene = GpuScene();
+}
+
+int addGpuObject(GpuScene& scene, int mesh, const glm::mat4& model, uint32_t material,
+	const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	if (scene.objects.size() >= scene.capacity) {
+		return -1;
+	}
+	GpuObject object;
+	object.mesh = mesh;
+	object.instance.model = model;
+	object.instance.material = material;
+	object.boundsMin = boundsMin;
+	object.boundsMax = boundsMax;
+	scene.objects.push_back(object);
+	return static_cast<int>(scene.objects.size() - 1);
+}
+
+void cullGpuScene(GpuScene& scene, int slot, unsigned cullProgram, const glm::mat4& viewProj,
+	const SoftOcclusion* occlusion) {
+	auto start = std::chrono::steady_clock::now();
+	scene.slot = slot % scene.regions;
+	size_t regionStart = static_cast<size_t>(scene.slot) * scene.regionSize;
+	unsigned char* region = scene.mapped + regionStart;
+
+	// The fence waited on in beginFrame covers the last frame that used the region, its count is final.
+	uint32_t* visibleCount = reinterpret_cast<uint32_t*>(region + scene.counterOffset);
+	scene.stats.visible = static_cast<int>(*visibleCount);
+	*visibleCount = 0;
+
+	size_t count = scene.objects.size();
+	InstanceData* instances = reinterpret_cast<InstanceData*>(region);
+	glm::vec4* bounds = reinterpret_cast<glm::vec4*>(region + scene.boundsOffset);
+	uint32_t* draws = reinterpret_cast<uint32_t*>(region + scene.drawsOffset);
+	for (size_t i = 0; i < count; ++i) {
+		const GpuObject& object = scene.objects[i];
+		const ArenaMesh& mesh = scene.arena->meshes[static_cast<size_t>(object.mesh)];
+		instances[i] = object.instance;
+		bounds[2 * i] = glm::vec4(object.boundsMin, 0.f);
+		bounds[2 * i + 1] = glm::vec4(object.boundsMax, 0.f);
+		// Taken from the arena every frame, meshes move when it is defragmented.
+		draws[4 * i] = static_cast<uint32_t>(mesh.indexCount);
+		draws[4 * i + 1] = static_cast<uint32_t>(mesh.firstIndex);
+		draws[4 * i + 2] = static_cast<uint32_t>(mesh.baseVertex);
+		draws[4 * i + 3] = object.hidden ? hiddenList : object.list;
+	}
+	scene.stats.objects = static_cast<int>(count);
+	scene.stats.writeMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	if (count == 0) {
+		return;
+	}
+
+	useProgram(cullProgram);
+	UniformTable& uniforms = programUniforms(cullProgram);
+	glm::vec4 planes[6];
+	extractFrustumPlanes(viewProj, planes);
+	setUniform(uniforms, UNIFORM("frustumPlanes"), planes, 6);
+	setUniform(uniforms, UNIFORM("viewProj"), viewProj);
+	setUniform(uniforms, UNIFORM("objectCount"), static_cast<int>(count));
+	setUniform(uniforms, UNIFORM("listCount"), scene.lists);
+	setUniform(uniforms, UNIFORM("occlusionEnabled"), occlusion ? 1 : 0);
+	if (occlusion) {
+		glTextureSubImage2D(scene.occlusionTexture, 0, 0, 0, occlusionBlocksX, occlusionBlocksY, GL_RED, GL_FLOAT,
+			occlusion->blockMaxDepth.data());
+	}
+	// Bound either way, the shader wants a complete texture behind its sampler.
+	bindTexture(occlusionTextureUnit, GL_TEXTURE_2D, scene.occlusionTexture);
+
+	bindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, scene.buffer, static_cast<GLintptr>(regionStart + scene.boundsOffset),
+		static_cast<GLsizeiptr>(count * 2 * sizeof(glm::vec4)));
+	bindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, scene.buffer, static_cast<GLintptr>(regionStart + scene.drawsOffset),
+		static_cast<GLsizeiptr>(count * 4 * sizeof(uint32_t)));
+	bindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, scene.commandBuffer, 0,
+		static_cast<GLsizeiptr>(count * static_cast<size_t>(scene.lists) * sizeof(DrawCommand)));
+	bindBufferRange(GL_SHADER_STORAGE_BUFFER, 3, scene.buffer, static_cast<GLintptr>(regionStart + scene.counterOffset),
+		static_cast<GLsizeiptr>(sizeof(uint32_t)));
+	glDispatchCompute(static_cast<unsigned>((count + cullGroupSize - 1) / cullGroupSize), 1, 1);
+	// The commands are read by the indirect draw, the count by the CPU through the mapping.
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+}
+
+// Points both vertex arrays at the arena's buffers and the records of the frame.
+static void bindSceneBuffers(GpuScene& scene) {
+	// The arena replaces its buffers when it grows.
+	const GeometryArena& arena = *scene.arena;
+	if (scene.vaoPositionBuffer != arena.positionBuffer || scene.vaoVertexBuffer != arena.vertexBuffer
+		|| scene.vaoIndexBuffer != arena.indexBuffer) {
+		// Unbound first, so the cached element array binding cannot go stale.
+		bindVertexArray(0);
+		glVertexArrayVertexBuffer(scene.vao, 0, arena.positionBuffer, 0, sizeof(glm::vec3));
+		glVertexArrayVertexBuffer(scene.vao, 2, arena.vertexBuffer, 0, static_cast<GLsizei>(vertexAttributeSize(arena.format)));
+		glVertexArrayElementBuffer(scene.vao, arena.indexBuffer);
+		glVertexArrayVertexBuffer(scene.depthVao, 0, arena.positionBuffer, 0, sizeof(glm::vec3));
+		glVertexArrayElementBuffer(scene.depthVao, arena.indexBuffer);
+		scene.vaoPositionBuffer = arena.positionBuffer;
+		scene.vaoVertexBuffer = arena.vertexBuffer;
+		scene.vaoIndexBuffer = arena.indexBuffer;
+	}
+	GLintptr region = static_cast<GLintptr>(static_cast<size_t>(scene.slot) * scene.regionSize);
+	glVertexArrayVertexBuffer(scene.vao, 1, scene.buffer, region, sizeof(InstanceData));
+	glVertexArrayVertexBuffer(scene.depthVao, 1, scene.buffer, region, sizeof(InstanceData));
+}
+
+static void drawScene(GpuScene& scene, unsigned vao, int list) {
+	if (scene.objects.empty()) {
+		return;
+	}
+	bindSceneBuffers(scene);
+	bindVertexArray(vao);
+	bindBuffer(GL_DRAW_INDIRECT_BUFFER, scene.commandBuffer);
+	size_t first = static_cast<size_t>(list) * scene.objects.size();
+	glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, reinterpret_cast<const void*>(first * sizeof(DrawCommand)),
+		static_cast<GLsizei>(scene.objects.size()), 0);
+}
+
+void drawGpuScene(GpuScene& scene, int list) {
+	drawScene(scene, scene.vao, list);
+}
+
+void drawGpuSceneDepth(GpuScene& scene) {
+	for (int list = 0; list < scene.lists; ++list) {
+		drawScene(scene, scene.depthVao, list);
+	}
+}
+
+void drawGpuObject(GpuScene& scene, size_t id) {
+	const ArenaMesh& mesh = scene.arena->meshes[static_cast<size_t>(scene.objects[id].mesh)];
+	bindSceneBuffers(scene);
+	bindVertexArray(scene.vao);
+	glDrawElementsInstancedBaseVertexBaseInstance(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_INT,
+		reinterpret_cast<const void*>(static_cast<size_t>(mesh.firstIndex) * sizeof(uint32_t)), 1, mesh.baseVertex,
+		static_cast<unsigned>(id));
+}
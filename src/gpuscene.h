@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "geometry.h"
+#include "instancing.h"
+#include "softocclusion.h"
+
+#include <glm/glm.hpp>
+
+// GL 4.5 path where the GPU decides what gets drawn. Each object has a record in one buffer that
+// is mapped once, persistently and coherently, with a region per frame in flight: its
+// InstanceData, its world space bounds and the arena mesh it draws. Every frame the CPU writes
+// the records of the frame's region and a compute shader (cull.comp) tests the bounds against
+// the frustum and the software occlusion depth, writing one indirect command per object, with
+// no instances when it is culled or the CPU hid it. The whole scene is then one
+// glMultiDrawElementsIndirect with the INSTANCED shader variant, where each command's base
+// instance selects the object's record as its instance attributes.
+// Objects can be split over a few draw lists, like the shading LOD levels of shadinglod.h. The
+// culling writes a set of commands per list, each object only getting instances in its own,
+// and every list is one multi-draw with a program of its own.
+// All objects come from one arena. Only used when gpuDrivenSupported(); without GL 4.5 the same
+// objects go through the render queue and instancing.h instead.
+struct GpuObject {
+	int mesh;
+	InstanceData instance;
+	// World space, must hold the object wherever its model matrix puts it.
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+	// Set by the CPU every frame for what it already knows is not drawn, like objects outside the
+	// PVS. They get no instances whatever the culling says.
+	bool hidden = false;
+	// The draw list, below GpuScene::lists.
+	uint8_t list = 0;
+};
+
+struct GpuSceneStats {
+	int objects = 0;
+	// Objects that passed culling. Read back from the region once its fence signaled, so this
+	// is from queueDepth frames ago.
+	int visible = 0;
+	// Writing the records into the mapping.
+	float writeMs = 0.f;
+};
+
+struct GpuScene {
+	const GeometryArena* arena = nullptr;
+	// Changed freely between frames, written to the GPU by cullGpuScene.
+	std::vector<GpuObject> objects;
+	size_t capacity = 0;
+	int lists = 1;
+
+	unsigned buffer = 0;
+	unsigned char* mapped = nullptr;
+	int regions = 0;
+	size_t regionSize = 0;
+	// Where bounds, draw parameters and the visible count start in a region, the records first.
+	size_t boundsOffset = 0;
+	size_t drawsOffset = 0;
+	size_t counterOffset = 0;
+	// Of the current frame.
+	int slot = 0;
+
+	// Only ever touched by the GPU. The commands of each list, one per object, one list after the other.
+	unsigned commandBuffer = 0;
+	// Arena positions on binding 0, the records of the frame on binding 1, the rest of the arena
+	// vertices on binding 2.
+	unsigned vao = 0;
+	// The same without the attribute stream and material index, for depth pre-passes.
+	unsigned depthVao = 0;
+	unsigned vaoPositionBuffer = 0;
+	unsigned vaoVertexBuffer = 0;
+	unsigned vaoIndexBuffer = 0;
+	// SoftOcclusion::blockMaxDepth.
+	unsigned occlusionTexture = 0;
+	GpuSceneStats stats;
+};
+
+// GL 4.5: direct state access, persistent mapping, compute shaders and indirect multi-draws.
+bool gpuDrivenSupported();
+
+// capacity is the most objects the scene takes, regions the number of frames in flight,
+// FramePacing::queueDepth, lists the number of draw lists.
+void createGpuScene(GpuScene& scene, const GeometryArena& arena, size_t capacity, int regions, int lists = 1);
+void deleteGpuScene(GpuScene& scene);
+// Returns the object id, its index in GpuScene::objects, or -1 when the scene is full.
+int addGpuObject(GpuScene& scene, int mesh, const glm::mat4& model, uint32_t material,
+	const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+
+// Writes the objects into the region of the frame's FramePacing slot and dispatches the culling.
+// occlusion is left out when null, otherwise its depth must be rasterized for viewProj.
+void cullGpuScene(GpuScene& scene, int slot, unsigned cullProgram, const glm::mat4& viewProj,
+	const SoftOcclusion* occlusion);
+// Draws what the culling let through of one list. The program must be current with its textures bound.
+void drawGpuScene(GpuScene& scene, int list = 0);
+// All lists through depthVao, with a DEPTH_ONLY program current. See depthprepass.h.
+void drawGpuSceneDepth(GpuScene& scene);
+// Draws one object of the frame's records directly, whatever the culling said, for hidden
+// objects the caller draws on its own, like ones conditional on an occlusion query. The
+// program must be current with its textures bound.
+void drawGpuObject(GpuScene& scene, size_t id);
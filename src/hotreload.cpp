@@ -0,0 +1,218 @@
+#include "hotreload.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <sys/stat.h>
+
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>
+
+struct ReloadJob {
+	ShaderProgram* target;
+	std::vector<ShaderStage> stages;
+	std::string defines;
+};
+
+struct ReloadResult {
+	ShaderProgram* target;
+	unsigned program;
+};
+
+static GLFWwindow* reloadWindow = nullptr;
+static std::thread reloadThread;
+
+// Everything below the mutex is shared with the worker.
+static std::mutex reloadMutex;
+static std::condition_variable reloadCond;
+static bool reloadStop = false;
+static std::vector<std::string> watchedPaths;
+static std::vector<ReloadJob> pendingJobs;
+static std::vector<ReloadResult> finishedBuilds;
+static std::vector<std::string> changedPaths;
+
+// Main thread only.
+static std::vector<ShaderProgram*> watchedPrograms;
+static std::vector<ShaderVariants*> watchedVariants;
+
+static const int pollIntervalMs = 250;
+
+static long long modificationTime(const std::string& path) {
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0) {
+		return -1;
+	}
+	return static_cast<long long>(st.st_mtim.tv_sec) * 1000000000ll + st.st_mtim.tv_nsec;
+}
+
+static void reloadWorker() {
+	glfwMakeContextCurrent(reloadWindow);
+
+	std::unordered_map<std::string, long long> mtimes;
+	std::unique_lock<std::mutex> lock(reloadMutex);
+	while (!reloadStop) {
+		reloadCond.wait_for(lock, std::chrono::milliseconds(pollIntervalMs));
+		if (reloadStop) {
+			break;
+		}
+		std::vector<std::string> paths = watchedPaths;
+		std::vector<ReloadJob> jobs;
+		jobs.swap(pendingJobs);
+		lock.unlock();
+
+		std::vector<std::string> changed;
+		for (const std::string& path : paths) {
+			long long mtime = modificationTime(path);
+			auto it = mtimes.find(path);
+			if (it == mtimes.end()) {
+				mtimes[path] = mtime;
+			} else if (it->second != mtime) {
+				it->second = mtime;
+				changed.push_back(path);
+			}
+		}
+
+		std::vector<ReloadResult> results;
+		for (const ReloadJob& job : jobs) {
+			unsigned program = buildShaderProgram(job.stages, job.defines.c_str());
+			if (program) {
+				results.push_back({job.target, program});
+			} else {
+				printf("Shader reload failed, keeping the previous program.\n");
+			}
+		}
+		if (!results.empty()) {
+			// The main context may only use the programs once the driver is done with them.
+			glFinish();
+		}
+
+		lock.lock();
+		changedPaths.insert(changedPaths.end(), changed.begin(), changed.end());
+		finishedBuilds.insert(finishedBuilds.end(), results.begin(), results.end());
+	}
+
+	lock.unlock();
+	glfwMakeContextCurrent(NULL);
+}
+
+bool startShaderReload(GLFWwindow* window) {
+	// Windows can only be created from the main thread. This one is never shown, it only
+	// carries a context that shares objects with the main one.
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	reloadWindow = glfwCreateWindow(1, 1, "shader reload", NULL, window);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+	if (!reloadWindow) {
+		printf("Failed to create shared context, shader reload disabled.\n");
+		return false;
+	}
+
+	reloadStop = false;
+	reloadThread = std::thread(reloadWorker);
+	return true;
+}
+
+void stopShaderReload() {
+	if (!reloadWindow) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(reloadMutex);
+		reloadStop = true;
+	}
+	reloadCond.notify_one();
+	reloadThread.join();
+
+	for (const ReloadResult& res : finishedBuilds) {
+		glDeleteProgram(res.program);
+	}
+	finishedBuilds.clear();
+	pendingJobs.clear();
+
+	glfwDestroyWindow(reloadWindow);
+	reloadWindow = nullptr;
+}
+
+static void watchStages(const std::vector<ShaderStage>& stages) {
+	std::lock_guard<std::mutex> lock(reloadMutex);
+	for (const ShaderStage& stage : stages) {
+		if (std::find(watchedPaths.begin(), watchedPaths.end(), stage.path) == watchedPaths.end()) {
+			watchedPaths.push_back(stage.path);
+		}
+	}
+}
+
+void watchShaderProgram(ShaderProgram& sp) {
+	watchedPrograms.push_back(&sp);
+	watchStages(sp.stages);
+}
+
+void watchShaderVariants(ShaderVariants& sv) {
+	watchedVariants.push_back(&sv);
+	watchStages(sv.stages);
+}
+
+static bool usesAnyPath(const ShaderProgram& sp, const std::vector<std::string>& paths) {
+	for (const ShaderStage& stage : sp.stages) {
+		if (std::find(paths.begin(), paths.end(), stage.path) != paths.end()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void queueReload(ShaderProgram& sp, std::vector<ReloadJob>& jobs) {
+	jobs.push_back({&sp, sp.stages, sp.defines});
+}
+
+void updateShaderReload() {
+	if (!reloadWindow) {
+		return;
+	}
+
+	std::vector<ReloadResult> results;
+	std::vector<std::string> changed;
+	{
+		std::lock_guard<std::mutex> lock(reloadMutex);
+		results.swap(finishedBuilds);
+		changed.swap(changedPaths);
+	}
+
+	for (const ReloadResult& res : results) {
+		replaceShaderProgram(*res.target, res.program);
+	}
+	if (!results.empty()) {
+		printf("Reloaded %zu shader program(s).\n", results.size());
+	}
+
+	if (changed.empty()) {
+		return;
+	}
+
+	std::vector<ReloadJob> jobs;
+	for (ShaderProgram* sp : watchedPrograms) {
+		if (usesAnyPath(*sp, changed)) {
+			queueReload(*sp, jobs);
+		}
+	}
+	for (ShaderVariants* sv : watchedVariants) {
+		for (auto& it : sv->variants) {
+			if (usesAnyPath(it.second, changed)) {
+				queueReload(it.second, jobs);
+			}
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(reloadMutex);
+		pendingJobs.insert(pendingJobs.end(), jobs.begin(), jobs.end());
+	}
+	reloadCond.notify_one();
+}
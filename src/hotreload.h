@@ -0,0 +1,20 @@
+#pragma once
+
+#include "shader.h"
+
+struct GLFWwindow;
+
+// Rebuilds shader programs in the background whenever one of their source files changes.
+// A worker thread polls the sources and compiles on its own GL context, shared with the main
+// window, so the render loop never waits on the compiler. A build that fails keeps the old program.
+bool startShaderReload(GLFWwindow* window);
+void stopShaderReload();
+
+// The watched objects must outlive the reload worker.
+void watchShaderProgram(ShaderProgram& sp);
+// Covers every variant, including ones requested after this call.
+void watchShaderVariants(ShaderVariants& sv);
+
+// Call at the start of a frame, on the main thread. Swaps in programs finished since the last
+// frame and hands newly changed sources to the worker.
+void updateShaderReload();
@@ -0,0 +1,70 @@
+#include "instancing.h"
+#include "geometry.h"
+#include "glstate.h"
+
+#include <cstddef>
+
+void createInstancedMesh(InstancedMesh& mesh, const std::vector<float>& vertexData) {
+	// readObjectFile emits three vertices per triangle, most of them shared with neighbours.
+	const size_t vertexSize = vertexFormatSize(VERTEX_FORMAT_STANDARD);
+	std::vector<unsigned char> vertices;
+	std::vector<uint32_t> indices;
+	indexVertices(vertexData.data(), vertexSize, vertexData.size() / standardVertexFloats, vertices, indices);
+	mesh.indexCount = static_cast<int>(indices.size());
+	mesh.vertexCount = static_cast<int>(vertices.size() / vertexSize);
+
+	glGenVertexArrays(1, &mesh.vao);
+	bindVertexArray(mesh.vao);
+
+	glGenBuffers(1, &mesh.vertexBuffer);
+	bindBuffer(GL_ARRAY_BUFFER, mesh.vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(vertices.size()), vertices.data(), GL_STATIC_DRAW);
+
+	glGenBuffers(1, &mesh.indexBuffer);
+	bindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, static_cast<GLsizeiptr>(indices.size() * sizeof(uint32_t)), indices.data(), GL_STATIC_DRAW);
+
+	setupVertexFormat(VERTEX_FORMAT_STANDARD);
+
+	// The instance attributes are pointed at the frame ring when drawing, only their
+	// divisor is fixed here.
+	for (unsigned i = 0; i < 4; ++i) {
+		glEnableVertexAttribArray(instanceModelLocation + i);
+		glVertexAttribDivisor(instanceModelLocation + i, 1);
+	}
+	glEnableVertexAttribArray(instanceMaterialLocation);
+	glVertexAttribDivisor(instanceMaterialLocation, 1);
+}
+
+void deleteInstancedMesh(InstancedMesh& mesh) {
+	deleteBuffer(mesh.indexBuffer);
+	deleteBuffer(mesh.vertexBuffer);
+	deleteVertexArray(mesh.vao);
+	mesh = InstancedMesh();
+}
+
+void uploadInstances(InstancedMesh& mesh, FrameRing& ring) {
+	if (!mesh.instances.empty()) {
+		mesh.instanceOffset = ringUpload(ring, mesh.instances.data(), mesh.instances.size() * sizeof(InstanceData));
+	}
+}
+
+void drawInstancedMesh(InstancedMesh& mesh, const FrameRing& ring) {
+	if (mesh.instances.empty()) {
+		return;
+	}
+
+	// There is no base instance in GL 3.3, so the attributes follow the data instead.
+	bindVertexArray(mesh.vao);
+	bindBuffer(GL_ARRAY_BUFFER, ring.buffer);
+	const int stride = sizeof(InstanceData);
+	size_t instanceOffset = ringBufferOffset(ring, mesh.instanceOffset);
+	for (unsigned i = 0; i < 4; ++i) {
+		size_t column = instanceOffset + offsetof(InstanceData, model) + i * sizeof(glm::vec4);
+		glVertexAttribPointer(instanceModelLocation + i, 4, GL_FLOAT, GL_FALSE, stride, reinterpret_cast<void*>(column));
+	}
+	size_t material = instanceOffset + offsetof(InstanceData, material);
+	glVertexAttribIPointer(instanceMaterialLocation, 1, GL_UNSIGNED_INT, stride, reinterpret_cast<void*>(material));
+
+	glDrawElementsInstanced(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_INT, 0, static_cast<GLsizei>(mesh.instances.size()));
+}
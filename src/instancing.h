@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "framering.h"
+
+#include <glm/glm.hpp>
+
+// Per-instance vertex attributes, read with a divisor of 1. The model matrix takes locations
+// 5 to 8, one column each, the material index location 9. Matches the INSTANCED shader variant.
+struct InstanceData {
+	glm::mat4 model;
+	uint32_t material;
+};
+
+const unsigned instanceModelLocation = 5;
+const unsigned instanceMaterialLocation = 9;
+
+// An indexed mesh drawn many times with one glDrawElementsInstanced.
+struct InstancedMesh {
+	unsigned vao = 0;
+	unsigned vertexBuffer = 0;
+	unsigned indexBuffer = 0;
+	int indexCount = 0;
+	int vertexCount = 0;
+
+	std::vector<InstanceData> instances;
+	// Frame ring region offset of this frame's instances.
+	size_t instanceOffset = 0;
+};
+
+// vertexData is interleaved like readObjectFile builds it: position, uv, normal, tangent,
+// bitangent, 14 floats per vertex, three per triangle. Identical vertices are merged.
+void createInstancedMesh(InstancedMesh& mesh, const std::vector<float>& vertexData);
+void deleteInstancedMesh(InstancedMesh& mesh);
+
+// Copies mesh.instances into the frame ring, before finishFrameRing.
+void uploadInstances(InstancedMesh& mesh, FrameRing& ring);
+// Draws the uploaded instances, after finishFrameRing. The program must be current.
+void drawInstancedMesh(InstancedMesh& mesh, const FrameRing& ring);
@@ -0,0 +1,115 @@
+#include "jobs.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static std::vector<std::thread> workers;
+
+// Everything below the mutex is shared with the workers. The loop parameters are only changed
+// while no worker is inside a loop.
+static std::mutex jobMutex;
+static std::condition_variable jobCond;
+static std::condition_variable doneCond;
+static bool jobStop = false;
+static unsigned long long jobGeneration = 0;
+static int activeWorkers = 0;
+static const std::function<void(size_t, size_t)>* jobFn = nullptr;
+static size_t jobCount = 0;
+static size_t jobGrain = 1;
+static std::atomic<size_t> jobNext(0);
+static std::atomic<size_t> jobDone(0);
+
+// Claims ranges until there are none left.
+static void runRanges(const std::function<void(size_t, size_t)>& fn, size_t count, size_t grain) {
+	for (;;) {
+		size_t begin = jobNext.fetch_add(grain);
+		if (begin >= count) {
+			break;
+		}
+		size_t end = std::min(begin + grain, count);
+		fn(begin, end);
+		jobDone.fetch_add(end - begin);
+	}
+}
+
+static void jobWorker() {
+	unsigned long long seen = 0;
+	std::unique_lock<std::mutex> lock(jobMutex);
+	for (;;) {
+		jobCond.wait(lock, [&]() { return jobStop || jobGeneration != seen; });
+		if (jobStop) {
+			break;
+		}
+		seen = jobGeneration;
+		// If this wakes after the loop is over, no range is left and fn is never called.
+		const std::function<void(size_t, size_t)>& fn = *jobFn;
+		size_t count = jobCount;
+		size_t grain = jobGrain;
+		++activeWorkers;
+		lock.unlock();
+
+		runRanges(fn, count, grain);
+
+		lock.lock();
+		--activeWorkers;
+		doneCond.notify_all();
+	}
+}
+
+void startJobWorkers(int count) {
+	if (count < 0) {
+		count = static_cast<int>(std::thread::hardware_concurrency()) - 1;
+	}
+	jobStop = false;
+	for (int i = 0; i < count; ++i) {
+		workers.emplace_back(jobWorker);
+	}
+}
+
+void stopJobWorkers() {
+	{
+		std::lock_guard<std::mutex> lock(jobMutex);
+		jobStop = true;
+	}
+	jobCond.notify_all();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+	workers.clear();
+}
+
+int jobThreadCount() {
+	return static_cast<int>(workers.size()) + 1;
+}
+
+void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& fn) {
+	grain = std::max<size_t>(grain, 1);
+	if (workers.empty() || count <= grain) {
+		if (count > 0) {
+			fn(0, count);
+		}
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(jobMutex);
+		// A worker that woke up late for the previous loop may still be on its way out.
+		doneCond.wait(lock, []() { return activeWorkers == 0; });
+		jobFn = &fn;
+		jobCount = count;
+		jobGrain = grain;
+		jobNext = 0;
+		jobDone = 0;
+		++jobGeneration;
+	}
+	jobCond.notify_all();
+
+	runRanges(fn, count, grain);
+
+	std::unique_lock<std::mutex> lock(jobMutex);
+	doneCond.wait(lock, [&]() { return jobDone == count && activeWorkers == 0; });
+}
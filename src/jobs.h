@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+// A fixed set of worker threads for data parallel loops. Only the main thread submits work,
+// one loop at a time, and helps with it while it waits.
+void startJobWorkers(int count = -1);
+void stopJobWorkers();
+// Threads a loop is spread over, the calling thread included. 1 when no workers are running.
+int jobThreadCount();
+
+// Calls fn(begin, end) over [0, count) in ranges of grain items and returns once all are done.
+// Runs inline when there is only one range or no workers.
+void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& fn);
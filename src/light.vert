@@ -1,11 +1,12 @@
 #version 330
 
 layout (location = 0) in vec3 inPos;
-uniform mat4 proj;
-uniform mat4 model;
-uniform mat4 view;
+layout (std140) uniform ObjectData {
+	mat4 model;
+	mat4 modelViewProj;
+};
 
 void main() {
-	gl_Position = proj * view * model * vec4(inPos, 1.0);
+	gl_Position = modelViewProj * vec4(inPos, 1.0);
 }
 
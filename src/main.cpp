@@ -1,14 +1,42 @@
 #include <cstdio>
+#include <cstdlib>
 #include <cmath>
 #include <cstring>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cfloat>
 
+#include <chrono>
+#include <thread>
 #include <vector>
 
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
 #include "../include/glad/glad.h"
 
+#include "blocks.h"
+#include "clusteredlighting.h"
+#include "culling.h"
+#include "depthprepass.h"
+#include "framepacing.h"
+#include "framering.h"
+#include "geometry.h"
+#include "glstate.h"
+#include "gpuscene.h"
+#include "hotreload.h"
+#include "instancing.h"
+#include "jobs.h"
+#include "occlusion.h"
+#include "pvs.h"
+#include "renderqueue.h"
+#include "shader.h"
+#include "shadinglod.h"
+#include "softocclusion.h"
+#include "staticbatch.h"
+#include "uniforms.h"
+#include "vertexpulling.h"
+
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -26,7 +54,7 @@ static void keyCallback(GLFWwindow* window, int key, int scancode, int action, i
 }
 
 static void resizeCallback(GLFWwindow* window, int width, int height) {
-	glViewport(0, 0, width, height);
+	setViewport(0, 0, width, height);
 }
 
 float yaw = 0.f;
@@ -75,7 +103,7 @@ unsigned readTexture(const char* imageFile, int width, int height) {
 
 	unsigned tex;
 	glGenTextures(1, &tex);
-	glBindTexture(GL_TEXTURE_2D, tex);
+	bindTexture(0, GL_TEXTURE_2D, tex);
 
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
@@ -89,77 +117,6 @@ unsigned readTexture(const char* imageFile, int width, int height) {
 	return tex;
 }
 
-unsigned readShader(const char* path, GLenum type) {
-	FILE* fp = fopen(path, "r");
-	if (!fp) {
-		printf("Failed to open shader %s.\n", path);
-		return 0;
-	}
-
-	const int bufSize = 4096;
-	char* buf = static_cast<char*>(malloc(bufSize));
-	memset(buf, 0, bufSize);
-
-	fread(buf, 1, bufSize - 1, fp);
-	fclose(fp);
-
-	unsigned shader = glCreateShader(type);
-	glShaderSource(shader, 1, &buf, NULL);
-	glCompileShader(shader);
-
-	int success = 1;
-	glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
-	if (!success) {
-		printf("Problem with compilation of %s shader!\n", path);
-		char info[512];
-		glGetShaderInfoLog(shader, 512, NULL, info);
-		printf("Shader info log: %s\n", info);
-	}
-
-	free(buf);
-	return shader;
-}
-
-unsigned createShaderProgram(std::initializer_list<unsigned> shaders) {
-	unsigned program = glCreateProgram();
-	for (unsigned shader : shaders) {
-		glAttachShader(program, shader);
-	}
-	glLinkProgram(program);
-
-	int success = 1;
-	glGetProgramiv(program, GL_LINK_STATUS, &success);
-	if (!success) {
-		printf("Problem with linking of shading program!\n");
-		char info[512];
-		glGetProgramInfoLog(program, 512, NULL, info);
-		printf("Program info log: %s\n", info);
-	}
-
-	return program;
-}
-
-void setProgramUniform(unsigned program, const glm::mat4& mat, const char* name) {
-	glUseProgram(program);
-	int location = glGetUniformLocation(program, name);
-	glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(mat));
-}
-
-void setProgramUniform(unsigned program, const glm::vec3& v, const char* name) {
-	glUseProgram(program);
-	int location = glGetUniformLocation(program, name);
-	glUniform3f(location, v[0], v[1], v[2]);
-}
-
-void setProgramTexture(unsigned program, unsigned tex, int slot, const char* name) {
-	glUseProgram(program);
-	GLenum enumSlot = (GLenum)(GL_TEXTURE0 + slot); // Get the correct enum slot
-	glActiveTexture(enumSlot);
-	glBindTexture(GL_TEXTURE_2D, tex);
-	int location = glGetUniformLocation(program, name);
-	glUniform1i(location, slot);
-}
-
 glm::vec3 calculateNormal(const glm::vec3& pos1, const glm::vec3& pos2, const glm::vec3& pos3) {
 	return glm::cross(pos2 - pos1, pos3 - pos2);
 }
@@ -216,11 +173,13 @@ void appendToVertexBuffer(std::vector<float>& buffer, glm::vec3 v) {
 	buffer.insert(buffer.end(), ptr, ptr + 3);
 }
 
-unsigned readObjectFile(const char* path, int normalsMode, int& renderCount) {
+// Fills bufferData with 14 floats per vertex, three vertices per triangle: position, uv, normal,
+// tangent, bitangent. In normals mode it is a cloud of points to draw the normals at instead.
+bool parseObjectFile(const char* path, int normalsMode, std::vector<float>& bufferData, int& renderCount) {
 	FILE* fp = fopen(path, "r");
 	if (!fp) {
 		printf("Failed to open asset %s.\n", path);
-		return 0;
+		return false;
 	}
 
 	const int bufSize = 4096;
@@ -230,7 +189,7 @@ unsigned readObjectFile(const char* path, int normalsMode, int& renderCount) {
 	std::vector<glm::vec2> vt;
 	std::vector<glm::vec3> vn;
 
-	std::vector<float> bufferData;
+	bufferData.clear();
 	renderCount = 0;
 	while(fgets(buf, 4096, fp)) {
 		if (buf[0] == 'v') {
@@ -327,30 +286,158 @@ unsigned readObjectFile(const char* path, int normalsMode, int& renderCount) {
 		}
 	}
 	free(buf);
+	fclose(fp);
+	return true;
+}
+
+// Adds the mesh to the arena, converted to the arena's vertex format. Returns the mesh id, -1 on failure.
+int readObjectFile(GeometryArena& arena, const char* path, int normalsMode) {
+	std::vector<float> bufferData;
+	int renderCount = 0;
+	if (!parseObjectFile(path, normalsMode, bufferData, renderCount)) {
+		return -1;
+	}
+
+	size_t numVertices = bufferData.size() / standardVertexFloats;
+	int mesh;
+	if (arena.format == VERTEX_FORMAT_PACKED) {
+		std::vector<PackedVertex> packed = packVertices(bufferData);
+		mesh = addArenaMesh(arena, packed.data(), numVertices);
+	} else {
+		mesh = addArenaMesh(arena, bufferData.data(), numVertices);
+	}
 
-	unsigned vao;
-	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
-
-	unsigned vbo;
-	glGenBuffers(1, &vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	int bufferSize = static_cast<int>(bufferData.size() * sizeof(float));
-	glBufferData(GL_ARRAY_BUFFER, bufferSize, bufferData.data(), GL_STATIC_DRAW);
-
-	// Points, uv coordinates, normals, tangent, bitangent.
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), 0);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 14 * sizeof(float), reinterpret_cast<void*>(3 * sizeof(float)));
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), reinterpret_cast<void*>(5 * sizeof(float)));
-	glEnableVertexAttribArray(2);
-	glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), reinterpret_cast<void*>(8 * sizeof(float)));
-	glEnableVertexAttribArray(3);
-	glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 14 * sizeof(float), reinterpret_cast<void*>(11 * sizeof(float)));
-	glEnableVertexAttribArray(4);
-
-	return vao;
+	glm::vec3 boundsMin(FLT_MAX);
+	glm::vec3 boundsMax(-FLT_MAX);
+	for (size_t i = 0; i < numVertices; ++i) {
+		const float* pos = &bufferData[i * standardVertexFloats];
+		glm::vec3 p(pos[0], pos[1], pos[2]);
+		boundsMin = glm::min(boundsMin, p);
+		boundsMax = glm::max(boundsMax, p);
+	}
+	arena.meshes[static_cast<size_t>(mesh)].boundsMin = boundsMin;
+	arena.meshes[static_cast<size_t>(mesh)].boundsMax = boundsMax;
+	return mesh;
+}
+
+// Culls random boxes around the camera with every path, one thread and all of them.
+static void benchmarkCulling(const glm::mat4& viewProj, size_t count) {
+	CullingSet set;
+	for (size_t i = 0; i < count; ++i) {
+		glm::vec3 center(rand() % 400 - 200, rand() % 40 - 20, rand() % 400 - 200);
+		glm::vec3 extent(0.5f + (rand() % 100) * 0.02f);
+		addCullingBounds(set, center - extent, center + extent);
+	}
+
+	const int iterations = 20;
+	const CullingPath paths[] = {CULL_SCALAR, CULL_SSE, CULL_AVX};
+	for (CullingPath path : paths) {
+		for (int threaded = 0; threaded < 2; ++threaded) {
+			float totalMs = 0.f;
+			for (int i = 0; i < iterations; ++i) {
+				cullBounds(set, viewProj, path, threaded != 0);
+				totalMs += set.cullMs;
+			}
+			float perObjectMs = totalMs / iterations / static_cast<float>(count);
+			printf("Culling %s, %d threads: %.3f ms per 100k objects (%d of %d visible).\n",
+				cullingPathName(path), threaded ? jobThreadCount() : 1, perObjectMs * 100000.f,
+				set.visibleCount, static_cast<int>(count));
+		}
+	}
+}
+
+// Fills two blocks of a small ring's second region around an allocation that grows the buffer,
+// then reads them back through ringBufferOffset. The growth moves the region, the data of the
+// block written before it must move along.
+static bool checkFrameRingGrow() {
+	FrameRing ring;
+	createFrameRing(ring, 4096, 2);
+	beginFrameRing(ring, 1);
+	std::vector<unsigned char> before(256), after(256);
+	for (size_t i = 0; i < before.size(); ++i) {
+		before[i] = static_cast<unsigned char>(i);
+		after[i] = static_cast<unsigned char>(255 - i);
+	}
+	size_t beforeOffset = ringUpload(ring, before.data(), before.size());
+	ringAllocate(ring, 3 * ring.regionSize);
+	size_t afterOffset = ringUpload(ring, after.data(), after.size());
+	finishFrameRing(ring);
+
+	std::vector<unsigned char> readBefore(before.size()), readAfter(after.size());
+	bindBuffer(GL_COPY_READ_BUFFER, ring.buffer);
+	glGetBufferSubData(GL_COPY_READ_BUFFER, static_cast<GLintptr>(ringBufferOffset(ring, beforeOffset)),
+		static_cast<GLsizeiptr>(readBefore.size()), readBefore.data());
+	glGetBufferSubData(GL_COPY_READ_BUFFER, static_cast<GLintptr>(ringBufferOffset(ring, afterOffset)),
+		static_cast<GLsizeiptr>(readAfter.size()), readAfter.data());
+	bool grew = ring.stats.grows > 0;
+	deleteFrameRing(ring);
+	return grew && readBefore == before && readAfter == after;
+}
+
+// Draws the static chunks iterations times through their vertex array, through the position-only
+// vertex array and pulled from buffer textures, with rasterization off so only vertex fetch and
+// transform are timed. Attributes the position-only array leaves disabled read as constants.
+static void benchmarkVertexFetch(const StaticBatch& batch, GeometryArena& arena, ShaderVariants& shaders, int iterations) {
+	ShaderVariantKey pulledKey;
+	pulledKey.vertexPulling = true;
+	ShaderProgram* programs[2] = {&requestShaderVariant(shaders, ShaderVariantKey()), &requestShaderVariant(shaders, pulledKey)};
+	for (ShaderProgram* sp : programs) {
+		while (!pollShaderProgram(*sp)) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		if (sp->failed) {
+			printf("Vertex fetch benchmark skipped, a program failed to build.\n");
+			return;
+		}
+	}
+	bool pulling = enableVertexPulling(arena);
+	if (!pulling) {
+		printf("Vertex fetch benchmark: the arena is past GL_MAX_TEXTURE_BUFFER_SIZE, not pulling.\n");
+	}
+
+	// The transforms do not matter with nothing rasterized, the blocks just have to be backed.
+	unsigned blockBuffer;
+	glGenBuffers(1, &blockBuffer);
+	bindBuffer(GL_UNIFORM_BUFFER, blockBuffer);
+	std::vector<unsigned char> zeros(sizeof(FrameData), 0);
+	glBufferData(GL_UNIFORM_BUFFER, static_cast<GLsizeiptr>(zeros.size()), zeros.data(), GL_STATIC_DRAW);
+	bindBufferRange(GL_UNIFORM_BUFFER, FRAME_DATA_BINDING, blockBuffer, 0, sizeof(FrameData));
+	bindBufferRange(GL_UNIFORM_BUFFER, OBJECT_DATA_BINDING, blockBuffer, 0, sizeof(ObjectData));
+
+	unsigned query;
+	glGenQueries(1, &query);
+	glEnable(GL_RASTERIZER_DISCARD);
+	const char* paths[3] = {"vertex array", "positions only", "pulled from buffer textures"};
+	for (int path = 0; path < (pulling ? 3 : 2); ++path) {
+		bool pulled = path == 2;
+		unsigned program = programs[pulled ? 1 : 0]->program;
+		UniformTable& uniforms = programUniforms(program);
+		useProgram(program);
+		bindVertexArray(pulled ? pullingVertexArray() : path == 1 ? arena.positionVao : arena.vao);
+		long long vertices = 0;
+		glBeginQuery(GL_TIME_ELAPSED, query);
+		for (int i = 0; i < iterations; ++i) {
+			for (const StaticChunk& chunk : batch.chunks) {
+				if (pulled) {
+					drawPulledPacket(makePulledDrawPacket(arena, chunk.mesh, program, chunk.material, GL_TRIANGLES), uniforms);
+				} else {
+					const ArenaMesh& mesh = arena.meshes[static_cast<size_t>(chunk.mesh)];
+					glDrawElementsBaseVertex(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_INT,
+						reinterpret_cast<const void*>(static_cast<size_t>(mesh.firstIndex) * sizeof(uint32_t)), mesh.baseVertex);
+				}
+				vertices += arena.meshes[static_cast<size_t>(chunk.mesh)].indexCount;
+			}
+		}
+		glEndQuery(GL_TIME_ELAPSED);
+		GLuint64 elapsedNs = 0;
+		glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsedNs);
+		double ms = static_cast<double>(elapsedNs) / 1e6;
+		printf("Vertex fetch, %s: %lld vertices in %.2f ms, %.1f M vertices/s.\n",
+			paths[path], vertices, ms, ms > 0.0 ? vertices / ms / 1000.0 : 0.0);
+	}
+	glDisable(GL_RASTERIZER_DISCARD);
+	glDeleteQueries(1, &query);
+	deleteBuffer(blockBuffer);
 }
 
 int main() {
@@ -361,11 +448,18 @@ int main() {
 
 	glfwSetErrorCallback(errorCallback);
 	
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	// GL 4.5 for the GPU driven path where the driver has it, see gpuscene.h. Everything else
+	// only needs 3.3.
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
 	int windowWidth = 800;
 	int windowHeight = 600;
 	GLFWwindow* window = glfwCreateWindow(windowWidth, windowHeight, "Lecture 1", NULL, NULL);
+	if (!window) {
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		window = glfwCreateWindow(windowWidth, windowHeight, "Lecture 1", NULL, NULL);
+	}
 	glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 	glfwSetCursorPosCallback(window, mouseCallback);  
 	glfwSetKeyCallback(window, keyCallback);
@@ -376,55 +470,375 @@ int main() {
 		return 1;
 	}
 
-	glViewport(0, 0, 800, 600);
+	invalidateGLState();
+	setViewport(0, 0, 800, 600);
+	// RENDER_BACKEND=gl33 sticks to the GL 3.3 path even where 4.5 is there.
+	const char* backendEnv = getenv("RENDER_BACKEND");
+	bool gpuDriven = gpuDrivenSupported() && !(backendEnv && strcmp(backendEnv, "gl33") == 0);
+	printf("Render backend: %s.\n", gpuDriven ? "GL 4.5, GPU driven" : "GL 3.3");
 	glfwSetFramebufferSizeCallback(window, resizeCallback);
 
-	glEnable(GL_DEPTH_TEST);
-
-	unsigned vertexShader = readShader("src/vert.glsl", GL_VERTEX_SHADER);
-	unsigned fragmentShader = readShader("src/frag.glsl", GL_FRAGMENT_SHADER);
+	setDepthTest(true);
+
+	initShaderPipeline();
+	// SHADERS_FROM_DISK=1 reads the shaders from src/ instead of the copies built into the
+	// executable, and reloads them as they are edited.
+	shaderSourcesFromDisk = getenv("SHADERS_FROM_DISK") != NULL;
+
+	// Compiles run in the background (or at least back to back) and are only checked once a
+	// program is first drawn with. Until then the fallback program is used.
+	double shaderStart = glfwGetTime();
+	ShaderVariants phongShaders;
+	phongShaders.stages = {
+		{"src/vert.glsl", GL_VERTEX_SHADER},
+		{"src/frag.glsl", GL_FRAGMENT_SHADER}
+	};
+	// Only the variants asked for are compiled. Request the one used for the box now so it
+	// compiles alongside the other programs.
+	// TANGENT_SPACE_LIGHTING=1 lights the boxes in tangent space, see ShaderVariantKey.
+	// CLUSTERED_LIGHTS=n adds n point lights through clustered forward shading, see
+	// clusteredlighting.h, which takes precedence over tangent space lighting.
+	const bool packedVertices = false;
+	const bool tangentSpaceLighting = getenv("TANGENT_SPACE_LIGHTING") != NULL;
+	const char* clusteredLightsEnv = getenv("CLUSTERED_LIGHTS");
+	const int clusteredLightCount = clusteredLightsEnv && atoi(clusteredLightsEnv) > 0 ? atoi(clusteredLightsEnv) : 0;
+	const bool clusteredLighting = clusteredLightCount > 0;
+	ShaderVariantKey boxVariant;
+	boxVariant.packedVertices = packedVertices;
+	boxVariant.tangentSpaceLighting = tangentSpaceLighting;
+	boxVariant.clusteredLighting = clusteredLighting;
+	requestShaderVariant(phongShaders, boxVariant);
+	// Same material for the instanced field of boxes.
+	ShaderVariantKey instancedVariant;
+	instancedVariant.instanced = true;
+	instancedVariant.tangentSpaceLighting = tangentSpaceLighting;
+	instancedVariant.clusteredLighting = clusteredLighting;
+	requestShaderVariant(phongShaders, instancedVariant);
+	// Static batches are always in the standard vertex format.
+	ShaderVariantKey staticVariant;
+	staticVariant.tangentSpaceLighting = tangentSpaceLighting;
+	staticVariant.clusteredLighting = clusteredLighting;
+	requestShaderVariant(phongShaders, staticVariant);
+	// VERTEX_PULLING=1 draws the boxes and the static batch with one program that reads the
+	// vertices itself, see vertexpulling.h. The boxes then come from the packed arena, the
+	// static batch from the standard one, with no vertex array switch between them.
+	bool vertexPulling = getenv("VERTEX_PULLING") != NULL;
+	ShaderVariantKey pulledVariant;
+	pulledVariant.vertexPulling = true;
+	pulledVariant.tangentSpaceLighting = tangentSpaceLighting;
+	pulledVariant.clusteredLighting = clusteredLighting;
+	if (vertexPulling) {
+		requestShaderVariant(phongShaders, pulledVariant);
+	}
+	// Boxes, static chunks and the GPU scene switch to cheaper variants as they get small on
+	// screen, see shadinglod.h. SHADING_LOD=0 keeps the full one.
+	const char* shadingLodEnv = getenv("SHADING_LOD");
+	const bool shadingLodEnabled = !(shadingLodEnv && strcmp(shadingLodEnv, "0") == 0);
+	ShaderVariantKey boxKey = vertexPulling ? pulledVariant : boxVariant;
+	ShaderVariantKey staticKey = vertexPulling ? pulledVariant : staticVariant;
+	for (int lod = 1; shadingLodEnabled && lod < shadingLodCount; ++lod) {
+		requestShaderVariant(phongShaders, shadingLodVariant(boxKey, static_cast<ShadingLod>(lod)));
+		requestShaderVariant(phongShaders, shadingLodVariant(staticKey, static_cast<ShadingLod>(lod)));
+		if (gpuDriven) {
+			requestShaderVariant(phongShaders, shadingLodVariant(instancedVariant, static_cast<ShadingLod>(lod)));
+		}
+	}
+	// DEPTH_PREPASS=on or off, decided from the measured overdraw otherwise. The opaque pass then
+	// goes out depth only first, with the depth variants of its programs, see depthprepass.h.
+	const char* depthPrepassEnv = getenv("DEPTH_PREPASS");
+	DepthPrepassMode depthPrepassMode = DEPTH_PREPASS_AUTO;
+	if (depthPrepassEnv && strcmp(depthPrepassEnv, "on") == 0) {
+		depthPrepassMode = DEPTH_PREPASS_ON;
+	} else if (depthPrepassEnv && strcmp(depthPrepassEnv, "off") == 0) {
+		depthPrepassMode = DEPTH_PREPASS_OFF;
+	}
+	if (depthPrepassMode != DEPTH_PREPASS_OFF) {
+		requestShaderVariant(phongShaders, depthPrepassVariant(boxVariant));
+		requestShaderVariant(phongShaders, depthPrepassVariant(instancedVariant));
+		requestShaderVariant(phongShaders, depthPrepassVariant(staticVariant));
+		if (vertexPulling) {
+			requestShaderVariant(phongShaders, depthPrepassVariant(pulledVariant));
+		}
+	}
 	// Shading program for the box light
-	unsigned lightVertShader = readShader("src/light.vert", GL_VERTEX_SHADER);
-	unsigned lightFragShader = readShader("src/light.frag", GL_FRAGMENT_SHADER);
+	ShaderProgram lightShader = submitShaderProgram({
+		{"src/light.vert", GL_VERTEX_SHADER},
+		{"src/light.frag", GL_FRAGMENT_SHADER}
+	});
 	// Shading program to display normals
-	unsigned normalVertShader = readShader("src/normal.vert", GL_VERTEX_SHADER);
-	unsigned normalGeomShader = readShader("src/normal.geom", GL_GEOMETRY_SHADER);
-	unsigned normalFragShader = readShader("src/normal.frag", GL_FRAGMENT_SHADER);
-
-	unsigned program = createShaderProgram({vertexShader, fragmentShader});
-	unsigned lightProgram = createShaderProgram({lightVertShader, lightFragShader});
-	unsigned normalProgram = createShaderProgram({normalVertShader, normalGeomShader, normalFragShader});
-
-	glDeleteShader(vertexShader);
-	glDeleteShader(fragmentShader);
-	glDeleteShader(lightVertShader);
-	glDeleteShader(lightFragShader);
-	glDeleteShader(normalVertShader);
-	glDeleteShader(normalFragShader);
-
-	int renderCountTri = 0;
-	unsigned vao = readObjectFile("/home/stef/Downloads/CubeManual.obj", false, renderCountTri);
-	int renderCountNormals = 0;
-	unsigned normalVao = readObjectFile("/home/stef/Downloads/CubeManual.obj", true, renderCountNormals);
+	ShaderProgram normalShader = submitShaderProgram({
+		{"src/normal.vert", GL_VERTEX_SHADER},
+		{"src/normal.geom", GL_GEOMETRY_SHADER},
+		{"src/normal.frag", GL_FRAGMENT_SHADER}
+	});
+	// Frustum and occlusion culling of the GPU driven path.
+	ShaderProgram cullShader;
+	if (gpuDriven) {
+		cullShader = submitShaderProgram({{"src/cull.comp", GL_COMPUTE_SHADER}});
+	}
+	printf("Shader programs submitted in %.1f ms (%d cached, %d compiled, %d rejected), cache saved %.1f ms.\n",
+		(glfwGetTime() - shaderStart) * 1000.0, shaderCacheStats.hits, shaderCacheStats.misses,
+		shaderCacheStats.rejected, shaderCacheStats.savedMs);
+
+	// Recompile shaders in the background when their sources are edited.
+	const bool hotReload = shaderSourcesFromDisk;
+	if (hotReload && startShaderReload(window)) {
+		watchShaderVariants(phongShaders);
+		watchShaderProgram(lightShader);
+		watchShaderProgram(normalShader);
+		if (gpuDriven) {
+			watchShaderProgram(cullShader);
+		}
+	}
+
+	// All meshes of a vertex format share one set of buffers and one vertex array.
+	GeometryArena standardGeometry;
+	createGeometryArena(standardGeometry, VERTEX_FORMAT_STANDARD, 64 * 1024, 64 * 1024);
+	GeometryArena packedGeometry;
+	createGeometryArena(packedGeometry, VERTEX_FORMAT_PACKED, 64 * 1024, 64 * 1024);
+	GeometryArena& boxGeometry = packedVertices ? packedGeometry : standardGeometry;
+	int boxMesh = readObjectFile(boxGeometry, "/home/stef/Downloads/CubeManual.obj", false);
+	int normalMesh = readObjectFile(standardGeometry, "/home/stef/Downloads/CubeManual.obj", true);
+	if (boxMesh < 0 || normalMesh < 0) {
+		return 1;
+	}
+	int pulledBoxMesh = -1;
+	if (vertexPulling) {
+		enableVertexPulling(standardGeometry);
+		enableVertexPulling(packedGeometry);
+		pulledBoxMesh = &boxGeometry == &packedGeometry ? boxMesh : readObjectFile(packedGeometry, "/home/stef/Downloads/CubeManual.obj", false);
+	}
+
+	// INSTANCES=100000 draws that many extra boxes in a field below the scene, in one call.
+	const char* instancesEnv = getenv("INSTANCES");
+	int instanceCount = instancesEnv ? atoi(instancesEnv) : 1024;
+	std::vector<float> boxVertexData;
+	int boxVertexCount = 0;
+	parseObjectFile("/home/stef/Downloads/CubeManual.obj", false, boxVertexData, boxVertexCount);
+	InstancedMesh instancedBox;
+	if (instanceCount > 0) {
+		createInstancedMesh(instancedBox, boxVertexData);
+	}
+	const float instanceSpacing = 3.f;
+	int instanceRowLength = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(instanceCount))));
+	auto instanceOffset = [&](int i) {
+		return glm::vec3(
+			(i % instanceRowLength - 0.5f * instanceRowLength) * instanceSpacing,
+			-8.f,
+			(i / instanceRowLength - 0.5f * instanceRowLength) * instanceSpacing);
+	};
+	// Instances spin around y in place, so their bounds are fixed: the box swept around its axis.
+	CullingSet instanceCulling;
+	{
+		const ArenaMesh& box = boxGeometry.meshes[static_cast<size_t>(boxMesh)];
+		glm::vec3 corner = glm::max(glm::abs(box.boundsMin), glm::abs(box.boundsMax));
+		float radius = glm::length(glm::vec2(corner.x, corner.z));
+		for (int i = 0; i < instanceCount; ++i) {
+			glm::vec3 offset = instanceOffset(i);
+			addCullingBounds(instanceCulling,
+				offset + glm::vec3(-radius, box.boundsMin.y, -radius),
+				offset + glm::vec3(radius, box.boundsMax.y, radius));
+		}
+	}
 
 	unsigned diffuseTex = readTexture("/home/stef/Downloads/box_diffuse.rgb", 500, 500);
 	unsigned specularTex = readTexture("/home/stef/Downloads/box_specular.rgb", 500, 500);
 	unsigned normalTex = readTexture("/home/stef/Downloads/normalmap.rgb", 512, 512);
 
+	// FRAME_QUEUE_DEPTH frames may be in flight at once, 2 by default, see framepacing.h.
+	const char* frameQueueDepthEnv = getenv("FRAME_QUEUE_DEPTH");
+	FramePacing framePacing;
+	initFramePacing(framePacing, frameQueueDepthEnv ? atoi(frameQueueDepthEnv) : 2);
+	// Dynamic data of each frame in flight, see framering.h. Grows if a frame needs more.
+	FrameRing frameRing;
+	createFrameRing(frameRing, 4 << 20, framePacing.queueDepth);
+	const char* ringUploadEnv = getenv("RING_UPLOAD_MB");
+	size_t ringUploadBytes = ringUploadEnv ? static_cast<size_t>(atof(ringUploadEnv) * (1 << 20)) : 0;
+	// Camera and light in one block shared by all programs, per object data in another, both
+	// written to the frame ring.
+	UniformBlocks uniformBlocks;
+	createUniformBlocks(uniformBlocks, frameRing);
+
+	// Draws are collected every frame and issued sorted by state, see renderqueue.h.
+	RenderQueue renderQueue;
+	Material boxMaterial;
+	boxMaterial.numTextures = 3;
+	boxMaterial.textures[0] = diffuseTex;
+	boxMaterial.samplers[0] = UNIFORM("diffuseMap");
+	boxMaterial.textures[1] = specularTex;
+	boxMaterial.samplers[1] = UNIFORM("specularMap");
+	boxMaterial.textures[2] = normalTex;
+	boxMaterial.samplers[2] = UNIFORM("normalMap");
+	uint16_t boxMaterialIndex = addMaterial(renderQueue, boxMaterial);
+	Material normalMaterial;
+	normalMaterial.numTextures = 1;
+	normalMaterial.textures[0] = normalTex;
+	normalMaterial.samplers[0] = UNIFORM("normalMap");
+	uint16_t normalMaterialIndex = addMaterial(renderQueue, normalMaterial);
+
+	// A floor of boxes below the one in the middle. It never moves, so unless staticBatching is
+	// turned off it is merged into a few world space meshes up front instead of drawn box by box.
+	const int boxGridSize = 32;
+	const float boxGridSpacing = 2.5f;
+	const bool staticBatching = true;
+	StaticBatch staticBoxes;
+	staticBoxes.chunkSize = 20.f;
+	std::vector<glm::mat4> boxModels;
+	// The boxes are solid, so they double as occluders for the software occlusion pass.
+	SoftOcclusion softOcclusion;
+	ArenaMesh boxExtent = boxGeometry.meshes[static_cast<size_t>(boxMesh)];
+	addOccluderBox(softOcclusion, boxExtent.boundsMin, boxExtent.boundsMax);
+	for (int z = 0; z < boxGridSize; ++z) {
+		for (int x = 0; x < boxGridSize; ++x) {
+			glm::vec3 offset((x - 0.5f * (boxGridSize - 1)) * boxGridSpacing, -2.f, (z - 0.5f * (boxGridSize - 1)) * boxGridSpacing);
+			addOccluderBox(softOcclusion, boxExtent.boundsMin + offset, boxExtent.boundsMax + offset);
+			if (staticBatching) {
+				addStaticObject(staticBoxes, boxVertexData, glm::translate(offset), boxMaterialIndex);
+			} else {
+				boxModels.push_back(glm::translate(offset));
+			}
+		}
+	}
+	buildStaticBatch(staticBoxes, standardGeometry);
+	// Buffer textures only reach GL_MAX_TEXTURE_BUFFER_SIZE texels, the arenas may be past that
+	// from the start or have grown past it since.
+	if (vertexPulling && !(standardGeometry.vertexTexture && packedGeometry.vertexTexture)) {
+		printf("Arenas too large for buffer textures, drawing through vertex arrays instead of pulling.\n");
+		vertexPulling = false;
+		boxKey = boxVariant;
+		staticKey = staticVariant;
+	}
+	boxModels.push_back(glm::mat4(1.f));
+
+	// On the GPU driven path the static chunks and the instance field are one GpuScene, culled
+	// and drawn without the CPU going through them object by object.
+	GpuScene gpuScene;
+	int firstGpuInstance = 0;
+	if (gpuDriven) {
+		int gpuBoxMesh = &boxGeometry == &standardGeometry ? boxMesh : readObjectFile(standardGeometry, "/home/stef/Downloads/CubeManual.obj", false);
+		// A draw list per shading level.
+		size_t gpuObjects = staticBoxes.chunks.size() + static_cast<size_t>(instanceCount);
+		createGpuScene(gpuScene, standardGeometry, gpuObjects, framePacing.queueDepth, shadingLodEnabled ? shadingLodCount : 1);
+		// The chunks first, so chunk i is object i.
+		for (const StaticChunk& chunk : staticBoxes.chunks) {
+			addGpuObject(gpuScene, chunk.mesh, glm::mat4(1.f), chunk.material, chunk.boundsMin, chunk.boundsMax);
+		}
+		firstGpuInstance = static_cast<int>(gpuScene.objects.size());
+		for (int i = 0; i < instanceCount; ++i) {
+			size_t k = static_cast<size_t>(i);
+			glm::vec3 center(instanceCulling.centerX[k], instanceCulling.centerY[k], instanceCulling.centerZ[k]);
+			glm::vec3 extent(instanceCulling.extentX[k], instanceCulling.extentY[k], instanceCulling.extentZ[k]);
+			addGpuObject(gpuScene, gpuBoxMesh, glm::translate(instanceOffset(i)), static_cast<uint32_t>(i), center - extent, center + extent);
+		}
+	}
+
 	const float cameraSpeed = 2.f;
 	glm::vec3 cameraPos(0.f, 0.f, 3.f);
 	glm::vec3 lightPos(-0.2, 1, 0.7);
+	// The clustered lights hover over the floor of boxes, each circling its own spot.
+	std::vector<PointLight> pointLights(static_cast<size_t>(clusteredLightCount));
+	std::vector<glm::vec3> pointLightHomes;
+	for (PointLight& light : pointLights) {
+		float floorExtent = 0.5f * boxGridSize * boxGridSpacing;
+		float u = (float)rand() / (float)RAND_MAX;
+		float v = (float)rand() / (float)RAND_MAX;
+		float w = (float)rand() / (float)RAND_MAX;
+		pointLightHomes.push_back(glm::vec3((2.f * u - 1.f) * floorExtent, -1.2f + 1.5f * w, (2.f * v - 1.f) * floorExtent));
+		light.range = 2.f + 3.f * (float)rand() / (float)RAND_MAX;
+		light.color = 2.f * glm::vec3((float)rand() / (float)RAND_MAX, (float)rand() / (float)RAND_MAX, (float)rand() / (float)RAND_MAX);
+	}
+	ClusteredLighting clusteredLights;
+	if (clusteredLighting) {
+		createClusteredLighting(clusteredLights);
+	}
 
 	float aspect = (float)windowWidth / (float)windowHeight;
 	glm::mat4 proj = glm::perspective(glm::radians(45.f), aspect, 0.1f, 500.f);
 
+	// Culling, and later other per-frame loops, spread large object counts over these.
+	startJobWorkers();
+	// Nothing in the scene moves, so its bounds are gathered once. Boxes first, then the static
+	// chunks, in the order they are submitted below. The index of an object in these is also its
+	// occlusion and PVS id.
+	CullingSet sceneCulling;
+	std::vector<glm::vec3> objectBoundsMin;
+	std::vector<glm::vec3> objectBoundsMax;
+	for (const glm::mat4& boxModel : boxModels) {
+		glm::vec3 boundsMin, boundsMax;
+		transformBounds(boxModel, boxExtent.boundsMin, boxExtent.boundsMax, boundsMin, boundsMax);
+		objectBoundsMin.push_back(boundsMin);
+		objectBoundsMax.push_back(boundsMax);
+	}
+	for (const StaticChunk& chunk : staticBoxes.chunks) {
+		objectBoundsMin.push_back(chunk.boundsMin);
+		objectBoundsMax.push_back(chunk.boundsMax);
+	}
+	size_t objectCount = objectBoundsMin.size();
+	for (size_t i = 0; i < objectCount; ++i) {
+		addCullingBounds(sceneCulling, objectBoundsMin[i], objectBoundsMax[i]);
+	}
+	// Visibility from every cell of the space above the floor, baked against the box occluders
+	// or loaded from the cache, see pvs.h.
+	const bool pvsCulling = true;
+	Pvs pvs;
+	if (pvsCulling) {
+		float extent = 0.5f * boxGridSize * boxGridSpacing + 8.f;
+		setupPvsGrid(pvs, glm::vec3(-extent, -1.5f, -extent), glm::vec3(extent, 8.5f, extent), 4.f);
+		bakePvs(pvs, softOcclusion.vertices, objectBoundsMin, objectBoundsMax);
+		printf("PVS %s in %.1f ms: %d cells, %d objects, %d bytes (%d uncompressed).\n",
+			pvs.stats.fromCache ? "loaded" : "baked", pvs.stats.bakeMs, pvs.stats.cells, pvs.stats.objects,
+			pvs.stats.compressedBytes, pvs.stats.uncompressedBytes);
+	}
+	// Hardware occlusion queries on top of frustum culling, see occlusion.h.
+	const bool occlusionCulling = true;
+	OcclusionCulling occlusion;
+	createOcclusionCulling(occlusion);
+	std::vector<unsigned> occlusionConditions;
+	DepthPrepass depthPrepass;
+	createDepthPrepass(depthPrepass, depthPrepassMode);
+	ShadingLodSet shadingLod;
+	std::vector<unsigned> chunkPrograms(staticBoxes.chunks.size());
+	float boxRadius = glm::length(boxExtent.boundsMax - boxExtent.boundsMin) * 0.5f;
+	// The pre-pass only takes draws whose program and depth program are both built: the fallback
+	// program would not reproduce the depth exactly, and GL_EQUAL would drop its fragments.
+	auto depthProgramOf = [&](const ShaderVariantKey& key) -> unsigned {
+		ShaderProgram& color = requestShaderVariant(phongShaders, key);
+		ShaderProgram& depth = requestShaderVariant(phongShaders, depthPrepassVariant(key));
+		bool built = pollShaderProgram(color) && !color.failed && pollShaderProgram(depth) && !depth.failed;
+		return built ? depth.program : 0;
+	};
+	// Software occlusion before any of that, see softocclusion.h. SOFT_OCCLUSION_VALIDATE compares
+	// its depth with the GPU one once the scene is drawn, which stalls every frame.
+	const bool softOcclusionCulling = true;
+	const bool softOcclusionValidate = getenv("SOFT_OCCLUSION_VALIDATE") != NULL;
+	// CULL_BENCHMARK=100000 times frustum culling that many boxes with each code path at startup.
+	const char* cullBenchmarkEnv = getenv("CULL_BENCHMARK");
+	if (cullBenchmarkEnv) {
+		glm::mat4 benchmarkView = glm::translate(-cameraPos);
+		benchmarkCulling(proj * benchmarkView, static_cast<size_t>(atoi(cullBenchmarkEnv)));
+	}
+	// RING_CHECK=1 checks that growing the frame ring mid-frame keeps what the frame wrote.
+	if (getenv("RING_CHECK")) {
+		printf("Frame ring grow check: %s.\n", checkFrameRingGrow() ? "passed" : "FAILED");
+	}
+	// VERTEX_FETCH_BENCHMARK=100 times that many passes over the static batch with each vertex path.
+	const char* fetchBenchmarkEnv = getenv("VERTEX_FETCH_BENCHMARK");
+	if (fetchBenchmarkEnv) {
+		benchmarkVertexFetch(staticBoxes, standardGeometry, phongShaders, atoi(fetchBenchmarkEnv));
+	}
+
 	double lastTime = glfwGetTime();
+	double lastReportTime = lastTime;
 	while (!glfwWindowShouldClose(window)) {
+		// Wait before sampling time and input, so what the frame shows is as recent as it can be.
+		beginFrameRing(frameRing, beginFrame(framePacing));
 		double currTime = glfwGetTime();
 		float elapsedTime = static_cast<float>(currTime - lastTime);
 		lastTime = currTime;
+		resetGLStateStats();
 
 		glfwPollEvents();
+		updateShaderReload();
 
 		glm::mat4 rot = glm::eulerAngleXY(glm::radians(pitch), glm::radians(yaw));
 		glm::vec3 cameraRight(rot[0][0], rot[1][0], rot[2][0]);
@@ -455,48 +869,327 @@ int main() {
 		glm::mat4 model(1.f);
 		glm::mat4 view = rot * glm::translate(-cameraPos);
 
+		unsigned lightProgram = shaderProgramHandle(lightShader);
+		unsigned normalProgram = shaderProgramHandle(normalShader);
+		unsigned instancedProgram = shaderProgramHandle(requestShaderVariant(phongShaders, instancedVariant));
+		// Indexed by ShadingLod, all the full variant when shading LOD is off.
+		unsigned boxPrograms[shadingLodCount];
+		unsigned staticPrograms[shadingLodCount];
+		// The draw lists of the GPU scene.
+		unsigned gpuScenePrograms[shadingLodCount];
+		for (int lod = 0; lod < shadingLodCount; ++lod) {
+			ShadingLod level = shadingLodEnabled ? static_cast<ShadingLod>(lod) : SHADING_LOD_FULL;
+			boxPrograms[lod] = shaderProgramHandle(requestShaderVariant(phongShaders, shadingLodVariant(boxKey, level)));
+			staticPrograms[lod] = shaderProgramHandle(requestShaderVariant(phongShaders, shadingLodVariant(staticKey, level)));
+			gpuScenePrograms[lod] = gpuDriven
+				? shaderProgramHandle(requestShaderVariant(phongShaders, shadingLodVariant(instancedVariant, level))) : 0;
+		}
+		// The GPU scene waits for its culling program, frames until then go the GL 3.3 way so the
+		// chunks and the instance field do not pop in. Should it fail to build, the 3.3 path takes over.
+		bool gpuSceneReady = gpuDriven && pollShaderProgram(cullShader);
+		if (gpuSceneReady && cullShader.failed) {
+			printf("GPU culling unavailable, falling back to the GL 3.3 path.\n");
+			gpuDriven = false;
+			gpuSceneReady = false;
+		}
+
 		glClearColor(0.6f, 0.6f, 0.6f, 1.f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		glUseProgram(lightProgram);
-		glBindVertexArray(vao);
+		int framebufferWidth, framebufferHeight;
+		glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+		if (clusteredLighting) {
+			for (size_t i = 0; i < pointLights.size(); ++i) {
+				float phase = static_cast<float>(currTime) + static_cast<float>(i);
+				pointLights[i].position = pointLightHomes[i] + glm::vec3(std::sin(phase), 0.f, std::cos(phase)) * 0.5f;
+			}
+			assignClusterLights(clusteredLights, pointLights.data(), pointLights.size(), view, proj,
+				framebufferWidth, framebufferHeight);
+			uploadClusterLights(clusteredLights, framePacing.slot);
+		}
 
-		setProgramUniform(program, proj, "proj");
-		setProgramUniform(program, view, "view");
-		setProgramUniform(program, model, "model");
-		setProgramUniform(program, lightPos, "lightPos");
-		setProgramUniform(program, cameraPos, "cameraPos");
-		setProgramTexture(program, diffuseTex, 0, "diffuseMap");
-		setProgramTexture(program, specularTex, 1, "specularMap");
-		setProgramTexture(program, normalTex, 2, "normalMap");
-		glDrawArrays(GL_TRIANGLES, 0, renderCountTri);
+		FrameData frameData;
+		frameData.proj = proj;
+		frameData.view = view;
+		frameData.cameraPos = glm::vec4(cameraPos, 1.f);
+		frameData.lightPos[0] = glm::vec4(lightPos, 1.f);
+		frameData.clusterScale = clusteredLights.scale;
+		updateFrameData(uniformBlocks, frameData);
+
+		beginRenderQueue(renderQueue);
+		glm::mat4 viewProj = proj * view;
+		bool depthPrepassFrame = beginDepthPrepassFrame(depthPrepass, framePacing.slot);
+		unsigned gpuSceneDepthProgram = 0;
+		if (depthPrepassFrame) {
+			for (int lod = 0; lod < shadingLodCount; ++lod) {
+				ShadingLod level = shadingLodEnabled ? static_cast<ShadingLod>(lod) : SHADING_LOD_FULL;
+				setDepthProgram(renderQueue, boxPrograms[lod], depthProgramOf(shadingLodVariant(boxKey, level)));
+				setDepthProgram(renderQueue, staticPrograms[lod], depthProgramOf(shadingLodVariant(staticKey, level)));
+			}
+			gpuSceneDepthProgram = gpuSceneReady ? depthProgramOf(instancedVariant) : 0;
+		}
+
+		cullBounds(sceneCulling, viewProj);
+		if (pvsCulling) {
+			applyPvs(pvs, cameraPos, sceneCulling);
+		}
+		// The GPU scene culls its instances itself.
+		if (!gpuSceneReady) {
+			cullBounds(instanceCulling, viewProj);
+		}
+		if (softOcclusionCulling) {
+			rasterizeOccluders(softOcclusion, viewProj, cameraPos);
+			testSoftOcclusion(softOcclusion, sceneCulling);
+			if (!gpuSceneReady) {
+				testSoftOcclusion(softOcclusion, instanceCulling);
+			}
+		}
+		const uint8_t* visible = sceneCulling.visible.data();
+
+		// Objects in the frustum that were hidden last time are only drawn if their box query passes.
+		beginOcclusionFrame(occlusion, objectCount, cameraPos);
+		occlusionConditions.assign(objectCount, 0);
+		for (size_t i = 0; occlusionCulling && i < objectCount; ++i) {
+			if (visible[i]) {
+				occlusionConditions[i] = occlusionDecision(occlusion, i, objectBoundsMin[i], objectBoundsMax[i]);
+			}
+		}
+
+		// The instances of the GPU scene take the ids after the scene objects.
+		size_t shadingLodObjects = objectCount + static_cast<size_t>(instanceCount);
+		beginShadingLodFrame(shadingLod, shadingLodObjects, proj, static_cast<float>(framebufferHeight));
+		for (size_t i = 0; i < boxModels.size(); ++i) {
+			if (!visible[i]) {
+				continue;
+			}
+			const glm::mat4& boxModel = boxModels[i];
+			float distance = glm::length(glm::clamp(cameraPos, objectBoundsMin[i], objectBoundsMax[i]) - cameraPos);
+			unsigned program = boxPrograms[selectShadingLod(shadingLod, i, projectedPixels(shadingLod, boxRadius, distance))];
+			DrawPacket box = vertexPulling ? makePulledDrawPacket(packedGeometry, pulledBoxMesh, program, boxMaterialIndex, GL_TRIANGLES)
+				: makeDrawPacket(boxGeometry, boxMesh, program, boxMaterialIndex, GL_TRIANGLES);
+			box.condition = occlusionConditions[i];
+			RenderPass pass = box.condition ? RENDER_PASS_OCCLUSION_TESTED : RENDER_PASS_OPAQUE;
+			submitDraw(renderQueue, pass, box, {boxModel, viewProj * boxModel}, -(view * boxModel[3]).z);
+		}
+		if (!gpuSceneReady) {
+			// Chunks go by their largest object at the nearest point of their bounds.
+			for (size_t i = 0; i < staticBoxes.chunks.size(); ++i) {
+				const StaticChunk& chunk = staticBoxes.chunks[i];
+				size_t id = boxModels.size() + i;
+				float distance = glm::length(glm::clamp(cameraPos, chunk.boundsMin, chunk.boundsMax) - cameraPos);
+				chunkPrograms[i] = visible[id]
+					? staticPrograms[selectShadingLod(shadingLod, id, projectedPixels(shadingLod, chunk.objectRadius, distance))] : 0;
+			}
+			submitStaticBatch(renderQueue, staticBoxes, standardGeometry, staticPrograms[SHADING_LOD_FULL],
+				view, viewProj, visible + boxModels.size(), occlusionConditions.data() + boxModels.size(), vertexPulling,
+				chunkPrograms.data());
+		} else {
+			// The GPU scene culls the chunks again, but only the CPU knows the PVS and the queries.
+			// Chunks hidden last time are drawn after the queries, each conditional on its own.
+			for (size_t i = 0; i < staticBoxes.chunks.size(); ++i) {
+				const StaticChunk& chunk = staticBoxes.chunks[i];
+				size_t id = boxModels.size() + i;
+				GpuObject& object = gpuScene.objects[i];
+				object.hidden = !visible[id] || occlusionConditions[id] != 0;
+				if (visible[id]) {
+					float distance = glm::length(glm::clamp(cameraPos, chunk.boundsMin, chunk.boundsMax) - cameraPos);
+					ShadingLod level = selectShadingLod(shadingLod, id, projectedPixels(shadingLod, chunk.objectRadius, distance));
+					object.list = static_cast<uint8_t>(shadingLodEnabled ? level : SHADING_LOD_FULL);
+				}
+			}
+		}
 
 		// One more time for the light
 		glm::mat4 lightModel = glm::translate(lightPos) * glm::scale(glm::vec3(0.1, 0.1, 0.1));
-		glUseProgram(lightProgram);
-		glBindVertexArray(vao);
-		setProgramUniform(lightProgram, proj, "proj");
-		setProgramUniform(lightProgram, view, "view");
-		setProgramUniform(lightProgram, lightModel, "model");
-		glDrawArrays(GL_TRIANGLES, 0, 36);
+		DrawPacket light = makeDepthDrawPacket(boxGeometry, boxMesh, lightProgram, noMaterial, GL_TRIANGLES);
+		submitDraw(renderQueue, RENDER_PASS_OPAQUE, light, {lightModel, viewProj * lightModel}, -(view * lightModel[3]).z);
 
 		// One more time for the normals
 		const bool shadeNormals = 1;
 		if (shadeNormals) {
-			glUseProgram(normalProgram);
-			glBindVertexArray(normalVao);
-			setProgramUniform(normalProgram, proj, "proj");
-			setProgramUniform(normalProgram, view, "view");
-			setProgramUniform(normalProgram, model, "model");
-			setProgramTexture(normalProgram, normalTex, 0, "normalMap");
-			glDrawArrays(GL_POINTS, 0, renderCountNormals);
+			DrawPacket normals = makeDrawPacket(standardGeometry, normalMesh, normalProgram, normalMaterialIndex, GL_POINTS);
+			submitDraw(renderQueue, RENDER_PASS_DEBUG, normals, {model, viewProj * model}, -(view * model[3]).z);
+		}
+
+		// Every instance spins, so the data of all visible ones is uploaded again each frame. The
+		// GPU scene takes all of them and leaves the culling to the GPU.
+		double instanceStart = glfwGetTime();
+		auto instanceModel = [&](int i) {
+			float angle = static_cast<float>(currTime) + i * 0.1f;
+			float c = std::cos(angle);
+			float s = std::sin(angle);
+			return glm::mat4(
+				glm::vec4(c, 0.f, -s, 0.f),
+				glm::vec4(0.f, 1.f, 0.f, 0.f),
+				glm::vec4(s, 0.f, c, 0.f),
+				glm::vec4(instanceOffset(i), 1.f));
+		};
+		instancedBox.instances.clear();
+		if (gpuSceneReady) {
+			// Leaving the culling to the GPU, the shading level goes by the distance to the bounds.
+			for (int i = 0; i < instanceCount; ++i) {
+				GpuObject& object = gpuScene.objects[static_cast<size_t>(firstGpuInstance + i)];
+				object.instance.model = instanceModel(i);
+				float distance = glm::length(glm::clamp(cameraPos, object.boundsMin, object.boundsMax) - cameraPos);
+				ShadingLod level = selectShadingLod(shadingLod, objectCount + static_cast<size_t>(i),
+					projectedPixels(shadingLod, boxRadius, distance));
+				object.list = static_cast<uint8_t>(shadingLodEnabled ? level : SHADING_LOD_FULL);
+			}
+		} else {
+			for (int i = 0; i < instanceCount; ++i) {
+				if (!instanceCulling.visible[static_cast<size_t>(i)]) {
+					continue;
+				}
+				InstanceData instance;
+				instance.model = instanceModel(i);
+				instance.material = static_cast<uint32_t>(i);
+				instancedBox.instances.push_back(instance);
+			}
+			uploadInstances(instancedBox, frameRing);
+		}
+		double instanceMs = (glfwGetTime() - instanceStart) * 1000.0;
+
+		// RING_UPLOAD_MB=10 adds that much filler data to the frame ring, to see what heavy
+		// dynamic uploads cost.
+		if (ringUploadBytes > 0) {
+			RingAllocation filler = ringAllocate(frameRing, ringUploadBytes);
+			if (filler.data) {
+				memset(filler.data, static_cast<int>(framePacing.frame & 0xFF), ringUploadBytes);
+			}
+		}
+
+		prepareRenderQueue(renderQueue, uniformBlocks);
+		finishFrameRing(frameRing);
+		bindFrameData(uniformBlocks);
+		if (gpuSceneReady) {
+			cullGpuScene(gpuScene, framePacing.slot, cullShader.program, viewProj, softOcclusionCulling ? &softOcclusion : nullptr);
+		}
+		if (depthPrepassFrame) {
+			beginDepthPrepass(depthPrepass);
+			drawRenderQueueDepth(renderQueue, uniformBlocks, RENDER_PASS_OPAQUE);
+			if (gpuSceneDepthProgram) {
+				useProgram(gpuSceneDepthProgram);
+				drawGpuSceneDepth(gpuScene);
+			}
+			endDepthPrepass(depthPrepass);
+		}
+		beginShadedCount(depthPrepass);
+		drawRenderQueue(renderQueue, uniformBlocks, RENDER_PASS_OPAQUE, RENDER_PASS_OPAQUE);
+		auto bindBoxTextures = [&](unsigned boxProgram) {
+			UniformTable& boxUniforms = programUniforms(boxProgram);
+			useProgram(boxProgram);
+			bindTexture(0, GL_TEXTURE_2D, diffuseTex);
+			setUniform(boxUniforms, UNIFORM("diffuseMap"), 0);
+			bindTexture(1, GL_TEXTURE_2D, specularTex);
+			setUniform(boxUniforms, UNIFORM("specularMap"), 1);
+			bindTexture(2, GL_TEXTURE_2D, normalTex);
+			setUniform(boxUniforms, UNIFORM("normalMap"), 2);
+		};
+		// Opaque too, and drawn before the queries so it can hide what they test.
+		if (gpuSceneReady) {
+			if (gpuSceneDepthProgram) {
+				setDepthFunc(GL_EQUAL);
+				setDepthMask(false);
+			}
+			for (int list = 0; list < gpuScene.lists; ++list) {
+				bindBoxTextures(gpuScenePrograms[list]);
+				drawGpuScene(gpuScene, list);
+			}
+			setDepthFunc(GL_LESS);
+			setDepthMask(true);
+		}
+		endShadedCount(depthPrepass);
+		issueOcclusionQueries(occlusion);
+		drawRenderQueue(renderQueue, uniformBlocks, RENDER_PASS_OCCLUSION_TESTED, RENDER_PASS_TRANSPARENT);
+		for (size_t i = 0; gpuSceneReady && i < staticBoxes.chunks.size(); ++i) {
+			unsigned condition = occlusionConditions[boxModels.size() + i];
+			if (!condition) {
+				continue;
+			}
+			bindBoxTextures(gpuScenePrograms[gpuScene.objects[i].list]);
+			// Without waiting, like the render queue's conditional draws.
+			glBeginConditionalRender(condition, GL_QUERY_NO_WAIT);
+			drawGpuObject(gpuScene, i);
+			glEndConditionalRender();
+		}
+		if (softOcclusionCulling && softOcclusionValidate) {
+			validateSoftOcclusion(softOcclusion, framebufferWidth, framebufferHeight);
+		}
+
+		if (!instancedBox.instances.empty()) {
+			bindBoxTextures(instancedProgram);
+			drawInstancedMesh(instancedBox, frameRing);
+		}
+
+		// Every few seconds, report what the last frame cost.
+		if (currTime - lastReportTime > 2.0) {
+			lastReportTime = currTime;
+			printf("Frame pacing: %d frames in flight, %.2f ms waiting on the GPU, %d stalls so far.\n",
+				framePacing.queueDepth, framePacing.stats.waitMs, framePacing.stats.stalls);
+			printf("Frame ring: %.2f MB in %d allocations, %.2f MB at most of %.2f MB per frame, grown %d times.\n",
+				frameRing.stats.usedBytes / 1048576.0, frameRing.stats.allocations, frameRing.stats.peakBytes / 1048576.0,
+				frameRing.regionSize / 1048576.0, frameRing.stats.grows);
+			printf("State calls per frame: %d issued, %d elided.\n", glStateStats.issued, glStateStats.elided);
+			printf("Render queue: %d draws in %d calls, %d program, %d material, %d vertex array switches.\n",
+				renderQueue.stats.draws, renderQueue.stats.calls, renderQueue.stats.programSwitches,
+				renderQueue.stats.materialSwitches, renderQueue.stats.vaoSwitches);
+			if (gpuSceneReady) {
+				printf("GPU scene: %d objects in one indirect draw, %d of them drawn %d frames ago, %.2f ms to update, %.2f ms to write.\n",
+					gpuScene.stats.objects, gpuScene.stats.visible, gpuScene.regions, instanceMs, gpuScene.stats.writeMs);
+			} else {
+				printf("Instances: %d of %d in one draw, %.2f ms to update and upload.\n",
+					static_cast<int>(instancedBox.instances.size()), instanceCount, instanceMs);
+			}
+			// On the GPU driven path the instances are culled by the GPU scene.
+			int culled = static_cast<int>(sceneCulling.count + (gpuSceneReady ? 0 : instanceCulling.count));
+			int culledVisible = sceneCulling.visibleCount + (gpuSceneReady ? 0 : instanceCulling.visibleCount);
+			float cullMs = sceneCulling.cullMs + (gpuSceneReady ? 0.f : instanceCulling.cullMs);
+			printf("Frustum culling: %d of %d visible, %.3f ms (%.3f ms per 100k objects, %s).\n",
+				culledVisible, culled, cullMs,
+				culled > 0 ? cullMs * 100000.f / culled : 0.f, cullingPathName(CULL_FASTEST));
+			printf("Depth pre-pass: %s%s, %llu fragments shaded with it, %llu without, overdraw %.2f, switched %d times.\n",
+				depthPrepass.stats.enabled ? "on" : "off", depthPrepassMode == DEPTH_PREPASS_AUTO ? " (automatic)" : "",
+				static_cast<unsigned long long>(depthPrepass.stats.shadedWith),
+				static_cast<unsigned long long>(depthPrepass.stats.shadedWithout),
+				depthPrepass.stats.overdraw, depthPrepass.stats.switches);
+			printf("Shading LOD: %d full, %d vertex normals, %d lit per vertex.\n", shadingLod.stats.objects[SHADING_LOD_FULL],
+				shadingLod.stats.objects[SHADING_LOD_PHONG], shadingLod.stats.objects[SHADING_LOD_VERTEX]);
+			if (clusteredLighting) {
+				printf("Clustered lighting: %d lights, %d in depth range, %d list entries, at most %d per cluster, %.3f ms to assign.\n",
+					clusteredLights.stats.lights, clusteredLights.stats.inRange, clusteredLights.stats.indices,
+					clusteredLights.stats.longestList, clusteredLights.stats.assignMs);
+			}
+			printf("Occlusion culling: %d objects, %d queries, %d skipped as hidden.\n",
+				occlusion.stats.objects, occlusion.stats.queries, occlusion.stats.hidden);
+			printf("PVS: cell %d, %d hidden.\n", pvs.stats.cell, pvs.stats.hidden);
+			printf("Software occlusion: %d occluders, %d triangles, %d of %d tested hidden, %.3f ms raster, %.3f ms test%s.\n",
+				softOcclusion.stats.occluders, softOcclusion.stats.triangles, softOcclusion.stats.occluded,
+				softOcclusion.stats.tested, softOcclusion.stats.rasterMs, softOcclusion.stats.testMs,
+				softOcclusion.stats.overBudget ? ", over budget" : "");
 		}
 
 		glfwSwapBuffers(window);
+		endFrame(framePacing);
 	}
 
-	glDeleteProgram(program);
-	glDeleteProgram(lightProgram);
+	deleteFramePacing(framePacing);
+	deleteFrameRing(frameRing);
+	deleteGpuScene(gpuScene);
+	stopShaderReload();
+	stopJobWorkers();
+	deleteOcclusionCulling(occlusion);
+	deleteDepthPrepass(depthPrepass);
+	deleteClusteredLighting(clusteredLights);
+	deleteUniformBlocks(uniformBlocks);
+	deleteInstancedMesh(instancedBox);
+	deleteStaticBatch(staticBoxes, standardGeometry);
+	deleteGeometryArena(standardGeometry);
+	deleteGeometryArena(packedGeometry);
+	deleteVertexPulling();
+	deleteShaderVariants(phongShaders);
+	deleteShaderProgram(lightShader);
+	deleteShaderProgram(normalShader);
+	deleteShaderProgram(cullShader);
 	//glDeleteBuffers(1, &vbo);
 
 	glfwDestroyWindow(window);
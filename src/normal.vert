@@ -6,9 +6,10 @@ layout (location = 2) in vec3 inNormal;
 layout (location = 3) in vec3 inTangent;
 layout (location = 4) in vec3 inBitangent;
 
-uniform mat4 proj;
-uniform mat4 model;
-uniform mat4 view;
+layout (std140) uniform ObjectData {
+	mat4 model;
+	mat4 modelViewProj;
+};
 
 uniform sampler2D normalMap;
 
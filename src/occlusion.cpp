@@ -0,0 +1,149 @@
+#include "occlusion.h"
+#include "glstate.h"
+#include "uniforms.h"
+
+#include <cstdint>
+
+// Visible objects are queried again this often, staggered by id so the queries spread out.
+static const int visibleQueryInterval = 4;
+// Boxes are grown a little so surfaces lying on them, like a cube's own faces, do not hide them.
+static const float boundsMargin = 0.01f;
+// The camera counts as inside a box this close to it, where the near plane could clip it away.
+static const float nearMargin = 0.2f;
+
+void createOcclusionCulling(OcclusionCulling& oc) {
+	oc.program = submitShaderProgram({
+		{"src/bounds.vert", GL_VERTEX_SHADER},
+		{"src/light.frag", GL_FRAGMENT_SHADER}
+	});
+
+	const float corners[] = {
+		0, 0, 0,  1, 0, 0,  1, 1, 0,  0, 1, 0,
+		0, 0, 1,  1, 0, 1,  1, 1, 1,  0, 1, 1,
+	};
+	const uint8_t indices[] = {
+		0, 2, 1, 0, 3, 2,
+		4, 5, 6, 4, 6, 7,
+		0, 1, 5, 0, 5, 4,
+		3, 6, 2, 3, 7, 6,
+		0, 4, 7, 0, 7, 3,
+		1, 2, 6, 1, 6, 5,
+	};
+
+	glGenVertexArrays(1, &oc.cubeVao);
+	bindVertexArray(oc.cubeVao);
+	glGenBuffers(1, &oc.cubeVertexBuffer);
+	bindBuffer(GL_ARRAY_BUFFER, oc.cubeVertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+	glGenBuffers(1, &oc.cubeIndexBuffer);
+	bindBuffer(GL_ELEMENT_ARRAY_BUFFER, oc.cubeIndexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), 0);
+	glEnableVertexAttribArray(0);
+}
+
+void deleteOcclusionCulling(OcclusionCulling& oc) {
+	for (OcclusionObject& object : oc.objects) {
+		glDeleteQueries(1, &object.query);
+	}
+	deleteVertexArray(oc.cubeVao);
+	deleteBuffer(oc.cubeVertexBuffer);
+	deleteBuffer(oc.cubeIndexBuffer);
+	deleteShaderProgram(oc.program);
+	oc = OcclusionCulling();
+}
+
+void beginOcclusionFrame(OcclusionCulling& oc, size_t objectCount, const glm::vec3& cameraPos) {
+	++oc.frame;
+	oc.stats = OcclusionStats();
+	oc.cameraPos = cameraPos;
+	oc.ready = pollShaderProgram(oc.program) && !oc.program.failed;
+	oc.queryHandles.clear();
+	oc.queryMin.clear();
+	oc.queryMax.clear();
+
+	while (oc.objects.size() > objectCount) {
+		glDeleteQueries(1, &oc.objects.back().query);
+		oc.objects.pop_back();
+	}
+	while (oc.objects.size() < objectCount) {
+		OcclusionObject object;
+		glGenQueries(1, &object.query);
+		oc.objects.push_back(object);
+	}
+
+	for (OcclusionObject& object : oc.objects) {
+		if (!object.pending) {
+			continue;
+		}
+		int available = 0;
+		glGetQueryObjectiv(object.query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			unsigned anySamples = 0;
+			glGetQueryObjectuiv(object.query, GL_QUERY_RESULT, &anySamples);
+			object.visible = anySamples != 0;
+			object.pending = false;
+		}
+	}
+}
+
+static bool contains(const glm::vec3& boundsMin, const glm::vec3& boundsMax, const glm::vec3& p, float margin) {
+	return p.x >= boundsMin.x - margin && p.y >= boundsMin.y - margin && p.z >= boundsMin.z - margin
+		&& p.x <= boundsMax.x + margin && p.y <= boundsMax.y + margin && p.z <= boundsMax.z + margin;
+}
+
+unsigned occlusionDecision(OcclusionCulling& oc, size_t id, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	OcclusionObject& object = oc.objects[id];
+	++oc.stats.objects;
+	if (!oc.ready || contains(boundsMin, boundsMax, oc.cameraPos, nearMargin)) {
+		// Nothing to test with, or the box cannot be rasterized reliably.
+		object.visible = true;
+		return 0;
+	}
+
+	bool query;
+	if (object.visible) {
+		int interval = visibleQueryInterval;
+		query = !object.pending && (oc.frame + static_cast<int>(id % static_cast<size_t>(interval))) % interval == 0;
+	} else {
+		// A query still in flight keeps serving as the condition until its result is read.
+		query = !object.pending;
+	}
+	if (query) {
+		object.pending = true;
+		oc.queryHandles.push_back(object.query);
+		oc.queryMin.push_back(boundsMin - glm::vec3(boundsMargin));
+		oc.queryMax.push_back(boundsMax + glm::vec3(boundsMargin));
+	}
+
+	if (object.visible) {
+		return 0;
+	}
+	++oc.stats.hidden;
+	++oc.stats.conditionalDraws;
+	return object.query;
+}
+
+void issueOcclusionQueries(OcclusionCulling& oc) {
+	if (oc.queryHandles.empty()) {
+		return;
+	}
+
+	UniformTable& uniforms = programUniforms(oc.program.program);
+	useProgram(oc.program.program);
+	bindVertexArray(oc.cubeVao);
+	setColorMask(false);
+	setDepthMask(false);
+	setDepthFunc(GL_LEQUAL);
+	for (size_t i = 0; i < oc.queryHandles.size(); ++i) {
+		setUniform(uniforms, UNIFORM("boundsMin"), oc.queryMin[i]);
+		setUniform(uniforms, UNIFORM("boundsMax"), oc.queryMax[i]);
+		glBeginQuery(GL_ANY_SAMPLES_PASSED, oc.queryHandles[i]);
+		glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_BYTE, 0);
+		glEndQuery(GL_ANY_SAMPLES_PASSED);
+	}
+	setDepthFunc(GL_LESS);
+	setDepthMask(true);
+	setColorMask(true);
+	oc.stats.queries = static_cast<int>(oc.queryHandles.size());
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "shader.h"
+
+#include <glm/glm.hpp>
+
+// Occlusion culling with GL_ANY_SAMPLES_PASSED queries on bounding boxes, reusing results over
+// frames in the spirit of coherent hierarchical culling, without the hierarchy:
+// - Objects visible last time are drawn in the opaque pass. Every few frames their box is
+//   queried again to find out whether they became hidden.
+// - Objects hidden last time have their box queried every frame against the depth of the
+//   opaque pass, and are drawn right after, conditional on that query. The GPU skips them if
+//   the box was hidden, the CPU only learns the result a frame or more later.
+// Results are only read once available, so the CPU never waits on a query.
+struct OcclusionObject {
+	unsigned query = 0;
+	bool visible = true;
+	// A query was issued and its result not read yet.
+	bool pending = false;
+};
+
+struct OcclusionStats {
+	int objects = 0;
+	int queries = 0;
+	int conditionalDraws = 0;
+	// Objects the last available result said were hidden, skipped by the GPU.
+	int hidden = 0;
+};
+
+struct OcclusionCulling {
+	// Indexed by the ids the caller uses, which must stay stable across frames.
+	std::vector<OcclusionObject> objects;
+	int frame = 0;
+	OcclusionStats stats;
+	// Queries are skipped while the box program is still compiling.
+	bool ready = false;
+	glm::vec3 cameraPos;
+
+	ShaderProgram program;
+	unsigned cubeVao = 0;
+	unsigned cubeVertexBuffer = 0;
+	unsigned cubeIndexBuffer = 0;
+
+	// Boxes to query this frame.
+	std::vector<unsigned> queryHandles;
+	std::vector<glm::vec3> queryMin;
+	std::vector<glm::vec3> queryMax;
+};
+
+void createOcclusionCulling(OcclusionCulling& oc);
+void deleteOcclusionCulling(OcclusionCulling& oc);
+
+// Reads the results that came in since the last frame. objectCount is the number of ids in use.
+void beginOcclusionFrame(OcclusionCulling& oc, size_t objectCount, const glm::vec3& cameraPos);
+// For an object that passed frustum culling, with its world space bounds. Returns the query its
+// draw must be conditional on, 0 to draw it unconditionally in the opaque pass. Queues a query
+// of the bounds when one is due.
+unsigned occlusionDecision(OcclusionCulling& oc, size_t id, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+// Draws the queued boxes with color and depth writes off, each inside its query. Call between
+// the opaque pass and RENDER_PASS_OCCLUSION_TESTED.
+void issueOcclusionQueries(OcclusionCulling& oc);
@@ -0,0 +1,255 @@
+#include "pvs.h"
+#include "bvh.h"
+#include "embed.h"
+#include "jobs.h"
+
+#include <cstdio>
+#include <cmath>
+
+#include <algorithm>
+#include <chrono>
+
+#include <sys/stat.h>
+
+static const char* pvsCacheDir = ".pvscache";
+static const uint32_t pvsCacheMagic = 0x31535650; // "PVS1"
+// A hit this close to an object's box still counts as reaching the object.
+static const float hitEpsilon = 1e-3f;
+
+// Layout of a cache file. The cell offsets follow, then the compressed data.
+struct PvsFileHeader {
+	uint32_t magic;
+	uint32_t objectCount;
+	uint32_t cellCount;
+	uint32_t dataSize;
+	uint64_t key;
+};
+
+void setupPvsGrid(Pvs& pvs, const glm::vec3& gridMin, const glm::vec3& gridMax, float cellSize) {
+	pvs.gridMin = gridMin;
+	pvs.cellSize = cellSize;
+	glm::vec3 cells = glm::ceil((gridMax - gridMin) / cellSize);
+	pvs.cellsX = std::max(1, static_cast<int>(cells.x));
+	pvs.cellsY = std::max(1, static_cast<int>(cells.y));
+	pvs.cellsZ = std::max(1, static_cast<int>(cells.z));
+}
+
+int pvsCell(const Pvs& pvs, const glm::vec3& position) {
+	glm::vec3 cell = glm::floor((position - pvs.gridMin) / pvs.cellSize);
+	int x = static_cast<int>(cell.x);
+	int y = static_cast<int>(cell.y);
+	int z = static_cast<int>(cell.z);
+	if (x < 0 || y < 0 || z < 0 || x >= pvs.cellsX || y >= pvs.cellsY || z >= pvs.cellsZ) {
+		return -1;
+	}
+	return (z * pvs.cellsY + y) * pvs.cellsX + x;
+}
+
+static uint64_t pvsKey(const Pvs& pvs, const std::vector<glm::vec3>& occluderTriangles,
+	const std::vector<glm::vec3>& objectMin, const std::vector<glm::vec3>& objectMax) {
+	int settings[4] = {pvs.cellsX, pvs.cellsY, pvs.cellsZ, pvs.raysPerObject};
+	uint64_t key = contentHash(reinterpret_cast<const char*>(&pvsCacheMagic), sizeof(pvsCacheMagic));
+	key = contentHash(reinterpret_cast<const char*>(settings), sizeof(settings), key);
+	key = contentHash(reinterpret_cast<const char*>(&pvs.gridMin), sizeof(pvs.gridMin), key);
+	key = contentHash(reinterpret_cast<const char*>(&pvs.cellSize), sizeof(pvs.cellSize), key);
+	key = contentHash(reinterpret_cast<const char*>(occluderTriangles.data()), occluderTriangles.size() * sizeof(glm::vec3), key);
+	key = contentHash(reinterpret_cast<const char*>(objectMin.data()), objectMin.size() * sizeof(glm::vec3), key);
+	key = contentHash(reinterpret_cast<const char*>(objectMax.data()), objectMax.size() * sizeof(glm::vec3), key);
+	return key;
+}
+
+static void pvsCachePath(uint64_t key, char* path, size_t size) {
+	snprintf(path, size, "%s/%016llx.bin", pvsCacheDir, static_cast<unsigned long long>(key));
+}
+
+static bool loadPvs(Pvs& pvs, uint64_t key, int cellCount) {
+	char path[256];
+	pvsCachePath(key, path, sizeof(path));
+	FILE* fp = fopen(path, "rb");
+	if (!fp) {
+		return false;
+	}
+
+	PvsFileHeader header;
+	bool valid = fread(&header, sizeof(header), 1, fp) == 1 && header.magic == pvsCacheMagic && header.key == key &&
+		header.objectCount == static_cast<uint32_t>(pvs.objectCount) && header.cellCount == static_cast<uint32_t>(cellCount);
+	if (valid) {
+		pvs.cellOffsets.resize(header.cellCount + 1);
+		pvs.data.resize(header.dataSize);
+		valid = fread(pvs.cellOffsets.data(), sizeof(uint32_t), pvs.cellOffsets.size(), fp) == pvs.cellOffsets.size() &&
+			fread(pvs.data.data(), 1, pvs.data.size(), fp) == pvs.data.size() &&
+			pvs.cellOffsets.back() == header.dataSize;
+	}
+	fclose(fp);
+	if (!valid) {
+		remove(path);
+	}
+	return valid;
+}
+
+static void savePvs(const Pvs& pvs, uint64_t key) {
+	mkdir(pvsCacheDir, 0755);
+	char path[256];
+	pvsCachePath(key, path, sizeof(path));
+	FILE* fp = fopen(path, "wb");
+	if (!fp) {
+		printf("Failed to write PVS cache %s.\n", path);
+		return;
+	}
+
+	PvsFileHeader header;
+	header.magic = pvsCacheMagic;
+	header.objectCount = static_cast<uint32_t>(pvs.objectCount);
+	header.cellCount = static_cast<uint32_t>(pvs.cellOffsets.size() - 1);
+	header.dataSize = static_cast<uint32_t>(pvs.data.size());
+	header.key = key;
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(pvs.cellOffsets.data(), sizeof(uint32_t), pvs.cellOffsets.size(), fp);
+	fwrite(pvs.data.data(), 1, pvs.data.size(), fp);
+	fclose(fp);
+}
+
+// xorshift32, seeded per cell so a bake gives the same sets whatever the thread count.
+static float randomFloat(uint32_t& state) {
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return static_cast<float>(state >> 8) * (1.f / 16777216.f);
+}
+
+static glm::vec3 randomPoint(uint32_t& state, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	float x = randomFloat(state);
+	float y = randomFloat(state);
+	float z = randomFloat(state);
+	return boundsMin + (boundsMax - boundsMin) * glm::vec3(x, y, z);
+}
+
+static bool insideBounds(const glm::vec3& p, const glm::vec3& boundsMin, const glm::vec3& boundsMax, float margin) {
+	return p.x >= boundsMin.x - margin && p.y >= boundsMin.y - margin && p.z >= boundsMin.z - margin &&
+		p.x <= boundsMax.x + margin && p.y <= boundsMax.y + margin && p.z <= boundsMax.z + margin;
+}
+
+static bool overlapBounds(const glm::vec3& aMin, const glm::vec3& aMax, const glm::vec3& bMin, const glm::vec3& bMax) {
+	return aMin.x <= bMax.x && aMin.y <= bMax.y && aMin.z <= bMax.z && bMin.x <= aMax.x && bMin.y <= aMax.y && bMin.z <= aMax.z;
+}
+
+static void compressBits(const std::vector<uint8_t>& bits, std::vector<uint8_t>& out) {
+	for (size_t i = 0; i < bits.size();) {
+		if (bits[i]) {
+			out.push_back(bits[i++]);
+			continue;
+		}
+		size_t run = 0;
+		while (i < bits.size() && !bits[i] && run < 255) {
+			++run;
+			++i;
+		}
+		out.push_back(0);
+		out.push_back(static_cast<uint8_t>(run));
+	}
+}
+
+static void bakeCell(const Pvs& pvs, const Bvh& bvh, int cell, const std::vector<glm::vec3>& objectMin,
+	const std::vector<glm::vec3>& objectMax, std::vector<uint8_t>& out) {
+	int x = cell % pvs.cellsX;
+	int y = cell / pvs.cellsX % pvs.cellsY;
+	int z = cell / (pvs.cellsX * pvs.cellsY);
+	glm::vec3 cellMin = pvs.gridMin + glm::vec3(x, y, z) * pvs.cellSize;
+	glm::vec3 cellMax = cellMin + glm::vec3(pvs.cellSize);
+
+	uint32_t state = static_cast<uint32_t>(cell) * 2654435761u + 1u;
+	std::vector<uint8_t> bits(static_cast<size_t>((pvs.objectCount + 7) / 8), 0);
+	for (size_t o = 0; o < static_cast<size_t>(pvs.objectCount); ++o) {
+		bool visible = overlapBounds(cellMin, cellMax, objectMin[o], objectMax[o]);
+		for (int r = 0; r < pvs.raysPerObject && !visible; ++r) {
+			// Center to center first, the most likely ray to get through.
+			glm::vec3 origin = r == 0 ? (cellMin + cellMax) * 0.5f : randomPoint(state, cellMin, cellMax);
+			glm::vec3 target = r == 0 ? (objectMin[o] + objectMax[o]) * 0.5f : randomPoint(state, objectMin[o], objectMax[o]);
+			glm::vec3 direction = target - origin;
+			float t = intersectBvh(bvh, origin, direction, 1.f);
+			// Hitting the object's own surface counts, its triangles are occluders too.
+			visible = t >= 1.f || insideBounds(origin + direction * t, objectMin[o], objectMax[o], hitEpsilon);
+		}
+		if (visible) {
+			bits[o / 8] |= static_cast<uint8_t>(1u << (o % 8));
+		}
+	}
+	compressBits(bits, out);
+}
+
+void bakePvs(Pvs& pvs, const std::vector<glm::vec3>& occluderTriangles,
+	const std::vector<glm::vec3>& objectMin, const std::vector<glm::vec3>& objectMax) {
+	auto start = std::chrono::steady_clock::now();
+	int cellCount = pvs.cellsX * pvs.cellsY * pvs.cellsZ;
+	pvs.objectCount = static_cast<int>(objectMin.size());
+	pvs.decodedCell = -1;
+	pvs.stats = PvsStats();
+	pvs.stats.cells = cellCount;
+	pvs.stats.objects = pvs.objectCount;
+	pvs.stats.uncompressedBytes = cellCount * ((pvs.objectCount + 7) / 8);
+
+	uint64_t key = pvsKey(pvs, occluderTriangles, objectMin, objectMax);
+	pvs.stats.fromCache = loadPvs(pvs, key, cellCount);
+	if (!pvs.stats.fromCache) {
+		Bvh bvh;
+		buildBvh(bvh, occluderTriangles);
+
+		std::vector<std::vector<uint8_t>> cells(static_cast<size_t>(cellCount));
+		parallelFor(cells.size(), 1, [&](size_t begin, size_t end) {
+			for (size_t cell = begin; cell < end; ++cell) {
+				bakeCell(pvs, bvh, static_cast<int>(cell), objectMin, objectMax, cells[cell]);
+			}
+		});
+
+		pvs.cellOffsets.clear();
+		pvs.data.clear();
+		for (const std::vector<uint8_t>& cell : cells) {
+			pvs.cellOffsets.push_back(static_cast<uint32_t>(pvs.data.size()));
+			pvs.data.insert(pvs.data.end(), cell.begin(), cell.end());
+		}
+		pvs.cellOffsets.push_back(static_cast<uint32_t>(pvs.data.size()));
+		savePvs(pvs, key);
+	}
+
+	pvs.stats.compressedBytes = static_cast<int>(pvs.data.size());
+	pvs.stats.bakeMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void decodeCell(Pvs& pvs, int cell) {
+	pvs.decoded.assign(static_cast<size_t>(pvs.objectCount), 0);
+	const uint8_t* p = pvs.data.data() + pvs.cellOffsets[static_cast<size_t>(cell)];
+	const uint8_t* end = pvs.data.data() + pvs.cellOffsets[static_cast<size_t>(cell) + 1];
+	size_t object = 0;
+	while (p < end) {
+		if (*p == 0) {
+			object += 8 * static_cast<size_t>(p[1]);
+			p += 2;
+			continue;
+		}
+		for (int bit = 0; bit < 8 && object < pvs.decoded.size(); ++bit, ++object) {
+			pvs.decoded[object] = (*p >> bit) & 1;
+		}
+		++p;
+	}
+	pvs.decodedCell = cell;
+}
+
+void applyPvs(Pvs& pvs, const glm::vec3& cameraPos, CullingSet& set) {
+	pvs.stats.cell = pvsCell(pvs, cameraPos);
+	pvs.stats.hidden = 0;
+	if (pvs.stats.cell < 0 || pvs.cellOffsets.empty()) {
+		return;
+	}
+	if (pvs.decodedCell != pvs.stats.cell) {
+		decodeCell(pvs, pvs.stats.cell);
+	}
+
+	size_t count = std::min(set.count, pvs.decoded.size());
+	for (size_t i = 0; i < count; ++i) {
+		if (set.visible[i] && !pvs.decoded[i]) {
+			set.visible[i] = 0;
+			--set.visibleCount;
+			++pvs.stats.hidden;
+		}
+	}
+}
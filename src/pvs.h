@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "culling.h"
+
+#include <glm/glm.hpp>
+
+// Potentially visible sets for static scenes. The space the camera can move through is split
+// into a grid of cells, and for every cell and every static object rays are cast between random
+// points of the two against the occluder triangles. An object some ray reaches is visible from
+// the cell. At runtime the cell of the camera is looked up and everything else is dropped, with
+// no occlusion work left in the frame.
+// Sampling can miss thin gaps, so the result is an approximation; more rays make it tighter.
+// Each cell's visibility is one bit per object, compressed by writing runs of zero bytes as a
+// zero followed by the run length. Baked sets are stored in .pvscache, keyed by a hash of
+// everything that went into them, so only changed scenes are baked again.
+struct PvsStats {
+	int cells = 0;
+	int objects = 0;
+	// Bytes of all cells, and what they would take as plain bitsets.
+	int compressedBytes = 0;
+	int uncompressedBytes = 0;
+	float bakeMs = 0.f;
+	bool fromCache = false;
+	// Per frame, the camera cell (-1 outside the grid) and the objects it hides.
+	int cell = -1;
+	int hidden = 0;
+};
+
+struct Pvs {
+	glm::vec3 gridMin;
+	float cellSize = 4.f;
+	int cellsX = 0, cellsY = 0, cellsZ = 0;
+	// Rays per cell and object, at most. Casting stops at the first one that gets through.
+	int raysPerObject = 64;
+
+	int objectCount = 0;
+	// Start of each cell in data, plus one past the last cell.
+	std::vector<uint32_t> cellOffsets;
+	std::vector<uint8_t> data;
+	PvsStats stats;
+
+	// The last cell looked up, decoded to one byte per object.
+	int decodedCell = -1;
+	std::vector<uint8_t> decoded;
+};
+
+// Covers [gridMin, gridMax] with cells of cellSize, rounding the count up.
+void setupPvsGrid(Pvs& pvs, const glm::vec3& gridMin, const glm::vec3& gridMax, float cellSize);
+// Loads the sets from the cache or bakes them on the job workers. occluderTriangles holds three
+// world space vertices per triangle, objects are given by their world space bounds.
+void bakePvs(Pvs& pvs, const std::vector<glm::vec3>& occluderTriangles,
+	const std::vector<glm::vec3>& objectMin, const std::vector<glm::vec3>& objectMax);
+
+// -1 when the position is outside the grid.
+int pvsCell(const Pvs& pvs, const glm::vec3& position);
+// Clears CullingSet::visible for objects the camera's cell cannot see. The first objectCount
+// entries of the set must be the baked objects, in the same order. Outside the grid nothing is hidden.
+void applyPvs(Pvs& pvs, const glm::vec3& cameraPos, CullingSet& set);
@@ -0,0 +1,338 @@
+#include "renderqueue.h"
+#include "glstate.h"
+#include "uniforms.h"
+#include "vertexpulling.h"
+
+#include <cstring>
+
+static uint64_t keyBits(uint64_t value, int width) {
+	return value & ((1ull << width) - 1);
+}
+
+// Positive floats compare like their bit patterns. Dropping the two low mantissa bits leaves 30.
+static uint64_t quantizeDepth(float depth) {
+	if (!(depth > 0.f)) {
+		return 0;
+	}
+	uint32_t bits;
+	memcpy(&bits, &depth, sizeof(bits));
+	return bits >> 2;
+}
+
+uint16_t addMaterial(RenderQueue& queue, const Material& material) {
+	queue.materials.push_back(material);
+	return static_cast<uint16_t>(queue.materials.size() - 1);
+}
+
+DrawPacket makeDrawPacket(const GeometryArena& arena, int mesh, unsigned program, uint16_t material, GLenum mode) {
+	const ArenaMesh& m = arena.meshes[static_cast<size_t>(mesh)];
+	DrawPacket packet;
+	packet.program = program;
+	packet.vao = arena.vao;
+	packet.material = material;
+	packet.mode = static_cast<uint16_t>(mode);
+	packet.firstIndex = m.firstIndex;
+	packet.indexCount = m.indexCount;
+	packet.baseVertex = m.baseVertex;
+	packet.object = 0;
+	packet.condition = 0;
+	packet.positionTexture = 0;
+	packet.vertexTexture = 0;
+	packet.indexTexture = 0;
+	packet.vertexFormat = static_cast<uint16_t>(arena.format);
+	packet.depthVao = arena.positionVao;
+	packet.depthPrepassed = false;
+	return packet;
+}
+
+DrawPacket makeDepthDrawPacket(const GeometryArena& arena, int mesh, unsigned program, uint16_t material, GLenum mode) {
+	DrawPacket packet = makeDrawPacket(arena, mesh, program, material, mode);
+	packet.vao = arena.positionVao;
+	return packet;
+}
+
+uint64_t makeSortKey(RenderPass pass, unsigned program, uint16_t material, unsigned vao, float viewDepth) {
+	uint64_t depth = quantizeDepth(viewDepth);
+	uint64_t key = keyBits(pass, 2) << 62;
+	if (pass == RENDER_PASS_TRANSPARENT) {
+		key |= keyBits(~depth, 30) << 32;
+		key |= keyBits(program, 10) << 22;
+		key |= keyBits(material, 12) << 10;
+		key |= keyBits(vao, 10);
+	} else {
+		key |= keyBits(program, 10) << 52;
+		key |= keyBits(material, 12) << 40;
+		key |= keyBits(vao, 10) << 30;
+		key |= depth;
+	}
+	return key;
+}
+
+void beginRenderQueue(RenderQueue& queue) {
+	queue.keys.clear();
+	queue.order.clear();
+	queue.packets.clear();
+	queue.objects.clear();
+	queue.depthPrograms.clear();
+	queue.drawn = 0;
+	queue.stats = RenderQueueStats();
+}
+
+uint32_t addObjectData(RenderQueue& queue, const ObjectData& object) {
+	queue.objects.push_back(object);
+	return static_cast<uint32_t>(queue.objects.size() - 1);
+}
+
+void submitDraw(RenderQueue& queue, RenderPass pass, const DrawPacket& packet, float viewDepth) {
+	uint32_t index = static_cast<uint32_t>(queue.packets.size());
+	queue.keys.push_back(makeSortKey(pass, packet.program, packet.material, packet.vao, viewDepth));
+	queue.order.push_back(index);
+	queue.packets.push_back(packet);
+}
+
+void submitDraw(RenderQueue& queue, RenderPass pass, const DrawPacket& packet, const ObjectData& object, float viewDepth) {
+	DrawPacket withObject = packet;
+	withObject.object = addObjectData(queue, object);
+	submitDraw(queue, pass, withObject, viewDepth);
+}
+
+// LSD radix sort over bytes, stable. Bytes equal across all keys are skipped, which for a
+// handful of programs and materials is most of them.
+static void radixSort(RenderQueue& queue) {
+	size_t n = queue.keys.size();
+	queue.keyScratch.resize(n);
+	queue.orderScratch.resize(n);
+
+	uint64_t* keys = queue.keys.data();
+	uint32_t* order = queue.order.data();
+	uint64_t* keysOut = queue.keyScratch.data();
+	uint32_t* orderOut = queue.orderScratch.data();
+
+	for (int shift = 0; shift < 64; shift += 8) {
+		size_t counts[256] = {0, };
+		for (size_t i = 0; i < n; ++i) {
+			++counts[(keys[i] >> shift) & 0xFF];
+		}
+		if (counts[(keys[0] >> shift) & 0xFF] == n) {
+			continue;
+		}
+
+		size_t sum = 0;
+		for (size_t& count : counts) {
+			size_t c = count;
+			count = sum;
+			sum += c;
+		}
+		for (size_t i = 0; i < n; ++i) {
+			size_t dst = counts[(keys[i] >> shift) & 0xFF]++;
+			keysOut[dst] = keys[i];
+			orderOut[dst] = order[i];
+		}
+		std::swap(keys, keysOut);
+		std::swap(order, orderOut);
+	}
+
+	// After an odd number of passes the result sits in the scratch arrays.
+	if (keys != queue.keys.data()) {
+		queue.keys.swap(queue.keyScratch);
+		queue.order.swap(queue.orderScratch);
+	}
+}
+
+static void bindMaterial(const Material& material, UniformTable& uniforms) {
+	for (int i = 0; i < material.numTextures; ++i) {
+		bindTexture(i, GL_TEXTURE_2D, material.textures[i]);
+		setUniform(uniforms, material.samplers[i], i);
+	}
+}
+
+static bool canMerge(const DrawPacket& lhs, const DrawPacket& rhs) {
+	return lhs.program == rhs.program && lhs.material == rhs.material && lhs.vao == rhs.vao
+		&& lhs.mode == rhs.mode && lhs.object == rhs.object && lhs.condition == 0 && rhs.condition == 0
+		&& lhs.vertexTexture == 0 && rhs.vertexTexture == 0 && lhs.depthPrepassed == rhs.depthPrepassed;
+}
+
+static void appendBatch(RenderQueue& queue, const DrawPacket& packet) {
+	queue.batchCounts.push_back(packet.indexCount);
+	queue.batchOffsets.push_back(reinterpret_cast<const void*>(static_cast<size_t>(packet.firstIndex) * sizeof(uint32_t)));
+	queue.batchBaseVertices.push_back(packet.baseVertex);
+}
+
+static void flushBatch(RenderQueue& queue, GLenum mode, unsigned condition) {
+	GLsizei count = static_cast<GLsizei>(queue.batchCounts.size());
+	// Without waiting: if the result is not in yet the draw goes ahead.
+	if (count > 0 && condition) {
+		glBeginConditionalRender(condition, GL_QUERY_NO_WAIT);
+		++queue.stats.conditionalDraws;
+	}
+	if (count == 1) {
+		glDrawElementsBaseVertex(mode, queue.batchCounts[0], GL_UNSIGNED_INT, queue.batchOffsets[0], queue.batchBaseVertices[0]);
+	} else if (count > 1) {
+		glMultiDrawElementsBaseVertex(mode, queue.batchCounts.data(), GL_UNSIGNED_INT,
+			queue.batchOffsets.data(), count, queue.batchBaseVertices.data());
+	}
+	if (count > 0 && condition) {
+		glEndConditionalRender();
+	}
+	if (count > 0) {
+		++queue.stats.calls;
+	}
+	queue.batchCounts.clear();
+	queue.batchOffsets.clear();
+	queue.batchBaseVertices.clear();
+}
+
+void prepareRenderQueue(RenderQueue& queue, UniformBlocks& blocks) {
+	if (queue.packets.empty()) {
+		return;
+	}
+	radixSort(queue);
+	uploadObjectData(blocks, queue.objects.data(), queue.objects.size());
+}
+
+void drawRenderQueue(RenderQueue& queue, UniformBlocks& blocks, RenderPass first, RenderPass last) {
+	const DrawPacket* prev = nullptr;
+	UniformTable* uniforms = nullptr;
+	for (; queue.drawn < queue.order.size(); ++queue.drawn) {
+		RenderPass pass = static_cast<RenderPass>(queue.keys[queue.drawn] >> 62);
+		if (pass > last) {
+			break;
+		}
+		if (pass < first) {
+			continue;
+		}
+		const DrawPacket& packet = queue.packets[queue.order[queue.drawn]];
+		++queue.stats.draws;
+
+		if (prev && canMerge(*prev, packet)) {
+			appendBatch(queue, packet);
+			continue;
+		}
+		if (prev) {
+			flushBatch(queue, prev->mode, prev->condition);
+		}
+
+		// Other code may have used other programs since the last call, so the first draw
+		// always goes through useProgram, which drops it if nothing changed.
+		bool programChanged = !prev || prev->program != packet.program;
+		if (programChanged) {
+			uniforms = &programUniforms(packet.program);
+			useProgram(packet.program);
+			++queue.stats.programSwitches;
+		}
+		// Sampler uniforms belong to the program, so a new program needs them set even if the
+		// textures stay. Both are cheap when nothing changes.
+		if (packet.material != noMaterial && (programChanged || prev->material != packet.material)) {
+			bindMaterial(queue.materials[packet.material], *uniforms);
+		}
+		if (!prev || prev->material != packet.material) {
+			++queue.stats.materialSwitches;
+		}
+		if (!prev || prev->vao != packet.vao) {
+			bindVertexArray(packet.vao);
+			++queue.stats.vaoSwitches;
+		}
+		if (packet.depthPrepassed != (prev && prev->depthPrepassed)) {
+			setDepthFunc(packet.depthPrepassed ? GL_EQUAL : GL_LESS);
+			setDepthMask(!packet.depthPrepassed);
+		}
+		bindObjectData(blocks, packet.object);
+
+		if (packet.vertexTexture) {
+			if (packet.condition) {
+				glBeginConditionalRender(packet.condition, GL_QUERY_NO_WAIT);
+				++queue.stats.conditionalDraws;
+			}
+			drawPulledPacket(packet, *uniforms);
+			if (packet.condition) {
+				glEndConditionalRender();
+			}
+			++queue.stats.calls;
+			prev = &packet;
+			continue;
+		}
+		appendBatch(queue, packet);
+		prev = &packet;
+	}
+	if (prev) {
+		flushBatch(queue, prev->mode, prev->condition);
+		if (prev->depthPrepassed) {
+			setDepthFunc(GL_LESS);
+			setDepthMask(true);
+		}
+	}
+}
+
+void setDepthProgram(RenderQueue& queue, unsigned program, unsigned depthProgram) {
+	for (auto& entry : queue.depthPrograms) {
+		if (entry.first == program) {
+			entry.second = depthProgram;
+			return;
+		}
+	}
+	queue.depthPrograms.push_back({program, depthProgram});
+}
+
+static unsigned findDepthProgram(const RenderQueue& queue, unsigned program) {
+	for (const auto& entry : queue.depthPrograms) {
+		if (entry.first == program) {
+			return entry.second;
+		}
+	}
+	return 0;
+}
+
+void drawRenderQueueDepth(RenderQueue& queue, UniformBlocks& blocks, RenderPass pass) {
+	const DrawPacket* prev = nullptr;
+	unsigned prevProgram = 0;
+	UniformTable* uniforms = nullptr;
+	for (size_t i = queue.drawn; i < queue.order.size(); ++i) {
+		RenderPass packetPass = static_cast<RenderPass>(queue.keys[i] >> 62);
+		if (packetPass > pass) {
+			break;
+		}
+		DrawPacket& packet = queue.packets[queue.order[i]];
+		unsigned program = findDepthProgram(queue, packet.program);
+		if (packetPass < pass || packet.condition || !program) {
+			continue;
+		}
+		packet.depthPrepassed = true;
+
+		// Like canMerge, on what the pre-pass binds.
+		bool merge = prev && prevProgram == program && prev->depthVao == packet.depthVao && prev->mode == packet.mode
+			&& prev->object == packet.object && prev->vertexTexture == 0 && packet.vertexTexture == 0;
+		if (merge) {
+			appendBatch(queue, packet);
+			continue;
+		}
+		if (prev) {
+			flushBatch(queue, prev->mode, 0);
+		}
+		if (!prev || prevProgram != program) {
+			uniforms = &programUniforms(program);
+			useProgram(program);
+		}
+		if (!prev || prev->depthVao != packet.depthVao) {
+			bindVertexArray(packet.depthVao);
+		}
+		bindObjectData(blocks, packet.object);
+		if (packet.vertexTexture) {
+			drawPulledPacket(packet, *uniforms);
+			++queue.stats.calls;
+		} else {
+			appendBatch(queue, packet);
+		}
+		prev = &packet;
+		prevProgram = program;
+	}
+	if (prev) {
+		flushBatch(queue, prev->mode, 0);
+	}
+}
+
+void executeRenderQueue(RenderQueue& queue, UniformBlocks& blocks) {
+	prepareRenderQueue(queue, blocks);
+	finishFrameRing(*blocks.ring);
+	bindFrameData(blocks);
+	drawRenderQueue(queue, blocks, RENDER_PASS_OPAQUE, RENDER_PASS_TRANSPARENT);
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "blocks.h"
+#include "geometry.h"
+
+// Passes run in this order. The pass is the top of the sort key.
+enum RenderPass {
+	RENDER_PASS_OPAQUE = 0,
+	// Opaque draws that only go ahead if their occlusion query passed, see occlusion.h. Drawn
+	// after the queries are issued against the depth of the opaque pass.
+	RENDER_PASS_OCCLUSION_TESTED = 1,
+	RENDER_PASS_DEBUG = 2,
+	RENDER_PASS_TRANSPARENT = 3,
+};
+
+const int maxMaterialTextures = 4;
+const uint16_t noMaterial = 0xFFFF;
+
+// Textures bound to consecutive units, starting at 0, with the sampler each unit feeds.
+struct Material {
+	int numTextures = 0;
+	unsigned textures[maxMaterialTextures];
+	uint64_t samplers[maxMaterialTextures];
+};
+
+// Everything needed to issue one draw once the queue is sorted. Draws are indexed, from a
+// GeometryArena mesh, or pulled, see vertexpulling.h.
+struct DrawPacket {
+	unsigned program;
+	unsigned vao;
+	uint16_t material;
+	uint16_t mode;
+	int firstIndex;
+	int indexCount;
+	int baseVertex;
+	// Slot in RenderQueue::objects.
+	uint32_t object;
+	// Occlusion query the draw is conditional on, 0 to always draw.
+	unsigned condition;
+	// Buffer textures the vertices and indices are pulled from, 0 when the vertex array feeds them.
+	unsigned positionTexture;
+	unsigned vertexTexture;
+	unsigned indexTexture;
+	uint16_t vertexFormat;
+	// What the depth pre-pass draws the packet through, GeometryArena::positionVao unless pulled.
+	unsigned depthVao;
+	// Set by drawRenderQueueDepth. The color draw then tests GL_EQUAL against the depth the
+	// pre-pass wrote, without writing.
+	bool depthPrepassed;
+};
+
+DrawPacket makeDrawPacket(const GeometryArena& arena, int mesh, unsigned program, uint16_t material, GLenum mode);
+// Same through GeometryArena::positionVao, for programs that read nothing but the position:
+// depth only and shadow passes, the light cube.
+DrawPacket makeDepthDrawPacket(const GeometryArena& arena, int mesh, unsigned program, uint16_t material, GLenum mode);
+
+// Counted while executing: how often the bound state actually had to change between draws.
+struct RenderQueueStats {
+	int draws = 0;
+	// Draws wrapped in conditional rendering.
+	int conditionalDraws = 0;
+	// GL draw calls, less than draws when some were merged into multi-draws.
+	int calls = 0;
+	int programSwitches = 0;
+	int materialSwitches = 0;
+	int vaoSwitches = 0;
+};
+
+struct RenderQueue {
+	// Persistent, indexed by DrawPacket::material.
+	std::vector<Material> materials;
+
+	// Per frame.
+	std::vector<uint64_t> keys;
+	// Where drawRenderQueue continues, in order.
+	size_t drawn = 0;
+	std::vector<uint32_t> order;
+	std::vector<DrawPacket> packets;
+	std::vector<ObjectData> objects;
+	// Program to draw with in the depth pre-pass, for each program that has one.
+	std::vector<std::pair<unsigned, unsigned>> depthPrograms;
+	RenderQueueStats stats;
+
+	// Radix sort scratch space, kept to avoid allocations every frame.
+	std::vector<uint64_t> keyScratch;
+	std::vector<uint32_t> orderScratch;
+
+	// Multi-draw arguments of the run of draws being merged.
+	std::vector<GLsizei> batchCounts;
+	std::vector<const void*> batchOffsets;
+	std::vector<GLint> batchBaseVertices;
+};
+
+uint16_t addMaterial(RenderQueue& queue, const Material& material);
+
+// Key layout, most significant first. Opaque and debug: pass:2 program:10 material:12 vao:10 depth:30,
+// so state changes are minimized and draws sharing state go front to back for early-Z.
+// Transparent: pass:2 inverted depth:30 program:10 material:12 vao:10, back to front.
+// GL names are truncated to their bit width, a collision only costs a redundant switch.
+uint64_t makeSortKey(RenderPass pass, unsigned program, uint16_t material, unsigned vao, float viewDepth);
+
+void beginRenderQueue(RenderQueue& queue);
+// Object data several draws can share, their packets take the returned slot.
+uint32_t addObjectData(RenderQueue& queue, const ObjectData& object);
+// viewDepth is the distance of the object along the view direction, used to order the draws.
+void submitDraw(RenderQueue& queue, RenderPass pass, const DrawPacket& packet, float viewDepth);
+// Same, with object data of its own.
+void submitDraw(RenderQueue& queue, RenderPass pass, const DrawPacket& packet, const ObjectData& object, float viewDepth);
+// Sorts the frame's draws and uploads their object data to the frame ring, so it comes before
+// finishFrameRing.
+void prepareRenderQueue(RenderQueue& queue, UniformBlocks& blocks);
+// Issues the draws of passes first to last, the queue must be prepared. Neighbouring draws that
+// share program, material, vertex array and object data go out as one glMultiDrawElementsBaseVertex.
+// Pulled draws go out one by one.
+void drawRenderQueue(RenderQueue& queue, UniformBlocks& blocks, RenderPass first, RenderPass last);
+// Pre-pass over the draws of pass that are not conditional and whose program has a depth program,
+// writing only depth. It does not advance the queue: drawRenderQueue then draws the same packets
+// in color, shading only the fragments that ended up visible. Color writes must be off.
+void drawRenderQueueDepth(RenderQueue& queue, UniformBlocks& blocks, RenderPass pass);
+// For this frame's drawRenderQueueDepth: draws of program go through depthProgram, see
+// ShaderVariantKey::depthOnly.
+void setDepthProgram(RenderQueue& queue, unsigned program, unsigned depthProgram);
+// Prepares, finishes the frame ring and draws every pass, for frames with nothing else to upload.
+void executeRenderQueue(RenderQueue& queue, UniformBlocks& blocks);
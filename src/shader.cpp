@@ -0,0 +1,522 @@
+#include "shader.h"
+#include "embed.h"
+#include "glstate.h"
+#include "uniforms.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+
+#include <sys/stat.h>
+
+ShaderCacheStats shaderCacheStats;
+bool shaderSourcesFromDisk = false;
+
+static const char* shaderCacheDir = ".shadercache";
+static const uint32_t shaderCacheMagic = 0x31424750; // "PGB1"
+
+// Layout of a cache file. The binary blob follows right after the header.
+struct ProgramBinaryHeader {
+	uint32_t magic;
+	uint32_t format;
+	uint32_t length;
+	float buildMs;
+	uint64_t key;
+};
+
+static double nowMs() {
+	static auto start = std::chrono::steady_clock::now();
+	auto now = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::milli>(now - start).count();
+}
+
+static bool parallelCompile = false;
+static unsigned fallbackProgram = 0;
+
+// Drawn in place of programs that are still compiling or failed to build.
+static const char* fallbackVertSource =
+	"#version 330\n"
+	"layout (location = 0) in vec3 inPos;\n"
+	"layout (std140) uniform ObjectData {\n"
+	"\tmat4 model;\n"
+	"\tmat4 modelViewProj;\n"
+	"};\n"
+	"void main() {\n"
+	"\tgl_Position = modelViewProj * vec4(inPos, 1.0);\n"
+	"}\n";
+
+static const char* fallbackFragSource =
+	"#version 330\n"
+	"out vec4 FragColor;\n"
+	"void main() {\n"
+	"\tFragColor = vec4(0.8, 0.2, 0.8, 1.0);\n"
+	"}\n";
+
+bool readSourceFile(const char* path, std::string& source) {
+	FILE* fp = fopen(path, "rb");
+	if (!fp) {
+		printf("Failed to open shader %s.\n", path);
+		return false;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	source.resize(size > 0 ? static_cast<size_t>(size) : 0);
+	size_t numRead = fread(&source[0], 1, source.size(), fp);
+	fclose(fp);
+
+	source.resize(numRead);
+	return true;
+}
+
+bool loadShaderSource(const char* path, std::string& source, uint64_t& hash) {
+	const EmbeddedFile* file = shaderSourcesFromDisk ? nullptr : findEmbeddedFile(path);
+	if (file) {
+		source.assign(file->data, file->size);
+		hash = file->hash;
+		return true;
+	}
+
+	if (!readSourceFile(path, source)) {
+		return false;
+	}
+	hash = contentHash(source.data(), source.size());
+	return true;
+}
+
+std::string injectDefines(const std::string& source, const char* defines) {
+	if (!defines || !defines[0]) {
+		return source;
+	}
+
+	size_t versionPos = source.find("#version");
+	size_t insertPos = 0;
+	if (versionPos != std::string::npos) {
+		size_t eol = source.find('\n', versionPos);
+		insertPos = (eol == std::string::npos) ? source.size() : eol + 1;
+	}
+
+	std::string res;
+	res.reserve(source.size() + strlen(defines) + 1);
+	res.append(source, 0, insertPos);
+	res.append(defines);
+	if (res.back() != '\n') {
+		res.push_back('\n');
+	}
+	res.append(source, insertPos, std::string::npos);
+	return res;
+}
+
+static unsigned submitShader(const char* source, GLenum type) {
+	unsigned shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+	return shader;
+}
+
+static bool checkShader(unsigned shader, const char* name) {
+	int success = 1;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+	if (!success) {
+		printf("Problem with compilation of %s shader!\n", name);
+		char info[512];
+		glGetShaderInfoLog(shader, 512, NULL, info);
+		printf("Shader info log: %s\n", info);
+	}
+	return success;
+}
+
+static bool checkProgram(unsigned program) {
+	int success = 1;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if (!success) {
+		printf("Problem with linking of shading program!\n");
+		char info[512];
+		glGetProgramInfoLog(program, 512, NULL, info);
+		printf("Program info log: %s\n", info);
+	}
+	return success;
+}
+
+unsigned compileShader(const char* source, GLenum type, const char* name) {
+	unsigned shader = submitShader(source, type);
+	checkShader(shader, name);
+	return shader;
+}
+
+static unsigned submitProgram(const std::vector<unsigned>& shaders, bool retrievable) {
+	unsigned program = glCreateProgram();
+	for (unsigned shader : shaders) {
+		glAttachShader(program, shader);
+	}
+	if (retrievable) {
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+	glLinkProgram(program);
+	return program;
+}
+
+unsigned createShaderProgram(const std::vector<unsigned>& shaders) {
+	unsigned program = submitProgram(shaders, false);
+	checkProgram(program);
+	for (unsigned shader : shaders) {
+		glDetachShader(program, shader);
+	}
+	return program;
+}
+
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size) {
+	return contentHash(static_cast<const char*>(data), size, hash);
+}
+
+static uint64_t hashString(uint64_t hash, const char* str) {
+	// Include the terminator so that "ab"+"c" and "a"+"bc" hash differently.
+	return hashBytes(hash, str ? str : "", (str ? strlen(str) : 0) + 1);
+}
+
+static bool programBinarySupported() {
+	static int numFormats = -1;
+	if (numFormats < 0) {
+		numFormats = 0;
+		if (GLAD_GL_ARB_get_program_binary) {
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+		}
+	}
+	return numFormats > 0;
+}
+
+// The sources enter the key through their content hashes, precomputed for embedded files.
+static uint64_t programCacheKey(const std::vector<ShaderStage>& stages, const std::vector<uint64_t>& sourceHashes, const char* defines) {
+	uint64_t key = contentHash(nullptr, 0);
+	// A binary is only valid for the exact driver that produced it.
+	key = hashString(key, reinterpret_cast<const char*>(glGetString(GL_VENDOR)));
+	key = hashString(key, reinterpret_cast<const char*>(glGetString(GL_RENDERER)));
+	key = hashString(key, reinterpret_cast<const char*>(glGetString(GL_VERSION)));
+	key = hashString(key, defines);
+
+	size_t i = 0;
+	for (const ShaderStage& stage : stages) {
+		key = hashBytes(key, &stage.type, sizeof(stage.type));
+		key = hashBytes(key, &sourceHashes[i], sizeof(sourceHashes[i]));
+		++i;
+	}
+	return key;
+}
+
+static void programCachePath(uint64_t key, char* path, size_t size) {
+	snprintf(path, size, "%s/%016llx.bin", shaderCacheDir, static_cast<unsigned long long>(key));
+}
+
+// Returns 0 if there is no usable binary for this key.
+static unsigned loadProgramBinary(uint64_t key, float& buildMs) {
+	char path[256];
+	programCachePath(key, path, sizeof(path));
+	FILE* fp = fopen(path, "rb");
+	if (!fp) {
+		return 0;
+	}
+
+	ProgramBinaryHeader header;
+	std::vector<char> blob;
+	bool valid = fread(&header, sizeof(header), 1, fp) == 1 && header.magic == shaderCacheMagic && header.key == key;
+	if (valid) {
+		blob.resize(header.length);
+		valid = fread(blob.data(), 1, blob.size(), fp) == blob.size();
+	}
+	fclose(fp);
+	if (!valid) {
+		remove(path);
+		return 0;
+	}
+
+	unsigned program = glCreateProgram();
+	glProgramBinary(program, header.format, blob.data(), static_cast<GLsizei>(blob.size()));
+
+	int success = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if (!success) {
+		// Driver update or a format it no longer accepts. Drop the entry and compile from source.
+		glDeleteProgram(program);
+		remove(path);
+		++shaderCacheStats.rejected;
+		return 0;
+	}
+
+	buildMs = header.buildMs;
+	return program;
+}
+
+static void saveProgramBinary(unsigned program, uint64_t key, float buildMs) {
+	int length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) {
+		return;
+	}
+
+	std::vector<char> blob(static_cast<size_t>(length));
+	GLenum format = 0;
+	GLsizei written = 0;
+	glGetProgramBinary(program, length, &written, &format, blob.data());
+	if (written <= 0) {
+		return;
+	}
+
+	mkdir(shaderCacheDir, 0755);
+	char path[256];
+	programCachePath(key, path, sizeof(path));
+	FILE* fp = fopen(path, "wb");
+	if (!fp) {
+		printf("Failed to write program cache %s.\n", path);
+		return;
+	}
+
+	ProgramBinaryHeader header;
+	header.magic = shaderCacheMagic;
+	header.format = format;
+	header.length = static_cast<uint32_t>(written);
+	header.buildMs = buildMs;
+	header.key = key;
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(blob.data(), 1, header.length, fp);
+	fclose(fp);
+}
+
+void initShaderPipeline() {
+	parallelCompile = GLAD_GL_KHR_parallel_shader_compile;
+	if (parallelCompile) {
+		// Let the driver pick the number of compiler threads.
+		glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+	}
+
+	unsigned vert = compileShader(fallbackVertSource, GL_VERTEX_SHADER, "fallback vertex");
+	unsigned frag = compileShader(fallbackFragSource, GL_FRAGMENT_SHADER, "fallback fragment");
+	fallbackProgram = createShaderProgram({vert, frag});
+	glDeleteShader(vert);
+	glDeleteShader(frag);
+}
+
+ShaderProgram submitShaderProgram(const std::vector<ShaderStage>& stages, const char* defines) {
+	ShaderProgram sp;
+	sp.submitMs = nowMs();
+	sp.stages = stages;
+	sp.defines = defines ? defines : "";
+
+	std::vector<std::string> sources;
+	std::vector<uint64_t> sourceHashes;
+	sources.reserve(stages.size());
+	for (const ShaderStage& stage : stages) {
+		std::string source;
+		uint64_t hash = 0;
+		if (!loadShaderSource(stage.path, source, hash)) {
+			sp.ready = true;
+			sp.failed = true;
+			return sp;
+		}
+		sources.push_back(injectDefines(source, defines));
+		sourceHashes.push_back(hash);
+	}
+
+	bool useCache = programBinarySupported();
+	if (useCache) {
+		sp.cacheKey = programCacheKey(stages, sourceHashes, defines);
+		float buildMs = 0.f;
+		sp.program = loadProgramBinary(sp.cacheKey, buildMs);
+		if (sp.program) {
+			double loadMs = nowMs() - sp.submitMs;
+			++shaderCacheStats.hits;
+			shaderCacheStats.loadMs += loadMs;
+			shaderCacheStats.savedMs += buildMs - loadMs;
+			sp.ready = true;
+			return sp;
+		}
+	}
+
+	// Submit everything, check nothing. The status is queried in pollShaderProgram.
+	for (const std::string& source : sources) {
+		size_t i = sp.shaders.size();
+		sp.shaders.push_back(submitShader(source.c_str(), stages[i].type));
+	}
+	sp.program = submitProgram(sp.shaders, useCache);
+	sp.saveBinary = useCache;
+	++shaderCacheStats.misses;
+	return sp;
+}
+
+// Runs once per program, after the driver is done with it.
+static void finishShaderProgram(ShaderProgram& sp) {
+	bool success = true;
+	for (size_t i = 0; i < sp.shaders.size(); ++i) {
+		success &= checkShader(sp.shaders[i], sp.stages[i].path);
+	}
+	success &= checkProgram(sp.program);
+
+	for (unsigned shader : sp.shaders) {
+		glDetachShader(sp.program, shader);
+		glDeleteShader(shader);
+	}
+	sp.shaders.clear();
+
+	double buildMs = nowMs() - sp.submitMs;
+	if (success && sp.saveBinary) {
+		saveProgramBinary(sp.program, sp.cacheKey, static_cast<float>(buildMs));
+	}
+	shaderCacheStats.loadMs += buildMs;
+
+	sp.ready = true;
+	sp.failed = !success;
+}
+
+bool pollShaderProgram(ShaderProgram& sp) {
+	if (sp.ready) {
+		return true;
+	}
+
+	if (parallelCompile) {
+		int complete = 0;
+		glGetProgramiv(sp.program, GL_COMPLETION_STATUS_KHR, &complete);
+		if (!complete) {
+			return false;
+		}
+	}
+
+	finishShaderProgram(sp);
+	return true;
+}
+
+unsigned shaderProgramHandle(ShaderProgram& sp) {
+	if (!pollShaderProgram(sp) || sp.failed) {
+		return fallbackProgram;
+	}
+	return sp.program;
+}
+
+void deleteShaderProgram(ShaderProgram& sp) {
+	for (unsigned shader : sp.shaders) {
+		glDeleteShader(shader);
+	}
+	sp.shaders.clear();
+	if (sp.program) {
+		forgetProgramUniforms(sp.program);
+		deleteProgram(sp.program);
+	}
+	sp = ShaderProgram();
+}
+
+void replaceShaderProgram(ShaderProgram& sp, unsigned program) {
+	for (unsigned shader : sp.shaders) {
+		glDeleteShader(shader);
+	}
+	sp.shaders.clear();
+	if (sp.program) {
+		forgetProgramUniforms(sp.program);
+		deleteProgram(sp.program);
+	}
+	sp.program = program;
+	sp.ready = true;
+	sp.failed = false;
+}
+
+unsigned loadShaderProgram(const std::vector<ShaderStage>& stages, const char* defines) {
+	ShaderProgram sp = submitShaderProgram(stages, defines);
+	if (!sp.ready) {
+		finishShaderProgram(sp);
+	}
+	return sp.program;
+}
+
+unsigned buildShaderProgram(const std::vector<ShaderStage>& stages, const char* defines) {
+	double start = nowMs();
+	std::vector<std::string> sources;
+	std::vector<uint64_t> sourceHashes;
+	for (const ShaderStage& stage : stages) {
+		std::string source;
+		uint64_t hash = 0;
+		if (!loadShaderSource(stage.path, source, hash)) {
+			return 0;
+		}
+		sources.push_back(injectDefines(source, defines));
+		sourceHashes.push_back(hash);
+	}
+
+	bool useCache = programBinarySupported();
+	bool success = true;
+	std::vector<unsigned> shaders;
+	for (size_t i = 0; i < stages.size(); ++i) {
+		shaders.push_back(submitShader(sources[i].c_str(), stages[i].type));
+	}
+	unsigned program = submitProgram(shaders, useCache);
+	for (size_t i = 0; i < stages.size(); ++i) {
+		success &= checkShader(shaders[i], stages[i].path);
+	}
+	success &= checkProgram(program);
+	for (unsigned shader : shaders) {
+		glDetachShader(program, shader);
+		glDeleteShader(shader);
+	}
+
+	if (!success) {
+		glDeleteProgram(program);
+		return 0;
+	}
+	if (useCache) {
+		uint64_t key = programCacheKey(stages, sourceHashes, defines);
+		saveProgramBinary(program, key, static_cast<float>(nowMs() - start));
+	}
+	return program;
+}
+
+std::string shaderVariantDefines(const ShaderVariantKey& key) {
+	char defines[512];
+	snprintf(defines, sizeof(defines),
+		"#define NORMAL_MAPPING %d\n"
+		"#define SPECULAR %d\n"
+		"#define LIGHT_COUNT %d\n"
+		"#define PACKED_VERTICES %d\n"
+		"#define INSTANCED %d\n"
+		"#define VERTEX_PULLING %d\n"
+		"#define DEPTH_ONLY %d\n"
+		"#define TANGENT_SPACE_LIGHTING %d\n"
+		"#define VERTEX_LIGHTING %d\n"
+		"#define CLUSTERED_LIGHTING %d\n",
+		key.normalMapping ? 1 : 0, key.specular ? 1 : 0, key.lightCount, key.packedVertices ? 1 : 0,
+		key.instanced ? 1 : 0, key.vertexPulling ? 1 : 0, key.depthOnly ? 1 : 0, key.tangentSpaceLighting ? 1 : 0,
+		key.vertexLighting ? 1 : 0, key.clusteredLighting ? 1 : 0);
+	return defines;
+}
+
+uint64_t shaderVariantHash(const ShaderVariantKey& key) {
+	uint64_t hash = static_cast<uint32_t>(key.lightCount);
+	hash = (hash << 1) | (key.normalMapping ? 1 : 0);
+	hash = (hash << 1) | (key.specular ? 1 : 0);
+	hash = (hash << 1) | (key.packedVertices ? 1 : 0);
+	hash = (hash << 1) | (key.instanced ? 1 : 0);
+	hash = (hash << 1) | (key.vertexPulling ? 1 : 0);
+	hash = (hash << 1) | (key.depthOnly ? 1 : 0);
+	hash = (hash << 1) | (key.tangentSpaceLighting ? 1 : 0);
+	hash = (hash << 1) | (key.vertexLighting ? 1 : 0);
+	hash = (hash << 1) | (key.clusteredLighting ? 1 : 0);
+	return hash;
+}
+
+ShaderProgram& requestShaderVariant(ShaderVariants& sv, const ShaderVariantKey& key) {
+	uint64_t hash = shaderVariantHash(key);
+	auto it = sv.variants.find(hash);
+	if (it != sv.variants.end()) {
+		return it->second;
+	}
+
+	std::string defines = shaderVariantDefines(key);
+	ShaderProgram& sp = sv.variants[hash];
+	sp = submitShaderProgram(sv.stages, defines.c_str());
+	return sp;
+}
+
+void deleteShaderVariants(ShaderVariants& sv) {
+	for (auto& it : sv.variants) {
+		deleteShaderProgram(it.second);
+	}
+	sv.variants.clear();
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../include/glad/glad.h"
+
+struct ShaderStage {
+	const char* path;
+	GLenum type;
+};
+
+// Counters filled in while loading programs, used to report how much startup time the cache saved.
+struct ShaderCacheStats {
+	int hits = 0;
+	int misses = 0;
+	int rejected = 0;
+	// Time spent loading programs, cached or not.
+	double loadMs = 0.0;
+	// Compile+link time recorded when the cached binaries were built, minus what loading them cost.
+	double savedMs = 0.0;
+};
+
+extern ShaderCacheStats shaderCacheStats;
+
+// Shader sources are compiled into the executable by embed.sh. Set this to read them from
+// disk instead, while editing shaders.
+extern bool shaderSourcesFromDisk;
+
+// A program whose compile and link were submitted but whose status was not checked yet.
+// Asking the driver for the status right away forces it to finish the work before the next
+// shader is even submitted, so the check is deferred until the program is first drawn with.
+struct ShaderProgram {
+	unsigned program = 0;
+	bool ready = false;
+	bool failed = false;
+
+	// What the program was built from, so it can be rebuilt when a source changes.
+	std::vector<ShaderStage> stages;
+	std::string defines;
+
+	std::vector<unsigned> shaders;
+	bool saveBinary = false;
+	uint64_t cacheKey = 0;
+	double submitMs = 0.0;
+};
+
+bool readSourceFile(const char* path, std::string& source);
+// The embedded copy of the source unless shaderSourcesFromDisk is set, along with its content hash.
+bool loadShaderSource(const char* path, std::string& source, uint64_t& hash);
+// Insert the defines right after the #version line, which must stay the first line of a GLSL source.
+std::string injectDefines(const std::string& source, const char* defines);
+
+unsigned compileShader(const char* source, GLenum type, const char* name);
+unsigned createShaderProgram(const std::vector<unsigned>& shaders);
+
+// Enables driver side parallel compilation where available and builds the fallback program.
+// Must be called once after the GL context is created.
+void initShaderPipeline();
+
+// Kick off compilation and linking of the given stages without waiting for the result.
+// If the driver can hand out program binaries, linked programs are cached on disk and
+// later launches skip GLSL compilation altogether.
+ShaderProgram submitShaderProgram(const std::vector<ShaderStage>& stages, const char* defines = "");
+// Non-blocking with KHR_parallel_shader_compile, otherwise waits for the driver.
+bool pollShaderProgram(ShaderProgram& sp);
+// The program to draw with: the real one once it is ready, the fallback until then or if it failed.
+unsigned shaderProgramHandle(ShaderProgram& sp);
+void deleteShaderProgram(ShaderProgram& sp);
+// Swap a freshly built program in place of the current one, which is deleted.
+void replaceShaderProgram(ShaderProgram& sp, unsigned program);
+
+// Blocking variant of submitShaderProgram.
+unsigned loadShaderProgram(const std::vector<ShaderStage>& stages, const char* defines = "");
+// Compile and link from source right away. Returns 0 if any stage fails, leaves the stats alone.
+// Safe to call from a thread with a context shared with the main one.
+unsigned buildShaderProgram(const std::vector<ShaderStage>& stages, const char* defines);
+
+// Features baked into a shader at compile time. Turning one off removes its work from the shader
+// instead of branching on a uniform, so every combination in use is compiled as its own program.
+struct ShaderVariantKey {
+	bool normalMapping = true;
+	bool specular = true;
+	// Vertex layout produced by readObjectFile with packed = true.
+	bool packedVertices = false;
+	// Model matrix and material index come from per-instance attributes, see instancing.h.
+	bool instanced = false;
+	// Vertices read by the shader from the arena buffers, see vertexpulling.h. Any vertex format,
+	// packedVertices does not apply. Not combined with instanced.
+	bool vertexPulling = false;
+	// Position only and an empty fragment shader, for depth pre-passes. See depthprepass.h.
+	bool depthOnly = false;
+	// Light and view directions moved into tangent space per vertex, so fragments light the
+	// normal map's normal as is. Needs normalMapping. Images stay within 1/255 per channel of
+	// the world space path for rigid models with orthonormal tangent frames. Sheared models or
+	// skewed frames differ more, 11/255 in specular highlights for a sheared box, as the world
+	// space path lights a normal that is not unit length.
+	bool tangentSpaceLighting = false;
+	// Diffuse lighting per vertex, no normal map and no specular. See shadinglod.h.
+	bool vertexLighting = false;
+	// Point lights from the per-cluster lists of clusteredlighting.h on top of the lightCount
+	// global ones. Rules out tangentSpaceLighting and vertexLighting, the lights of a fragment
+	// are only known once its cluster is.
+	bool clusteredLighting = false;
+	int lightCount = 1;
+};
+
+std::string shaderVariantDefines(const ShaderVariantKey& key);
+uint64_t shaderVariantHash(const ShaderVariantKey& key);
+
+// The programs built from one set of stages, one per variant requested so far.
+struct ShaderVariants {
+	std::vector<ShaderStage> stages;
+	std::unordered_map<uint64_t, ShaderProgram> variants;
+};
+
+// Submits the variant the first time it is asked for, afterwards it is just a lookup.
+ShaderProgram& requestShaderVariant(ShaderVariants& sv, const ShaderVariantKey& key);
+void deleteShaderVariants(ShaderVariants& sv);
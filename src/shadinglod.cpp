@@ -0,0 +1,46 @@
+#include "shadinglod.h"
+
+#include <algorithm>
+
+// The least pixels each level but the coarsest needs.
+static const float levelPixels[shadingLodCount - 1] = {shadingLodFullPixels, shadingLodPhongPixels};
+
+ShaderVariantKey shadingLodVariant(const ShaderVariantKey& key, ShadingLod lod) {
+	ShaderVariantKey variant = key;
+	if (lod >= SHADING_LOD_PHONG) {
+		variant.normalMapping = false;
+		variant.tangentSpaceLighting = false;
+	}
+	if (lod >= SHADING_LOD_VERTEX) {
+		variant.specular = false;
+		// Clustered lights are found per fragment, so those variants stay per fragment, just
+		// without specular.
+		variant.vertexLighting = !key.clusteredLighting;
+	}
+	return variant;
+}
+
+void beginShadingLodFrame(ShadingLodSet& set, size_t objectCount, const glm::mat4& proj, float viewportHeight) {
+	// New objects start at the finest level and drop to theirs on their first selection.
+	set.levels.resize(objectCount, SHADING_LOD_FULL);
+	set.pixelScale = proj[1][1] * viewportHeight * 0.5f;
+	set.stats = ShadingLodStats();
+}
+
+float projectedPixels(const ShadingLodSet& set, float radius, float distance) {
+	// Inside the sphere it covers the whole screen anyway.
+	return radius * set.pixelScale / std::max(distance, radius);
+}
+
+ShadingLod selectShadingLod(ShadingLodSet& set, size_t id, float pixels) {
+	int level = set.levels[id];
+	while (level > SHADING_LOD_FULL && pixels >= levelPixels[level - 1] * (1.f + shadingLodHysteresis)) {
+		--level;
+	}
+	while (level < SHADING_LOD_VERTEX && pixels < levelPixels[level] * (1.f - shadingLodHysteresis)) {
+		++level;
+	}
+	set.levels[id] = static_cast<uint8_t>(level);
+	++set.stats.objects[level];
+	return static_cast<ShadingLod>(level);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "shader.h"
+
+#include <glm/glm.hpp>
+
+// Shading level of detail: the farther and smaller an object is on screen, the cheaper the
+// variant of its program. Normal map detail is lost below a few texels per pixel and specular
+// highlights below a few pixels, while the full variant still pays for both per fragment.
+// Boxes and static chunks go through the render queue with the program of their level. The GPU
+// scene puts its objects, instances included, into a draw list per level. The instance field of
+// the GL 3.3 path is a single instanced draw and stays at the full level.
+enum ShadingLod {
+	// The program as requested: normal mapping, specular, every light.
+	SHADING_LOD_FULL = 0,
+	// Phong with the interpolated vertex normal, no normal map.
+	SHADING_LOD_PHONG = 1,
+	// Diffuse lighting once per vertex, the fragment shader only samples the diffuse map.
+	SHADING_LOD_VERTEX = 2,
+};
+
+const int shadingLodCount = 3;
+
+// Projected radius in pixels an object needs to keep SHADING_LOD_FULL and SHADING_LOD_PHONG.
+const float shadingLodFullPixels = 48.f;
+const float shadingLodPhongPixels = 12.f;
+// Objects only move to a finer level once they are this much above its threshold, and to a
+// coarser one once this much below, so one sitting on a threshold does not flicker.
+const float shadingLodHysteresis = 0.2f;
+
+struct ShadingLodStats {
+	// Objects selected at each level this frame.
+	int objects[shadingLodCount] = {};
+};
+
+struct ShadingLodSet {
+	// Indexed by the ids the caller uses, which must stay stable across frames.
+	std::vector<uint8_t> levels;
+	// Pixels per unit of radius at a distance of one.
+	float pixelScale = 0.f;
+	ShadingLodStats stats;
+};
+
+// The variant of key drawn at lod.
+ShaderVariantKey shadingLodVariant(const ShaderVariantKey& key, ShadingLod lod);
+
+// proj is the projection of the frame, viewportHeight in pixels.
+void beginShadingLodFrame(ShadingLodSet& set, size_t objectCount, const glm::mat4& proj, float viewportHeight);
+// Radius in pixels of a sphere at distance from the camera.
+float projectedPixels(const ShadingLodSet& set, float radius, float distance);
+// The level of object id covering pixels, next to the one it had last frame.
+ShadingLod selectShadingLod(ShadingLodSet& set, size_t id, float pixels);
@@ -0,0 +1,378 @@
+#include "softocclusion.h"
+#include "jobs.h"
+
+#include "../include/glad/glad.h"
+
+#include <cstdio>
+#include <cmath>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SOFT_OCCLUSION_X86 1
+#else
+#define SOFT_OCCLUSION_X86 0
+#endif
+
+// Rows rasterized by one job, two rows of blocks.
+static const int bandHeight = 2 * softBlockSize;
+static const int blocksX = softDepthWidth / softBlockSize;
+static const int blocksY = softDepthHeight / softBlockSize;
+// Clip space w below which a vertex counts as behind the near plane.
+static const float nearW = 1e-3f;
+// Objects tested per job, and how often the budget is checked while testing.
+static const size_t testGrain = 4096;
+static const size_t budgetCheckInterval = 256;
+// Allowed depth difference when validating, in window depth units.
+static const float validateEpsilon = 1e-3f;
+// Depth a box must lie behind the occluders by to be culled, in window depth units. Covers the
+// rounding of the depth planes, so a box sharing a face with an occluder stays visible.
+static const float occludedEpsilon = 1e-5f;
+
+static_assert(softDepthWidth % 8 == 0, "rows are rasterized eight pixels at a time");
+static_assert(softDepthHeight % bandHeight == 0, "bands must cover the buffer");
+
+typedef std::chrono::steady_clock Clock;
+
+static float elapsedMs(Clock::time_point start) {
+	return std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+}
+
+void addOccluderBox(SoftOcclusion& so, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	static const int faces[36] = {
+		0, 2, 1, 0, 3, 2,
+		4, 5, 6, 4, 6, 7,
+		0, 1, 5, 0, 5, 4,
+		3, 6, 2, 3, 7, 6,
+		0, 4, 7, 0, 7, 3,
+		1, 2, 6, 1, 6, 5,
+	};
+	glm::vec3 corners[8];
+	for (int i = 0; i < 8; ++i) {
+		corners[i] = glm::vec3(
+			(i == 1 || i == 2 || i == 5 || i == 6) ? boundsMax.x : boundsMin.x,
+			(i == 2 || i == 3 || i == 6 || i == 7) ? boundsMax.y : boundsMin.y,
+			i >= 4 ? boundsMax.z : boundsMin.z);
+	}
+
+	SoftOccluder occluder;
+	occluder.firstVertex = so.vertices.size();
+	occluder.vertexCount = 36;
+	occluder.center = (boundsMin + boundsMax) * 0.5f;
+	for (int index : faces) {
+		so.vertices.push_back(corners[index]);
+	}
+	so.occluders.push_back(occluder);
+}
+
+void addOccluderTriangles(SoftOcclusion& so, const std::vector<glm::vec3>& triangles, const glm::mat4& model) {
+	SoftOccluder occluder;
+	occluder.firstVertex = so.vertices.size();
+	occluder.vertexCount = triangles.size() / 3 * 3;
+	glm::vec3 sum(0.f);
+	for (size_t i = 0; i < occluder.vertexCount; ++i) {
+		glm::vec3 p(model * glm::vec4(triangles[i], 1.f));
+		so.vertices.push_back(p);
+		sum += p;
+	}
+	occluder.center = occluder.vertexCount ? sum / static_cast<float>(occluder.vertexCount) : glm::vec3(model[3]);
+	so.occluders.push_back(occluder);
+}
+
+// Window coordinates in pixels, window depth in [0, 1], and clip w. w <= 0 marks a vertex
+// behind the near plane.
+static glm::vec4 toScreen(const glm::mat4& viewProj, const glm::vec3& p) {
+	glm::vec4 clip = viewProj * glm::vec4(p, 1.f);
+	if (clip.w < nearW) {
+		return glm::vec4(0.f, 0.f, 0.f, -1.f);
+	}
+	float invW = 1.f / clip.w;
+	return glm::vec4(
+		(clip.x * invW * 0.5f + 0.5f) * softDepthWidth,
+		(clip.y * invW * 0.5f + 0.5f) * softDepthHeight,
+		clip.z * invW * 0.5f + 0.5f,
+		clip.w);
+}
+
+// Edge functions and depth as planes over the pixel grid: value = a * x + b * y + c.
+struct TriangleSetup {
+	float edgeA[3], edgeB[3], edgeC[3];
+	float depthA, depthB, depthC;
+	int minX, maxX, minY, maxY;
+};
+
+static bool setupTriangle(const glm::vec4& v0, const glm::vec4& in1, const glm::vec4& in2, TriangleSetup& t) {
+	if (v0.w <= 0.f || in1.w <= 0.f || in2.w <= 0.f) {
+		return false;
+	}
+	float area = (in1.x - v0.x) * (in2.y - v0.y) - (in1.y - v0.y) * (in2.x - v0.x);
+	if (std::fabs(area) < 1e-6f) {
+		return false;
+	}
+	// Both windings are rasterized, occluders need not be closed or consistently wound.
+	const glm::vec4& v1 = area > 0.f ? in1 : in2;
+	const glm::vec4& v2 = area > 0.f ? in2 : in1;
+	area = std::fabs(area);
+
+	const glm::vec4* v[3] = {&v0, &v1, &v2};
+	for (int i = 0; i < 3; ++i) {
+		const glm::vec4& a = *v[i];
+		const glm::vec4& b = *v[(i + 1) % 3];
+		t.edgeA[i] = a.y - b.y;
+		t.edgeB[i] = b.x - a.x;
+		t.edgeC[i] = -(t.edgeA[i] * a.x + t.edgeB[i] * a.y);
+	}
+	// Edge i is zero on the side opposite vertex (i + 2) % 3, so it weighs that vertex.
+	float invArea = 1.f / area;
+	t.depthA = (t.edgeA[1] * v0.z + t.edgeA[2] * v1.z + t.edgeA[0] * v2.z) * invArea;
+	t.depthB = (t.edgeB[1] * v0.z + t.edgeB[2] * v1.z + t.edgeB[0] * v2.z) * invArea;
+	t.depthC = (t.edgeC[1] * v0.z + t.edgeC[2] * v1.z + t.edgeC[0] * v2.z) * invArea;
+
+	float minX = std::min(v0.x, std::min(v1.x, v2.x));
+	float maxX = std::max(v0.x, std::max(v1.x, v2.x));
+	float minY = std::min(v0.y, std::min(v1.y, v2.y));
+	float maxY = std::max(v0.y, std::max(v1.y, v2.y));
+	t.minX = std::max(0, static_cast<int>(std::floor(minX)));
+	t.maxX = std::min(softDepthWidth - 1, static_cast<int>(std::ceil(maxX)));
+	t.minY = std::max(0, static_cast<int>(std::floor(minY)));
+	t.maxY = std::min(softDepthHeight - 1, static_cast<int>(std::ceil(maxY)));
+	return t.minX <= t.maxX && t.minY <= t.maxY;
+}
+
+static void rasterizeRowsScalar(float* depth, const TriangleSetup& t, int y0, int y1) {
+	for (int y = y0; y <= y1; ++y) {
+		float fy = y + 0.5f;
+		float* row = depth + y * softDepthWidth;
+		for (int x = t.minX; x <= t.maxX; ++x) {
+			float fx = x + 0.5f;
+			bool inside = true;
+			for (int e = 0; e < 3; ++e) {
+				inside = inside && t.edgeA[e] * fx + t.edgeB[e] * fy + t.edgeC[e] >= 0.f;
+			}
+			if (inside) {
+				row[x] = std::min(row[x], t.depthA * fx + t.depthB * fy + t.depthC);
+			}
+		}
+	}
+}
+
+#if SOFT_OCCLUSION_X86
+__attribute__((target("avx2,fma")))
+static void rasterizeRowsAVX2(float* depth, const TriangleSetup& t, int y0, int y1) {
+	const __m256 lanes = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+	int startX = t.minX & ~7;
+	for (int y = y0; y <= y1; ++y) {
+		float fy = y + 0.5f;
+		float* row = depth + y * softDepthWidth;
+		// Row constant parts of the planes.
+		__m256 rowEdge0 = _mm256_set1_ps(t.edgeB[0] * fy + t.edgeC[0]);
+		__m256 rowEdge1 = _mm256_set1_ps(t.edgeB[1] * fy + t.edgeC[1]);
+		__m256 rowEdge2 = _mm256_set1_ps(t.edgeB[2] * fy + t.edgeC[2]);
+		__m256 rowDepth = _mm256_set1_ps(t.depthB * fy + t.depthC);
+		for (int x = startX; x <= t.maxX; x += 8) {
+			__m256 fx = _mm256_add_ps(_mm256_set1_ps(static_cast<float>(x)), lanes);
+			__m256 e0 = _mm256_fmadd_ps(_mm256_set1_ps(t.edgeA[0]), fx, rowEdge0);
+			__m256 e1 = _mm256_fmadd_ps(_mm256_set1_ps(t.edgeA[1]), fx, rowEdge1);
+			__m256 e2 = _mm256_fmadd_ps(_mm256_set1_ps(t.edgeA[2]), fx, rowEdge2);
+			// The sign bit of the OR is set where any edge is negative, outside the triangle.
+			__m256 outside = _mm256_or_ps(_mm256_or_ps(e0, e1), e2);
+			__m256 z = _mm256_fmadd_ps(_mm256_set1_ps(t.depthA), fx, rowDepth);
+			__m256 old = _mm256_loadu_ps(row + x);
+			_mm256_storeu_ps(row + x, _mm256_blendv_ps(_mm256_min_ps(old, z), old, outside));
+		}
+	}
+}
+#endif
+
+static void updateBlockMax(SoftOcclusion& so, int blockY) {
+	for (int bx = 0; bx < blocksX; ++bx) {
+		float farthest = 0.f;
+		for (int y = blockY * softBlockSize; y < (blockY + 1) * softBlockSize; ++y) {
+			const float* row = &so.depth[static_cast<size_t>(y * softDepthWidth + bx * softBlockSize)];
+			for (int x = 0; x < softBlockSize; ++x) {
+				farthest = std::max(farthest, row[x]);
+			}
+		}
+		so.blockMaxDepth[static_cast<size_t>(blockY * blocksX + bx)] = farthest;
+	}
+}
+
+void rasterizeOccluders(SoftOcclusion& so, const glm::mat4& viewProj, const glm::vec3& cameraPos) {
+	Clock::time_point start = Clock::now();
+	so.viewProj = viewProj;
+	so.stats = SoftOcclusionStats();
+	so.depth.assign(static_cast<size_t>(softDepthWidth * softDepthHeight), 1.f);
+	so.blockMaxDepth.assign(static_cast<size_t>(blocksX * blocksY), 1.f);
+
+	so.order.resize(so.occluders.size());
+	for (size_t i = 0; i < so.order.size(); ++i) {
+		so.order[i] = i;
+	}
+	size_t count = std::min(so.maxOccluders, so.order.size());
+	auto nearer = [&](size_t lhs, size_t rhs) {
+		glm::vec3 l = so.occluders[lhs].center - cameraPos;
+		glm::vec3 r = so.occluders[rhs].center - cameraPos;
+		return glm::dot(l, l) < glm::dot(r, r);
+	};
+	std::partial_sort(so.order.begin(), so.order.begin() + static_cast<std::ptrdiff_t>(count), so.order.end(), nearer);
+	so.order.resize(count);
+
+	so.screenVertices.resize(so.vertices.size());
+	for (size_t o : so.order) {
+		const SoftOccluder& occluder = so.occluders[o];
+		for (size_t i = occluder.firstVertex; i < occluder.firstVertex + occluder.vertexCount; ++i) {
+			so.screenVertices[i] = toScreen(viewProj, so.vertices[i]);
+		}
+		so.stats.triangles += static_cast<int>(occluder.vertexCount / 3);
+	}
+	so.stats.occluders = static_cast<int>(count);
+
+#if SOFT_OCCLUSION_X86
+	bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+	std::atomic<bool> overBudget(false);
+	// Every band walks the occluders nearest first and stops once the budget is gone, which
+	// only ever leaves depth farther than it could be.
+	parallelFor(softDepthHeight / bandHeight, 1, [&](size_t begin, size_t end) {
+		for (size_t band = begin; band < end; ++band) {
+			int bandY0 = static_cast<int>(band) * bandHeight;
+			int bandY1 = bandY0 + bandHeight - 1;
+			for (size_t o : so.order) {
+				if (elapsedMs(start) > so.budgetMs) {
+					overBudget = true;
+					break;
+				}
+				const SoftOccluder& occluder = so.occluders[o];
+				for (size_t i = occluder.firstVertex; i + 2 < occluder.firstVertex + occluder.vertexCount; i += 3) {
+					TriangleSetup t;
+					if (!setupTriangle(so.screenVertices[i], so.screenVertices[i + 1], so.screenVertices[i + 2], t)) {
+						continue;
+					}
+					int y0 = std::max(t.minY, bandY0);
+					int y1 = std::min(t.maxY, bandY1);
+					if (y0 > y1) {
+						continue;
+					}
+#if SOFT_OCCLUSION_X86
+					if (avx2) {
+						rasterizeRowsAVX2(so.depth.data(), t, y0, y1);
+						continue;
+					}
+#endif
+					rasterizeRowsScalar(so.depth.data(), t, y0, y1);
+				}
+			}
+			for (int blockY = bandY0 / softBlockSize; blockY <= bandY1 / softBlockSize; ++blockY) {
+				updateBlockMax(so, blockY);
+			}
+		}
+	});
+	so.stats.overBudget = overBudget;
+	so.stats.rasterMs = elapsedMs(start);
+}
+
+// True when the box is certainly behind the rasterized occluders.
+static bool boxOccluded(const SoftOcclusion& so, const glm::vec3& center, const glm::vec3& extent) {
+	float minX = 1e30f, maxX = -1e30f, minY = 1e30f, maxY = -1e30f, minZ = 1e30f;
+	for (int i = 0; i < 8; ++i) {
+		glm::vec3 corner(
+			center.x + ((i & 1) ? extent.x : -extent.x),
+			center.y + ((i & 2) ? extent.y : -extent.y),
+			center.z + ((i & 4) ? extent.z : -extent.z));
+		glm::vec4 p = toScreen(so.viewProj, corner);
+		if (p.w <= 0.f) {
+			// Reaches behind the near plane, the camera may well see it.
+			return false;
+		}
+		minX = std::min(minX, p.x);
+		maxX = std::max(maxX, p.x);
+		minY = std::min(minY, p.y);
+		maxY = std::max(maxY, p.y);
+		minZ = std::min(minZ, p.z);
+	}
+
+	int bx0 = std::max(0, static_cast<int>(std::floor(minX)) / softBlockSize);
+	int bx1 = std::min(blocksX - 1, static_cast<int>(std::ceil(maxX)) / softBlockSize);
+	int by0 = std::max(0, static_cast<int>(std::floor(minY)) / softBlockSize);
+	int by1 = std::min(blocksY - 1, static_cast<int>(std::ceil(maxY)) / softBlockSize);
+	if (bx0 > bx1 || by0 > by1) {
+		// Off screen, frustum culling is in charge of that.
+		return false;
+	}
+	for (int by = by0; by <= by1; ++by) {
+		for (int bx = bx0; bx <= bx1; ++bx) {
+			if (so.blockMaxDepth[static_cast<size_t>(by * blocksX + bx)] + occludedEpsilon >= minZ) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void testSoftOcclusion(SoftOcclusion& so, CullingSet& set) {
+	Clock::time_point start = Clock::now();
+	float budgetLeft = so.budgetMs - so.stats.rasterMs - so.stats.testMs;
+	std::atomic<int> tested(0);
+	std::atomic<int> occluded(0);
+	std::atomic<bool> overBudget(false);
+
+	parallelFor(set.count, testGrain, [&](size_t begin, size_t end) {
+		int localTested = 0;
+		int localOccluded = 0;
+		for (size_t i = begin; i < end; ++i) {
+			if ((i - begin) % budgetCheckInterval == 0 && elapsedMs(start) > budgetLeft) {
+				overBudget = true;
+				break;
+			}
+			if (!set.visible[i]) {
+				continue;
+			}
+			++localTested;
+			glm::vec3 center(set.centerX[i], set.centerY[i], set.centerZ[i]);
+			glm::vec3 extent(set.extentX[i], set.extentY[i], set.extentZ[i]);
+			if (boxOccluded(so, center, extent)) {
+				set.visible[i] = 0;
+				++localOccluded;
+			}
+		}
+		tested += localTested;
+		occluded += localOccluded;
+	});
+
+	so.stats.tested += tested;
+	so.stats.occluded += occluded;
+	so.stats.overBudget = so.stats.overBudget || overBudget;
+	so.stats.testMs += elapsedMs(start);
+	set.visibleCount -= occluded;
+}
+
+void validateSoftOcclusion(const SoftOcclusion& so, int framebufferWidth, int framebufferHeight) {
+	std::vector<float> gpuDepth(static_cast<size_t>(framebufferWidth * framebufferHeight));
+	glReadPixels(0, 0, framebufferWidth, framebufferHeight, GL_DEPTH_COMPONENT, GL_FLOAT, gpuDepth.data());
+
+	int covered = 0;
+	int wrong = 0;
+	float worst = 0.f;
+	for (int y = 0; y < softDepthHeight; ++y) {
+		for (int x = 0; x < softDepthWidth; ++x) {
+			float cpu = so.depth[static_cast<size_t>(y * softDepthWidth + x)];
+			if (cpu >= 1.f) {
+				continue;
+			}
+			++covered;
+			// The GPU pixel under the center of the CPU one, which is where it was sampled.
+			int gx = std::min(framebufferWidth - 1, static_cast<int>((x + 0.5f) * framebufferWidth / softDepthWidth));
+			int gy = std::min(framebufferHeight - 1, static_cast<int>((y + 0.5f) * framebufferHeight / softDepthHeight));
+			float gpu = gpuDepth[static_cast<size_t>(gy * framebufferWidth + gx)];
+			if (cpu < gpu - validateEpsilon) {
+				++wrong;
+				worst = std::max(worst, gpu - cpu);
+			}
+		}
+	}
+	printf("Software occlusion check: %d of %d covered pixels nearer than the GPU depth (worst by %.4f).\n",
+		wrong, covered, worst);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "culling.h"
+
+#include <glm/glm.hpp>
+
+// CPU occlusion culling. A few nearby occluders, simplified to solid boxes or small triangle
+// lists, are rasterized into a low resolution depth buffer (AVX2, eight pixels at a time, in
+// bands of rows spread over the job workers). The farthest depth of every 8x8 block is kept,
+// and an object is hidden when the nearest point of its box lies behind that depth everywhere
+// it covers. Unlike hardware queries the answer is there in the same frame, before anything is
+// sent to GL. Occluders crossing the near plane are skipped and pixels are sampled at their
+// centers, so results are conservative up to subpixel edges; validateSoftOcclusion checks that.
+const int softDepthWidth = 256;
+const int softDepthHeight = 192;
+const int softBlockSize = 8;
+
+struct SoftOccluder {
+	size_t firstVertex;
+	size_t vertexCount;
+	glm::vec3 center;
+};
+
+struct SoftOcclusionStats {
+	int occluders = 0;
+	int triangles = 0;
+	int tested = 0;
+	int occluded = 0;
+	float rasterMs = 0.f;
+	float testMs = 0.f;
+	// The budget ran out, some occluders were left out or some objects left untested.
+	bool overBudget = false;
+};
+
+struct SoftOcclusion {
+	// Nearest first, at most this many occluders are rasterized each frame.
+	size_t maxOccluders = 256;
+	// Time for rasterizing and testing together. Whatever does not fit is treated as visible.
+	float budgetMs = 1.f;
+
+	// World space triangles, three vertices each, grouped by occluder. Set up once.
+	std::vector<glm::vec3> vertices;
+	std::vector<SoftOccluder> occluders;
+
+	// Per frame.
+	std::vector<float> depth;
+	std::vector<float> blockMaxDepth;
+	glm::mat4 viewProj;
+	SoftOcclusionStats stats;
+
+	// Scratch space.
+	std::vector<glm::vec4> screenVertices;
+	std::vector<size_t> order;
+};
+
+void addOccluderBox(SoftOcclusion& so, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+void addOccluderTriangles(SoftOcclusion& so, const std::vector<glm::vec3>& triangles, const glm::mat4& model);
+
+// Clears the depth buffer and rasterizes the nearest occluders seen from the camera.
+void rasterizeOccluders(SoftOcclusion& so, const glm::mat4& viewProj, const glm::vec3& cameraPos);
+// Clears CullingSet::visible for boxes hidden behind the occluders, boxes already culled are skipped.
+// May be called for several sets after one rasterizeOccluders, they share the budget and the stats.
+void testSoftOcclusion(SoftOcclusion& so, CullingSet& set);
+
+// Debug check against the depth buffer of the framebuffer, which must hold the frame's opaque
+// geometry. Counts pixels where the CPU depth is nearer than the GPU one, where objects could be
+// hidden that are not. Reads the depth back, so it stalls the pipeline.
+void validateSoftOcclusion(const SoftOcclusion& so, int framebufferWidth, int framebufferHeight);
@@ -0,0 +1,120 @@
+#include "staticbatch.h"
+#include "vertexpulling.h"
+
+#include <cfloat>
+
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+void addStaticObject(StaticBatch& batch, const std::vector<float>& vertices, const glm::mat4& model, uint16_t material) {
+	batch.objects.push_back({&vertices, model, material});
+}
+
+struct ChunkData {
+	std::vector<float> vertices;
+	glm::vec3 boundsMin = glm::vec3(FLT_MAX);
+	glm::vec3 boundsMax = glm::vec3(-FLT_MAX);
+	float objectRadius = 0.f;
+};
+
+static glm::vec3 transformPoint(const glm::mat4& m, const float* p) {
+	return glm::vec3(m * glm::vec4(p[0], p[1], p[2], 1.f));
+}
+
+static glm::vec3 transformDirection(const glm::mat3& m, const float* d) {
+	return m * glm::vec3(d[0], d[1], d[2]);
+}
+
+static void appendVec3(std::vector<float>& out, const glm::vec3& v) {
+	out.push_back(v.x);
+	out.push_back(v.y);
+	out.push_back(v.z);
+}
+
+void buildStaticBatch(StaticBatch& batch, GeometryArena& arena) {
+	// Ordered, so the chunks come out the same way every run.
+	typedef std::tuple<uint16_t, int, int, int> ChunkKey;
+	std::map<ChunkKey, ChunkData> chunks;
+
+	for (const StaticObject& object : batch.objects) {
+		const std::vector<float>& src = *object.vertices;
+		size_t numVertices = src.size() / standardVertexFloats;
+		if (numVertices == 0) {
+			continue;
+		}
+
+		// The whole object goes to the chunk of its center, objects are never split.
+		glm::vec3 objectMin(FLT_MAX);
+		glm::vec3 objectMax(-FLT_MAX);
+		for (size_t i = 0; i < numVertices; ++i) {
+			glm::vec3 p = transformPoint(object.model, &src[i * standardVertexFloats]);
+			objectMin = glm::min(objectMin, p);
+			objectMax = glm::max(objectMax, p);
+		}
+		glm::vec3 cell = glm::floor((objectMin + objectMax) * 0.5f / batch.chunkSize);
+		ChunkKey key(object.material, static_cast<int>(cell.x), static_cast<int>(cell.y), static_cast<int>(cell.z));
+		ChunkData& chunk = chunks[key];
+		chunk.boundsMin = glm::min(chunk.boundsMin, objectMin);
+		chunk.boundsMax = glm::max(chunk.boundsMax, objectMax);
+		chunk.objectRadius = std::max(chunk.objectRadius, glm::length(objectMax - objectMin) * 0.5f);
+
+		// Tangent frame vectors follow the model, normals its inverse transpose.
+		glm::mat3 tangentMatrix(object.model);
+		glm::mat3 normalMatrix = glm::transpose(glm::inverse(tangentMatrix));
+		std::vector<float>& out = chunk.vertices;
+		out.reserve(out.size() + src.size());
+		for (size_t i = 0; i < numVertices; ++i) {
+			const float* v = &src[i * standardVertexFloats];
+			appendVec3(out, transformPoint(object.model, v));
+			out.push_back(v[3]);
+			out.push_back(v[4]);
+			appendVec3(out, glm::normalize(transformDirection(normalMatrix, v + 5)));
+			appendVec3(out, transformDirection(tangentMatrix, v + 8));
+			appendVec3(out, transformDirection(tangentMatrix, v + 11));
+		}
+	}
+
+	for (auto& it : chunks) {
+		ChunkData& data = it.second;
+		StaticChunk chunk;
+		chunk.material = std::get<0>(it.first);
+		chunk.mesh = addArenaMesh(arena, data.vertices.data(), data.vertices.size() / standardVertexFloats);
+		chunk.boundsMin = data.boundsMin;
+		chunk.boundsMax = data.boundsMax;
+		chunk.objectRadius = data.objectRadius;
+		batch.chunks.push_back(chunk);
+	}
+	batch.objects.clear();
+}
+
+void deleteStaticBatch(StaticBatch& batch, GeometryArena& arena) {
+	for (const StaticChunk& chunk : batch.chunks) {
+		removeArenaMesh(arena, chunk.mesh);
+	}
+	batch.chunks.clear();
+}
+
+void submitStaticBatch(RenderQueue& queue, const StaticBatch& batch, const GeometryArena& arena,
+	unsigned program, const glm::mat4& view, const glm::mat4& viewProj, const uint8_t* visible,
+	const unsigned* conditions, bool pulled, const unsigned* chunkPrograms) {
+	if (batch.chunks.empty()) {
+		return;
+	}
+
+	uint32_t object = addObjectData(queue, {glm::mat4(1.f), viewProj});
+	for (size_t i = 0; i < batch.chunks.size(); ++i) {
+		if (visible && !visible[i]) {
+			continue;
+		}
+		const StaticChunk& chunk = batch.chunks[i];
+		unsigned chunkProgram = chunkPrograms ? chunkPrograms[i] : program;
+		DrawPacket packet = pulled ? makePulledDrawPacket(arena, chunk.mesh, chunkProgram, chunk.material, GL_TRIANGLES)
+			: makeDrawPacket(arena, chunk.mesh, chunkProgram, chunk.material, GL_TRIANGLES);
+		packet.object = object;
+		packet.condition = conditions ? conditions[i] : 0;
+		RenderPass pass = packet.condition ? RENDER_PASS_OCCLUSION_TESTED : RENDER_PASS_OPAQUE;
+		glm::vec3 center = (chunk.boundsMin + chunk.boundsMax) * 0.5f;
+		submitDraw(queue, pass, packet, -(view * glm::vec4(center, 1.f)).z);
+	}
+}
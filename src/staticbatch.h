@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "geometry.h"
+#include "renderqueue.h"
+
+#include <glm/glm.hpp>
+
+// Scenery that never moves, merged at load time into a few large meshes already in world space.
+// Objects are grouped by material and by the chunk of a regular grid their center falls in, so
+// each chunk of a material is one mesh that can still be culled on its own. Larger chunks mean
+// fewer draws, smaller ones tighter culling.
+struct StaticObject {
+	// Standard format vertices, as parseObjectFile produces them. Must outlive buildStaticBatch.
+	const std::vector<float>* vertices;
+	glm::mat4 model;
+	uint16_t material;
+};
+
+struct StaticChunk {
+	uint16_t material;
+	int mesh;
+	// World space bounds of everything merged into the chunk.
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+	// Of the bounding sphere of the largest object merged into the chunk. How large the chunk's
+	// objects get on screen, for shading LOD.
+	float objectRadius;
+};
+
+struct StaticBatch {
+	float chunkSize = 16.f;
+	std::vector<StaticObject> objects;
+	// Filled by buildStaticBatch.
+	std::vector<StaticChunk> chunks;
+};
+
+void addStaticObject(StaticBatch& batch, const std::vector<float>& vertices, const glm::mat4& model, uint16_t material);
+// Transforms and merges the objects into meshes in the arena, which must use VERTEX_FORMAT_STANDARD.
+// The object list is cleared, it is not needed anymore.
+void buildStaticBatch(StaticBatch& batch, GeometryArena& arena);
+void deleteStaticBatch(StaticBatch& batch, GeometryArena& arena);
+
+// Submits the chunks with the program, all of them or those with a non-zero entry in visible.
+// They share one identity object data slot, so chunks of the same material end up in a single multi-draw.
+// A chunk with a non-zero entry in conditions is drawn conditional on that occlusion query instead.
+// With pulled set the program is a VERTEX_PULLING one, see vertexpulling.h.
+// chunkPrograms, when given, holds a program per chunk drawn with instead, see shadinglod.h.
+void submitStaticBatch(RenderQueue& queue, const StaticBatch& batch, const GeometryArena& arena,
+	unsigned program, const glm::mat4& view, const glm::mat4& viewProj, const uint8_t* visible = nullptr,
+	const unsigned* conditions = nullptr, bool pulled = false, const unsigned* chunkPrograms = nullptr);
@@ -0,0 +1,194 @@
+#include "uniforms.h"
+#include "blocks.h"
+#include "clusteredlighting.h"
+#include "glstate.h"
+
+#include <cstring>
+
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+
+#include <glm/gtc/type_ptr.hpp>
+
+static std::unordered_map<unsigned, UniformTable> uniformTables;
+
+static unsigned uniformTypeSize(GLenum type) {
+	switch (type) {
+	case GL_FLOAT: return 4;
+	case GL_FLOAT_VEC2: return 8;
+	case GL_FLOAT_VEC3: return 12;
+	case GL_FLOAT_VEC4: return 16;
+	case GL_FLOAT_MAT3: return 36;
+	case GL_FLOAT_MAT4: return 64;
+	default: return 16; // ints, bools, samplers and anything wider we do not set yet
+	}
+}
+
+static bool isFloatType(GLenum type) {
+	switch (type) {
+	case GL_FLOAT:
+	case GL_FLOAT_VEC2:
+	case GL_FLOAT_VEC3:
+	case GL_FLOAT_VEC4:
+	case GL_FLOAT_MAT2:
+	case GL_FLOAT_MAT3:
+	case GL_FLOAT_MAT4:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void reflectUniforms(UniformTable& table) {
+	int numUniforms = 0;
+	glGetProgramiv(table.program, GL_ACTIVE_UNIFORMS, &numUniforms);
+	int maxLength = 0;
+	glGetProgramiv(table.program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+	std::vector<char> name(static_cast<size_t>(maxLength) + 1);
+
+	unsigned offset = 0;
+	std::vector<std::pair<uint64_t, int>> samplerUnits;
+	for (int i = 0; i < numUniforms; ++i) {
+		int count = 0;
+		GLenum type = 0;
+		GLsizei length = 0;
+		glGetActiveUniform(table.program, static_cast<unsigned>(i), maxLength, &length, &count, &type, name.data());
+		int location = glGetUniformLocation(table.program, name.data());
+		if (location < 0) {
+			// Part of a uniform block, not set through glUniform*.
+			continue;
+		}
+		// Arrays are reported as "name[0]", but set by their plain name.
+		char* bracket = strchr(name.data(), '[');
+		if (bracket) {
+			*bracket = '\0';
+			length = static_cast<GLsizei>(bracket - name.data());
+		}
+
+		UniformSlot slot;
+		slot.name = contentHash(name.data(), static_cast<size_t>(length));
+		slot.location = location;
+		slot.type = type;
+		slot.count = count;
+		slot.offset = offset;
+		slot.size = uniformTypeSize(type) * static_cast<unsigned>(count);
+		slot.valid = false;
+		table.slots.push_back(slot);
+		offset += slot.size;
+		int unit = clusterSamplerUnit(name.data());
+		if (unit >= 0) {
+			samplerUnits.emplace_back(slot.name, unit);
+		}
+	}
+
+	// GLSL 330 has no layout(binding = N), so the shared blocks are assigned their binding points here.
+	int numBlocks = 0;
+	glGetProgramiv(table.program, GL_ACTIVE_UNIFORM_BLOCKS, &numBlocks);
+	for (int i = 0; i < numBlocks; ++i) {
+		char blockName[64];
+		glGetActiveUniformBlockName(table.program, static_cast<unsigned>(i), sizeof(blockName), NULL, blockName);
+		int binding = uniformBlockBinding(blockName);
+		if (binding >= 0) {
+			glUniformBlockBinding(table.program, static_cast<unsigned>(i), static_cast<unsigned>(binding));
+		}
+	}
+
+	std::sort(table.slots.begin(), table.slots.end(), [](const UniformSlot& lhs, const UniformSlot& rhs) {
+		return lhs.name < rhs.name;
+	});
+	table.shadow.resize(offset);
+
+	// Samplers of textures that stay on fixed units, set once here instead of before every draw.
+	if (!samplerUnits.empty()) {
+		useProgram(table.program);
+		for (const auto& sampler : samplerUnits) {
+			setUniform(table, sampler.first, sampler.second);
+		}
+	}
+}
+
+UniformTable& programUniforms(unsigned program) {
+	auto it = uniformTables.find(program);
+	if (it != uniformTables.end()) {
+		return it->second;
+	}
+
+	UniformTable& table = uniformTables[program];
+	table.program = program;
+	reflectUniforms(table);
+	return table;
+}
+
+void forgetProgramUniforms(unsigned program) {
+	uniformTables.erase(program);
+}
+
+static UniformSlot* findSlot(UniformTable& table, uint64_t name, bool floatType) {
+	auto it = std::lower_bound(table.slots.begin(), table.slots.end(), name, [](const UniformSlot& slot, uint64_t name) {
+		return slot.name < name;
+	});
+	if (it == table.slots.end() || it->name != name || isFloatType(it->type) != floatType) {
+		return nullptr;
+	}
+	return &*it;
+}
+
+// Returns true if the value differs from what GL already has.
+static bool updateShadow(UniformTable& table, UniformSlot& slot, const void* data, unsigned size) {
+	unsigned char* shadow = &table.shadow[slot.offset];
+	size = std::min(size, slot.size);
+	if (slot.valid && memcmp(shadow, data, size) == 0) {
+		return false;
+	}
+	memcpy(shadow, data, size);
+	slot.valid = true;
+	return true;
+}
+
+void setUniform(UniformTable& table, uint64_t name, const glm::mat4& m) {
+	UniformSlot* slot = findSlot(table, name, true);
+	if (slot && updateShadow(table, *slot, glm::value_ptr(m), sizeof(m))) {
+		glUniformMatrix4fv(slot->location, 1, GL_FALSE, glm::value_ptr(m));
+	}
+}
+
+void setUniform(UniformTable& table, uint64_t name, const glm::vec3& v) {
+	setUniform(table, name, &v, 1);
+}
+
+void setUniform(UniformTable& table, uint64_t name, const glm::vec3* v, int count) {
+	UniformSlot* slot = findSlot(table, name, true);
+	if (!slot) {
+		return;
+	}
+	count = std::min(count, slot->count);
+	if (updateShadow(table, *slot, v, static_cast<unsigned>(count) * sizeof(glm::vec3))) {
+		glUniform3fv(slot->location, count, glm::value_ptr(v[0]));
+	}
+}
+
+void setUniform(UniformTable& table, uint64_t name, const glm::vec4* v, int count) {
+	UniformSlot* slot = findSlot(table, name, true);
+	if (!slot) {
+		return;
+	}
+	count = std::min(count, slot->count);
+	if (updateShadow(table, *slot, v, static_cast<unsigned>(count) * sizeof(glm::vec4))) {
+		glUniform4fv(slot->location, count, glm::value_ptr(v[0]));
+	}
+}
+
+void setUniform(UniformTable& table, uint64_t name, float f) {
+	UniformSlot* slot = findSlot(table, name, true);
+	if (slot && updateShadow(table, *slot, &f, sizeof(f))) {
+		glUniform1f(slot->location, f);
+	}
+}
+
+void setUniform(UniformTable& table, uint64_t name, int i) {
+	UniformSlot* slot = findSlot(table, name, false);
+	if (slot && updateShadow(table, *slot, &i, sizeof(i))) {
+		glUniform1i(slot->location, i);
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#include "../include/glad/glad.h"
+#include "embed.h"
+
+#include <glm/glm.hpp>
+
+// Hash of a uniform name, forced to be computed at compile time: UNIFORM("proj").
+#define UNIFORM(name) (std::integral_constant<uint64_t, contentHash(name, sizeof(name) - 1)>::value)
+
+struct UniformSlot {
+	uint64_t name;
+	int location;
+	GLenum type;
+	// Number of array elements, 1 for plain uniforms.
+	int count;
+	// Where the last value sent to GL is kept in UniformTable::shadow.
+	unsigned offset;
+	unsigned size;
+	bool valid;
+};
+
+// The active uniforms of one program, reflected once after it is linked. Setters compare
+// against a shadow copy of what was last sent and only call glUniform* on a change.
+struct UniformTable {
+	unsigned program = 0;
+	// Sorted by name hash.
+	std::vector<UniformSlot> slots;
+	std::vector<unsigned char> shadow;
+};
+
+// Reflected on first use and kept until forgetProgramUniforms. This is also where the
+// program's FrameData/ObjectData blocks get their binding points and its cluster samplers their
+// units, which makes a program with those current.
+UniformTable& programUniforms(unsigned program);
+// Must be called before a program is deleted, GL recycles the names.
+void forgetProgramUniforms(unsigned program);
+
+// The table's program must be the current one. Uniforms the program does not have are ignored,
+// like glUniform* does with location -1.
+void setUniform(UniformTable& table, uint64_t name, const glm::mat4& m);
+void setUniform(UniformTable& table, uint64_t name, const glm::vec3& v);
+void setUniform(UniformTable& table, uint64_t name, const glm::vec3* v, int count);
+void setUniform(UniformTable& table, uint64_t name, const glm::vec4* v, int count);
+void setUniform(UniformTable& table, uint64_t name, float f);
+// Ints, bools and sampler units.
+void setUniform(UniformTable& table, uint64_t name, int i);
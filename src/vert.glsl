@@ -1,27 +1,225 @@
 #version 330
 
+#ifndef NORMAL_MAPPING
+#define NORMAL_MAPPING 1
+#endif
+#ifndef PACKED_VERTICES
+#define PACKED_VERTICES 0
+#endif
+#ifndef INSTANCED
+#define INSTANCED 0
+#endif
+#ifndef VERTEX_PULLING
+#define VERTEX_PULLING 0
+#endif
+#ifndef DEPTH_ONLY
+#define DEPTH_ONLY 0
+#endif
+#ifndef LIGHT_COUNT
+#define LIGHT_COUNT 1
+#endif
+#ifndef VERTEX_LIGHTING
+#define VERTEX_LIGHTING 0
+#endif
+#ifndef CLUSTERED_LIGHTING
+#define CLUSTERED_LIGHTING 0
+#endif
+#if CLUSTERED_LIGHTING
+// The clustered lights of a fragment are only known per fragment.
+#undef VERTEX_LIGHTING
+#define VERTEX_LIGHTING 0
+#endif
+#if VERTEX_LIGHTING
+// Diffuse only, lit per vertex.
+#undef NORMAL_MAPPING
+#define NORMAL_MAPPING 0
+#undef SPECULAR
+#define SPECULAR 0
+#endif
+#ifndef TANGENT_SPACE_LIGHTING
+#define TANGENT_SPACE_LIGHTING 0
+#endif
+#if !NORMAL_MAPPING || CLUSTERED_LIGHTING
+// Only worth it with a normal map to light in tangent space, and only for the global lights.
+#undef TANGENT_SPACE_LIGHTING
+#define TANGENT_SPACE_LIGHTING 0
+#endif
+
+// Every variant computes the position the same way, so the color pass after a depth pre-pass
+// gets exactly the depth the pre-pass wrote, see depthprepass.h.
+invariant gl_Position;
+
+#if VERTEX_PULLING
+// No attributes, the vertex is read from the arena buffers, see vertexpulling.h. The layout is
+// chosen per draw by vertexFormat, so PACKED_VERTICES does not apply.
+#undef PACKED_VERTICES
+#define PACKED_VERTICES 0
+
+// Positions, three floats each, and the rest of the vertices, see GeometryArena.
+uniform usamplerBuffer positionData;
+uniform usamplerBuffer vertexData;
+uniform usamplerBuffer indexData;
+uniform int firstIndex;
+uniform int baseVertex;
+// VertexFormat in geometry.h.
+uniform int vertexFormat;
+
+vec3 inPos;
+vec2 inTextureCoords;
+vec3 inNormal;
+vec3 inTangent;
+vec3 inBitangent;
+
+float fetchFloat(int word) {
+	return uintBitsToFloat(texelFetch(vertexData, word).r);
+}
+
+vec3 fetchVec3(int word) {
+	return vec3(fetchFloat(word), fetchFloat(word + 1), fetchFloat(word + 2));
+}
+
+// Same as GL_INT_2_10_10_10_REV, normalized.
+vec4 unpackSnorm1010102(uint v) {
+	ivec4 bits = ivec4(int(v << 22u) >> 22, int(v << 12u) >> 22, int(v << 2u) >> 22, int(v) >> 30);
+	return max(vec4(bits) / vec4(511.0, 511.0, 511.0, 1.0), -1.0);
+}
+
+void pullVertex() {
+	int vertex = baseVertex + int(texelFetch(indexData, firstIndex + gl_VertexID).r);
+	int positionWord = vertex * 3;
+	inPos = uintBitsToFloat(uvec3(texelFetch(positionData, positionWord).r,
+		texelFetch(positionData, positionWord + 1).r, texelFetch(positionData, positionWord + 2).r));
+#if DEPTH_ONLY
+	return;
+#endif
+	if (vertexFormat == 1) {
+		// PackedVertex after its position, 4 words.
+		int word = vertex * 4;
+		inTextureCoords = vec2(fetchFloat(word), fetchFloat(word + 1));
+		inNormal = unpackSnorm1010102(texelFetch(vertexData, word + 2).r).xyz;
+		vec4 tangent = unpackSnorm1010102(texelFetch(vertexData, word + 3).r);
+		inTangent = tangent.xyz;
+		inBitangent = cross(inNormal, tangent.xyz) * tangent.w;
+	} else {
+		// Standard after its position, 11 floats.
+		int word = vertex * 11;
+		inTextureCoords = vec2(fetchFloat(word), fetchFloat(word + 1));
+		inNormal = fetchVec3(word + 2);
+		inTangent = fetchVec3(word + 5);
+		inBitangent = fetchVec3(word + 8);
+	}
+}
+#elif DEPTH_ONLY
+layout (location = 0) in vec3 inPos;
+#else
 layout (location = 0) in vec3 inPos;
 layout (location = 1) in vec2 inTextureCoords;
 layout (location = 2) in vec3 inNormal;
+#if PACKED_VERTICES
+// Unit tangent, w holds the handedness of the bitangent.
+layout (location = 3) in vec4 inTangent;
+#else
 layout (location = 3) in vec3 inTangent;
 layout (location = 4) in vec3 inBitangent;
+#endif
+#endif
+
+#if INSTANCED
+// Per instance, see InstanceData in instancing.h.
+layout (location = 5) in mat4 instanceModel;
+layout (location = 9) in uint instanceMaterial;
+
+#if !DEPTH_ONLY
+flat out uint materialIndex;
+#endif
+#else
+layout (std140) uniform ObjectData {
+	mat4 model;
+	mat4 modelViewProj;
+};
+#endif
+
+#if INSTANCED || TANGENT_SPACE_LIGHTING || VERTEX_LIGHTING
+// Same as maxFrameLights in blocks.h
+#define MAX_LIGHTS 8
 
-uniform mat4 proj;
-uniform mat4 model;
-uniform mat4 view;
+layout (std140) uniform FrameData {
+	mat4 proj;
+	mat4 view;
+	vec4 cameraPos;
+	vec4 lightPos[MAX_LIGHTS];
+	vec4 clusterScale;
+};
+#endif
 
+#if !DEPTH_ONLY
 out vec3 vertexPos;
 out vec2 textureCoords;
+// World space.
 out vec3 geomNormal;
 
+#if VERTEX_LIGHTING
+// Sum of the diffuse strengths of the lights.
+out float vertexDiffuse;
+#endif
+#if TANGENT_SPACE_LIGHTING
+// From the vertex to each light and to the camera, in tangent space. Not normalized, so they
+// interpolate linearly like the positions they come from.
+out vec3 tangentLightDir[LIGHT_COUNT];
+out vec3 tangentViewDir;
+#elif NORMAL_MAPPING
+// Tangent space to world space.
 out mat3 TBN;
+#endif
+#endif
 
 void main() {
+#if VERTEX_PULLING
+	pullVertex();
+#endif
+#if INSTANCED
+	mat4 model = instanceModel;
+	mat4 modelViewProj = proj * view * instanceModel;
+#endif
+	gl_Position = modelViewProj * vec4(inPos, 1.0);
+#if !DEPTH_ONLY
+#if INSTANCED
+	materialIndex = instanceMaterial;
+#endif
 	vertexPos = vec3(model * vec4(inPos, 1.0));
 	textureCoords = inTextureCoords;
-	geomNormal = inNormal;
-	gl_Position = proj * view * model * vec4(inPos, 1.0);
+	geomNormal = mat3(model) * inNormal;
+#if VERTEX_LIGHTING
+	vec3 worldNormal = normalize(geomNormal);
+	vertexDiffuse = 0.0;
+	for (int i = 0; i < LIGHT_COUNT; ++i) {
+		vertexDiffuse += max(dot(worldNormal, normalize(lightPos[i].xyz - vertexPos)), 0.0);
+	}
+#endif
 
-	vec3 N = cross(inTangent, inBitangent);
-	TBN = mat3(inTangent, inBitangent, N);
+#if NORMAL_MAPPING
+#if PACKED_VERTICES
+	vec3 T = inTangent.xyz;
+	vec3 B = cross(inNormal, T) * inTangent.w;
+#else
+	vec3 T = inTangent;
+	vec3 B = inBitangent;
+#endif
+	vec3 N = cross(T, B);
+#if TANGENT_SPACE_LIGHTING
+	// Orthonormalized, so with a rigid model the transpose is the inverse and directions keep
+	// their lengths: normalized per fragment they give the same angles as in world space.
+	N = normalize(N);
+	T = normalize(T - N * dot(N, T));
+	B = cross(N, T);
+	mat3 worldToTangent = transpose(mat3(model) * mat3(T, B, N));
+	for (int i = 0; i < LIGHT_COUNT; ++i) {
+		tangentLightDir[i] = worldToTangent * (lightPos[i].xyz - vertexPos);
+	}
+	tangentViewDir = worldToTangent * (cameraPos.xyz - vertexPos);
+#else
+	TBN = mat3(model) * mat3(T, B, N);
+#endif
+#endif
+#endif
 }
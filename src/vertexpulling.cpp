@@ -0,0 +1,43 @@
+#include "vertexpulling.h"
+#include "glstate.h"
+
+static unsigned emptyVertexArray = 0;
+
+unsigned pullingVertexArray() {
+	if (!emptyVertexArray) {
+		glGenVertexArrays(1, &emptyVertexArray);
+	}
+	return emptyVertexArray;
+}
+
+void deleteVertexPulling() {
+	if (emptyVertexArray) {
+		deleteVertexArray(emptyVertexArray);
+		emptyVertexArray = 0;
+	}
+}
+
+DrawPacket makePulledDrawPacket(const GeometryArena& arena, int mesh, unsigned program, uint16_t material, GLenum mode) {
+	DrawPacket packet = makeDrawPacket(arena, mesh, program, material, mode);
+	packet.vao = pullingVertexArray();
+	packet.depthVao = packet.vao;
+	packet.positionTexture = arena.positionTexture;
+	packet.vertexTexture = arena.vertexTexture;
+	packet.indexTexture = arena.indexTexture;
+	packet.vertexFormat = static_cast<uint16_t>(arena.format);
+	return packet;
+}
+
+void drawPulledPacket(const DrawPacket& packet, UniformTable& uniforms) {
+	bindTexture(pulledPositionUnit, GL_TEXTURE_BUFFER, packet.positionTexture);
+	setUniform(uniforms, UNIFORM("positionData"), pulledPositionUnit);
+	bindTexture(pulledVertexUnit, GL_TEXTURE_BUFFER, packet.vertexTexture);
+	setUniform(uniforms, UNIFORM("vertexData"), pulledVertexUnit);
+	bindTexture(pulledIndexUnit, GL_TEXTURE_BUFFER, packet.indexTexture);
+	setUniform(uniforms, UNIFORM("indexData"), pulledIndexUnit);
+	setUniform(uniforms, UNIFORM("firstIndex"), packet.firstIndex);
+	setUniform(uniforms, UNIFORM("baseVertex"), packet.baseVertex);
+	setUniform(uniforms, UNIFORM("vertexFormat"), static_cast<int>(packet.vertexFormat));
+	// One vertex per index, the shader looks the index up itself.
+	glDrawArrays(packet.mode, 0, packet.indexCount);
+}
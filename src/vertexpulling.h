@@ -0,0 +1,28 @@
+#pragma once
+
+#include "geometry.h"
+#include "renderqueue.h"
+#include "uniforms.h"
+
+// Programmable vertex pulling. The VERTEX_PULLING shader variant has no vertex attributes: it
+// reads the index of gl_VertexID and then the vertex itself from buffer textures over the arena
+// buffers, both of its streams, given the first index, base vertex and VertexFormat of the draw
+// as uniforms. Pulled draws are glDrawArrays with one shared attribute-less vertex array, so
+// meshes of any arena or vertex format follow each other with no vertex array switch, only other
+// textures and uniforms.
+// The price: attributes go through texture fetches, draws cannot be merged into multi-draws,
+// and with GL seeing no indices the post-transform cache does not help anymore.
+// Texture units the VERTEX_PULLING shaders read from, above the material textures.
+const int pulledVertexUnit = 4;
+const int pulledIndexUnit = 5;
+const int pulledPositionUnit = 6;
+
+// The vertex array pulled draws are issued with. It has no attributes, but core profiles need
+// one bound to draw anything.
+unsigned pullingVertexArray();
+void deleteVertexPulling();
+
+// Like makeDrawPacket, for the VERTEX_PULLING variant. The arena needs enableVertexPulling.
+DrawPacket makePulledDrawPacket(const GeometryArena& arena, int mesh, unsigned program, uint16_t material, GLenum mode);
+// Binds the textures of the packet, sets its uniforms and draws it. The program must be current.
+void drawPulledPacket(const DrawPacket& packet, UniformTable& uniforms);